@@ -0,0 +1,96 @@
+/*
+* End-to-end command throughput benchmark
+*
+* Writes a script of N '/bin/true' commands and times the techshell
+* binary running it in batch mode, once per launch mode, giving
+* commands/sec for the whole read, parse, launch and wait loop. The path
+* is spelled out because plain 'true' is a builtin and starts no process
+*
+* Usage: e2e_bench [--json] [-n commands] [path/to/techshell]
+*/
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+#include <fcntl.h>
+#include <spawn.h>
+#include <time.h>
+#include <sys/wait.h>
+
+#define DEFAULT_COMMANDS 5000
+
+extern char** environ;
+
+
+int main(int argc, char* argv[]){
+    int commands = DEFAULT_COMMANDS;
+    int json = 0;
+    const char* shell = "./techshell";
+
+    for(int i = 1; i < argc; i++){
+        if(strcmp(argv[i], "--json") == 0){
+            json = 1;
+        }
+        else if(strcmp(argv[i], "-n") == 0 && i + 1 < argc){
+            commands = atoi(argv[++i]);
+        }
+        else{
+            shell = argv[i];
+        }
+    }
+
+    char script[] = "/tmp/techshell_e2e_XXXXXX";
+    int fd = mkstemp(script);
+    if(fd == -1){
+        perror("mkstemp failed");
+        return 1;
+    }
+    FILE* file = fdopen(fd, "w");
+    for(int i = 0; i < commands; i++){
+        fputs("/bin/true\n", file);
+    }
+    fclose(file);
+
+    const char* modes[] = { "spawn", "vfork", "fork", "zygote" };
+    if(!json){
+        printf("%-6s %10s %10s %14s\n", "mode", "commands", "seconds", "commands/sec");
+    }
+    for(int m = 0; m < 4; m++){
+        char launch[32];
+        snprintf(launch, sizeof(launch), "--launch=%s", modes[m]);
+        char* args[] = { (char*)shell, launch, script, NULL };
+
+        // Keep the shell's own output out of the results
+        posix_spawn_file_actions_t actions;
+        posix_spawn_file_actions_init(&actions);
+        posix_spawn_file_actions_addopen(&actions, STDOUT_FILENO, "/dev/null", O_WRONLY, 0);
+
+        struct timespec start, end;
+        clock_gettime(CLOCK_MONOTONIC, &start);
+        pid_t pid;
+        int err = posix_spawn(&pid, shell, &actions, NULL, args, environ);
+        posix_spawn_file_actions_destroy(&actions);
+        if(err != 0){
+            fprintf(stderr, "e2e_bench: cannot run %s: %s\n", shell, strerror(err));
+            unlink(script);
+            return 1;
+        }
+        int status;
+        waitpid(pid, &status, 0);
+        clock_gettime(CLOCK_MONOTONIC, &end);
+
+        double seconds = (end.tv_sec - start.tv_sec) + (end.tv_nsec - start.tv_nsec) / 1e9;
+        if(json){
+            printf("{\"bench\":\"e2e\",\"mode\":\"%s\",\"commands\":%d,\"seconds\":%.4f,\"commands_per_sec\":%.0f,\"status\":%d}\n",
+                   modes[m], commands, seconds, commands / seconds, WIFEXITED(status) ? WEXITSTATUS(status) : -1);
+        }
+        else{
+            printf("%-6s %10d %10.4f %14.0f\n", modes[m], commands, seconds, commands / seconds);
+        }
+        fflush(stdout);
+    }
+
+    unlink(script);
+    return 0;
+}
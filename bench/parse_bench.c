@@ -0,0 +1,228 @@
+/*
+* Parse throughput benchmark
+*
+* Measures how many command lines per second ParseCommandLine can handle,
+* next to the strtok_r + strdup tokenizer it replaced, over several line
+* shapes: short commands, many arguments, redirections, pipelines, long
+* tokens and quoting
+*
+* Usage: parse_bench [--json] [iterations]
+*   --json  one JSON object per line instead of a table, used by 'make bench'
+*/
+
+#define TECHSHELL_NO_MAIN
+#include "../techshell.c"
+
+#define DEFAULT_ITERATIONS 100000
+#define MANY_ARGS 200          // Arguments in the "many args" shape
+#define LONG_TOKEN_SIZE 2048   // Bytes per token in the "long tokens" shape
+
+// A named line shape
+typedef struct{
+    const char* name;
+    char* line;
+} BenchLine;
+
+// What the original tokenizer produced for a line
+typedef struct{
+    char** args;
+    char* inputFile;
+    char* outputFile;
+} LegacyCommand;
+
+
+/*
+ * Function: LegacyParseCommandLine
+ * --------------------------------
+ * The original tokenizer, splitting on single spaces with strtok_r and
+ * copying every token with strdup. Kept here only as the baseline
+ *
+ * Parameters:
+ *   input - The line to tokenize, it is modified in place
+ *
+ * Returns:
+ *   A LegacyCommand whose strings must be released with LegacyFree
+ */
+static LegacyCommand LegacyParseCommandLine(char* input){
+    LegacyCommand command;
+    command.inputFile = NULL;
+    command.outputFile = NULL;
+
+    int capacity = INITIAL_ARG_SIZE;
+    int count = 0;
+    command.args = (char**)malloc(capacity * sizeof(char*));
+
+    char* token;
+    char* rest = input;
+    while((token = strtok_r(rest, " ", &rest))){
+        if(strcmp(token, "<") == 0){
+            token = strtok_r(NULL, " ", &rest);
+            if(token != NULL){
+                command.inputFile = strdup(token);
+            }
+        }
+        else if(strcmp(token, ">") == 0){
+            token = strtok_r(NULL, " ", &rest);
+            if(token != NULL){
+                command.outputFile = strdup(token);
+            }
+        }
+        else{
+            if(count >= capacity - 1){
+                capacity *= 2;
+                command.args = (char**)realloc(command.args, capacity * sizeof(char*));
+            }
+            command.args[count++] = strdup(token);
+        }
+    }
+    command.args[count] = NULL;
+    return command;
+}
+
+
+/*
+ * Function: LegacyFree
+ * --------------------
+ * Releases a command returned by LegacyParseCommandLine, the way main()
+ * used to after every line
+ *
+ * Parameters:
+ *   command - The command to free
+ *
+ * Returns:
+ *   None
+ */
+static void LegacyFree(LegacyCommand command){
+    free(command.inputFile);
+    free(command.outputFile);
+    for(int i = 0; command.args[i] != NULL; i++){
+        free(command.args[i]);
+    }
+    free(command.args);
+}
+
+
+/*
+ * Function: Now
+ * -------------
+ * Reads the monotonic clock
+ *
+ * Parameters:
+ *   None
+ *
+ * Returns:
+ *   Seconds as a double
+ */
+static double Now(){
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return ts.tv_sec + ts.tv_nsec / 1e9;
+}
+
+
+/*
+ * Function: BuildLines
+ * --------------------
+ * Creates the line shapes, generating the large ones
+ *
+ * Parameters:
+ *   count - Receives the number of shapes
+ *
+ * Returns:
+ *   The shapes, allocated for the life of the program
+ */
+static BenchLine* BuildLines(int* count){
+    static BenchLine lines[] = {
+        { "short", "ls -la" },
+        { "flags", "grep -rn '--include=*.c' pattern src include tests docs tools scripts build" },
+        { "redirect", "sort -u < input.txt > output.txt" },
+        { "pipeline", "cat access.log | grep GET | cut -d ' ' -f 1 | sort | uniq -c" },
+        { "quoted", "echo \"quoted argument\" 'single quoted' escaped\\ space" },
+        { "many_args", NULL },
+        { "long_tokens", NULL },
+    };
+    int shapes = sizeof(lines) / sizeof(lines[0]);
+
+    // "cp file0 file1 ... dest"
+    char* many = (char*)malloc(MANY_ARGS * 16 + 16);
+    char* out = many + sprintf(many, "cp");
+    for(int i = 0; i < MANY_ARGS; i++){
+        out += sprintf(out, " file%d.txt", i);
+    }
+    strcpy(out, " dest");
+    lines[shapes - 2].line = many;
+
+    // Four tokens of LONG_TOKEN_SIZE bytes each
+    char* longLine = (char*)malloc(4 * (LONG_TOKEN_SIZE + 1) + 8);
+    out = longLine + sprintf(longLine, "echo");
+    for(int i = 0; i < 4; i++){
+        *out++ = ' ';
+        memset(out, 'a' + i, LONG_TOKEN_SIZE);
+        out += LONG_TOKEN_SIZE;
+    }
+    *out = '\0';
+    lines[shapes - 1].line = longLine;
+
+    *count = shapes;
+    return lines;
+}
+
+
+int main(int argc, char* argv[]){
+    long iterations = DEFAULT_ITERATIONS;
+    int json = 0;
+    for(int i = 1; i < argc; i++){
+        if(strcmp(argv[i], "--json") == 0){
+            json = 1;
+        }
+        else{
+            iterations = atol(argv[i]);
+        }
+    }
+
+    int count;
+    BenchLine* lines = BuildLines(&count);
+    size_t longest = 0;
+    for(int i = 0; i < count; i++){
+        if(strlen(lines[i].line) > longest){
+            longest = strlen(lines[i].line);
+        }
+    }
+    char* buffer = (char*)malloc(longest + 1);
+    Arena arena = { 0 };
+
+    if(!json){
+        printf("%-12s %8s %14s %14s\n", "shape", "bytes", "legacy l/s", "lexer l/s");
+    }
+    for(int i = 0; i < count; i++){
+        size_t len = strlen(lines[i].line) + 1;
+
+        // Both tokenizers write into the line, so each run gets a fresh copy
+        double start = Now();
+        for(long n = 0; n < iterations; n++){
+            memcpy(buffer, lines[i].line, len);
+            LegacyFree(LegacyParseCommandLine(buffer));
+        }
+        double legacy = iterations / (Now() - start);
+
+        start = Now();
+        for(long n = 0; n < iterations; n++){
+            memcpy(buffer, lines[i].line, len);
+            ParseCommandLine(buffer, &arena);
+            ArenaReset(&arena);
+        }
+        double lexer = iterations / (Now() - start);
+
+        if(json){
+            printf("{\"bench\":\"parse\",\"shape\":\"%s\",\"bytes\":%zu,\"parser\":\"legacy\",\"lines_per_sec\":%.0f}\n",
+                   lines[i].name, len - 1, legacy);
+            printf("{\"bench\":\"parse\",\"shape\":\"%s\",\"bytes\":%zu,\"parser\":\"lexer\",\"lines_per_sec\":%.0f}\n",
+                   lines[i].name, len - 1, lexer);
+        }
+        else{
+            printf("%-12s %8zu %14.0f %14.0f\n", lines[i].name, len - 1, legacy, lexer);
+        }
+    }
+    free(buffer);
+    return 0;
+}
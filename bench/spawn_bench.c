@@ -0,0 +1,106 @@
+/*
+* Spawn latency benchmark
+*
+* Measures how long LaunchProcess takes to start /bin/true and have it
+* reaped, for each launch mode, while the parent holds a given amount of
+* resident memory. fork() has to copy page tables for all of it,
+* vfork() and posix_spawn() should not care, and the zygote is started
+* before any of it is allocated
+*
+* Usage: spawn_bench [--json] [-n iterations] [rss_mb...]
+*   rss_mb  parent sizes to test in MB, default 0 64 256
+*/
+
+#define TECHSHELL_NO_MAIN
+#include "../techshell.c"
+
+#define DEFAULT_ITERATIONS 500
+
+
+int main(int argc, char* argv[]){
+    int iterations = DEFAULT_ITERATIONS;
+    int json = 0;
+    long sizes[16];
+    int sizeCount = 0;
+
+    for(int i = 1; i < argc; i++){
+        if(strcmp(argv[i], "--json") == 0){
+            json = 1;
+        }
+        else if(strcmp(argv[i], "-n") == 0 && i + 1 < argc){
+            iterations = atoi(argv[++i]);
+        }
+        else if(sizeCount < 16){
+            sizes[sizeCount++] = atol(argv[i]);
+        }
+    }
+    if(sizeCount == 0){
+        sizes[sizeCount++] = 0;
+        sizes[sizeCount++] = 64;
+        sizes[sizeCount++] = 256;
+    }
+    if(iterations < 1){
+        iterations = 1;
+    }
+
+    const char* path = ResolveCommand("true");
+    if(path == NULL){
+        fprintf(stderr, "spawn_bench: 'true' not found in PATH\n");
+        return 1;
+    }
+    char* args[] = { "true", NULL };
+    const char* modeNames[] = { "spawn", "vfork", "fork", "zygote" };
+    LaunchMode modes[] = { LAUNCH_SPAWN, LAUNCH_VFORK, LAUNCH_FORK, LAUNCH_ZYGOTE };
+    if(StartZygote() != 0){
+        return 1;
+    }
+    double* samples = (double*)malloc(iterations * sizeof(double));
+
+    if(!json){
+        printf("%-6s %8s %10s %10s %10s\n", "mode", "rss_mb", "mean_us", "p50_us", "p99_us");
+    }
+    for(int s = 0; s < sizeCount; s++){
+        // Touch every page so the memory is really resident
+        size_t bytes = (size_t)sizes[s] << 20;
+        char* ballast = bytes ? (char*)malloc(bytes) : NULL;
+        if(bytes && ballast == NULL){
+            fprintf(stderr, "spawn_bench: cannot allocate %ld MB\n", sizes[s]);
+            continue;
+        }
+        if(ballast){
+            memset(ballast, 1, bytes);
+        }
+
+        for(int m = 0; m < 4; m++){
+            launchMode = modes[m];
+            double total = 0;
+            for(int i = 0; i < iterations; i++){
+                struct timespec start;
+                clock_gettime(CLOCK_MONOTONIC, &start);
+                pid_t pid = LaunchProcess(path, args, environ, NULL, -1);
+                if(pid != -1){
+                    waitpid(pid, NULL, 0);
+                }
+                samples[i] = ElapsedSince(&start) * 1e6;
+                total += samples[i];
+            }
+            qsort(samples, iterations, sizeof(double), CompareDoubles);
+            double mean = total / iterations;
+            double p50 = Percentile(samples, iterations, 50);
+            double p99 = Percentile(samples, iterations, 99);
+
+            if(json){
+                printf("{\"bench\":\"spawn\",\"mode\":\"%s\",\"rss_mb\":%ld,\"iterations\":%d,"
+                       "\"mean_us\":%.1f,\"p50_us\":%.1f,\"p99_us\":%.1f}\n",
+                       modeNames[m], sizes[s], iterations, mean, p50, p99);
+            }
+            else{
+                printf("%-6s %8ld %10.1f %10.1f %10.1f\n", modeNames[m], sizes[s], mean, p50, p99);
+            }
+            fflush(stdout);
+        }
+        free(ballast);
+    }
+    free(samples);
+    return 0;
+}
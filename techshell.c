@@ -3,13 +3,15 @@
 *
 * Features:
 * - Displays a prompt with the current working directory
-* - Executes user commands using fork() and execvp()
+* - Executes user commands using posix_spawn(), vfork() or fork()
 * - Supports reading from files using <
 * - Supports writing to files using >
 * - Handles errors
 * - Exits when the user types "exit"
 */
 
+#define _GNU_SOURCE
+
 #include <stdio.h>
 #include <stdlib.h>
 #include <unistd.h>
@@ -18,298 +20,10745 @@
 #include <sys/wait.h>
 #include <fcntl.h>
 #include <errno.h>
+#include <spawn.h>
+#include <sys/stat.h>
+#include <limits.h>
+#include <sys/mman.h>
+#include <signal.h>
+#include <sys/signalfd.h>
+#include <poll.h>
+#include <termios.h>
+#include <sys/sysinfo.h>
+#include <sys/resource.h>
+#include <time.h>
+#include <math.h>
+#include <stdint.h>
+#include <ctype.h>
+#include <dirent.h>
+#include <sys/sendfile.h>
+#include <sys/file.h>
+#include <sys/ioctl.h>
+#include <sys/inotify.h>
+#include <sys/socket.h>
+#include <sys/un.h>
+#include <sys/syscall.h>
+#include <sched.h>
+
+extern char** environ;
 
-#define MAX_INPUT_SIZE 1024  // Maximum size of user input
+#define READ_BUFFER_SIZE 65536  // Bytes requested from read() at a time
+#define INITIAL_LINE_SIZE 256   // Starting size of the reusable line buffer
 #define INITIAL_ARG_SIZE 10  // Start with space for 10 arguments, expand if needed
+#define PATH_HASH_SIZE 256   // Buckets in the command lookup table
+#define ARENA_BLOCK_SIZE 8192  // Smallest block the line arena asks malloc for
+#define TRACE_CAPACITY 65536   // Events kept by the trace ring buffer, older ones are overwritten
+#define TRACE_DETAIL_SIZE 24   // Bytes of command name kept with an event
+#define BUILTIN_TABLE_SIZE 128  // Slots in the builtin perfect hash, a power of two
+#define MEMO_DEFAULT_LIMIT (256ULL << 20)  // Bytes the memo cache may hold unless TECHSHELL_MEMO_LIMIT says otherwise
+#define MEMO_TRAILER_SIZE 8                // "TSMEMO", exit status, '\n' after a cached output
+#define HISTORY_MAGIC 0x54534831u          // "TSH1", starts every history record
+#define TRIE_MAX_DIRS 63                   // $PATH directories the command trie tracks, one bit each
+#define TRIE_BUILTIN_BIT 63                // Trie bit marking builtins
+#define DIR_CACHE_SIZE 16                  // Directory listings kept for globbing and completion
+#define DIR_CACHE_RACY_NS 20000000LL       // A listing read this soon after its directory's mtime is not trusted again
+#define GETDENTS_BUFFER_SIZE (1 << 20)     // Bytes of directory entries asked for per getdents64 call
+#define COMPLETION_ASK_LIMIT 100           // Candidates listed without asking first
+#define HERE_PIPE_LIMIT 65536              // Bodies up to this size go through a pipe when it holds them
+#define HERE_EXPAND 0x1                    // The '<<' delimiter was unquoted, expand variables in the body
+#define HERE_STRIP_TABS 0x2                // '<<-', leading tabs are removed from body lines
+#define REDIRECT_FD_LIMIT 10               // Redirections name descriptors 0-9, the shell moves its own above
+#define VARIABLE_TABLE_MIN 64              // Smallest variable table, a power of two
+#define CTRL_KEY(c) ((c) & 0x1f)
+#define ROTR32(x, n) (((x) >> (n)) | ((x) << (32 - (n))))
 
-// Defines a struct to store the parsed command data
-typedef struct{
+// What a redirection does to its descriptor
+typedef enum{
+    REDIRECT_READ,        // N<file
+    REDIRECT_WRITE,       // N>file, truncating
+    REDIRECT_APPEND,      // N>>file
+    REDIRECT_READ_WRITE,  // N<>file, created if missing
+    REDIRECT_DUP,         // N>&M or N<&M, N becomes a copy of M
+    REDIRECT_CLOSE,       // N>&- or N<&-
+    REDIRECT_HERE         // N<<END or N<<<word, N reads text held by the shell
+} RedirectKind;
+
+// One redirection of a command, kept in the order written
+typedef struct Redirect{
+    RedirectKind kind;
+    int fd;              // Descriptor redirected in the command, 0-9
+    int source;          // REDIRECT_DUP: the descriptor fd becomes a copy of
+    char* path;          // File name, or the text of REDIRECT_HERE
+    size_t length;       // Bytes of REDIRECT_HERE text
+    char* hereEnd;       // Delimiter line of a '<<' body, NULL otherwise
+    int hereFlags;       // HERE_* flags of a '<<' body
+    struct Redirect* next;
+} Redirect;
+
+// Defines a struct to store the parsed command data. A pipeline is a
+// chain of these linked through next, one per stage
+typedef struct ShellCommand{
     char** args;       // Dynamically allocated array for command arguments
-    char* inputFile;   // Input redirection file
-    char* outputFile;  // Output redirection file
+    Redirect* redirects;  // Redirections in the order written, NULL if none
+    int syntaxError;   // Set when the line could not be parsed, an error has been printed
+    int background;    // Line ended in '&', only meaningful on the first stage
+    char** assignments;  // NAME=value words in front of the command, NULL terminated, or NULL
+    struct ShellCommand* next;  // Stage reading this stage's output, NULL for the last
 } ShellCommand;
 
+// One descriptor operation, applied in the child before exec
+typedef struct{
+    int fd;      // Descriptor in the child
+    int source;  // Descriptor fd becomes a copy of, or -1 to close fd
+    int opened;  // source is a file or pipe the shell opened, not one of the command's own 0-9
+} FdAction;
+
+// Everything a command's redirections and pipe ends do to its descriptors
+typedef struct{
+    FdAction* actions;  // In the order they apply, in the line arena
+    int count;
+    int* opened;        // Close-on-exec descriptors opened by the shell for the actions
+    int openedCount;
+    unsigned int redirected;  // Bit n set when descriptor n (0-9) ends up redirected
+} FdPlan;
+
+// Kinds of tokens produced by the lexer
+typedef enum{
+    TOKEN_WORD,
+    TOKEN_REDIRECT_IN,   // <, the first redirection, they stay together
+    TOKEN_REDIRECT_OUT,  // >
+    TOKEN_REDIRECT_APPEND,      // >>
+    TOKEN_REDIRECT_READ_WRITE,  // <>
+    TOKEN_REDIRECT_ALL,         // &>, stdout and stderr
+    TOKEN_REDIRECT_APPEND_ALL,  // &>>
+    TOKEN_DUP_IN,        // <&
+    TOKEN_DUP_OUT,       // >&
+    TOKEN_HERE_DOC,      // <<, its body follows on the next lines
+    TOKEN_HERE_DOC_TABS, // <<-, the same with leading tabs removed
+    TOKEN_HERE_STRING,   // <<<, the last redirection
+    TOKEN_PIPE,          // |
+    TOKEN_BACKGROUND,    // &
+    TOKEN_END,
+    TOKEN_ERROR          // Malformed input, an error has been printed
+} TokenKind;
+
+// A token is a slice of the input line, NUL terminated in place
+typedef struct{
+    TokenKind kind;
+    char* text;  // Word text for TOKEN_WORD, NULL otherwise
+    int glob;    // The word has an unquoted '*', '?' or '[', text is then a glob pattern
+    int assignment;  // The word starts with an unquoted NAME=
+    int fd;          // Descriptor written before a redirection operator, -1 if none
+} Token;
+
+// Buffered reader that returns whole lines of any length
+typedef struct{
+    int fd;           // Descriptor lines are read from
+    char* buffer;     // Raw bytes read but not yet consumed
+    size_t start;     // First unconsumed byte in buffer
+    size_t end;       // One past the last valid byte in buffer
+    char* line;       // Line buffer, grown as needed and reused for every line
+    size_t lineSize;  // Allocated size of line
+    int eof;          // Set once read() has returned 0, or the whole input is in buffer
+} LineReader;
+
+LineReader inputReader = { STDIN_FILENO, NULL, 0, 0, NULL, 0, 0 };
+
+// Pieces a prompt template is compiled into, see CompilePrompt
+typedef enum{
+    PROMPT_LITERAL,  // Fixed text, including the expanded user and host names
+    PROMPT_CWD,      // \w  full working directory
+    PROMPT_CWD_BASE, // \W  last component of the working directory
+    PROMPT_STATUS    // \?  exit status of the last command
+} PromptPieceKind;
+
+typedef struct{
+    PromptPieceKind kind;
+    char* text;     // Literal text, NULL for the dynamic kinds
+    size_t length;
+} PromptPiece;
+
+PromptPiece* promptPieces = NULL;  // Compiled once at startup
+int promptPieceCount = 0;
+char* promptBuffer = NULL;         // Rendered prompt, reused for every line
+size_t promptBufferSize = 0;
+
+char* cachedCwd = NULL;  // Working directory, only refreshed when cd succeeds
+size_t cachedCwdLength = 0;
+
+int interactive = 0;  // Reading from a terminal, so prompts are shown
+int pipefail = 0;     // 'set -o pipefail': a pipeline fails if any stage fails
+
+// States a job moves through, see ReapChildren
+typedef enum{
+    JOB_RUNNING,
+    JOB_STOPPED,
+    JOB_DONE
+} JobState;
+
+// Resources used by a command, summed over its stages by wait4()
+typedef struct{
+    double wall;    // Seconds from starting the first stage to the last one exiting
+    double user;    // User CPU seconds
+    double sys;     // System CPU seconds
+    long maxRss;    // Peak resident set size of the largest stage, in KB
+    long voluntarySwitches;
+    long involuntarySwitches;
+} CommandUsage;
+
+// A pipeline the shell has started, kept in the job table while it is
+// in the background or stopped. The pids, statuses and text share the
+// job's allocation
+typedef struct{
+    int id;            // Number shown as [n] and used as %n
+    pid_t pgid;        // Process group of every stage, -1 without job control
+    pid_t* pids;       // One per stage, -1 for stages that never started
+    int* statuses;     // Exit status of each stage
+    int count;         // Number of stages
+    int remaining;     // Stages that have not exited yet
+    JobState state;
+    char* text;        // The command as it is shown by 'jobs'
+    struct timespec started;  // When the first stage was started
+    CommandUsage usage;       // Filled in as stages are reaped
+    int heap;          // Allocated with malloc, otherwise it lives in lineArena until the line is done
+} Job;
+
+Job** jobs = NULL;  // Job table, in the order the jobs were started
+int jobCount = 0;
+int jobCapacity = 0;
+
+int jobControl = 0;        // Interactive, so jobs get their own process groups and the terminal
+int childSignalFd = -1;    // signalfd reporting SIGCHLD, which stays blocked in the shell
+pid_t shellPgid = 0;       // The shell's process group, given the terminal back after each job
+struct termios shellTermios;  // Terminal modes restored after a foreground job
+
+CommandUsage lastUsage;  // Usage of the last foreground command, wall < 0 if it did not finish
+
+// One completed phase of the REPL loop, see TraceEnd
+typedef struct{
+    const char* name;     // Phase name, always a string literal
+    uint64_t start;       // CLOCK_MONOTONIC nanoseconds
+    uint64_t duration;    // Nanoseconds
+    char detail[TRACE_DETAIL_SIZE];  // Command name for spawn and wait, may be empty
+} TraceEvent;
+
+TraceEvent* traceEvents = NULL;  // Ring buffer, allocated only when tracing is on
+uint64_t traceCount = 0;         // Events ever recorded, the buffer holds the last TRACE_CAPACITY
+char* tracePath = NULL;          // Chrome trace JSON written here at exit
+pid_t tracePid = 0;              // Only this process writes the trace
+int lastStatus = 0;   // Exit status of the last command, the shell's own status at EOF
+
+// One block of arena memory, blocks are chained and kept between lines
+typedef struct ArenaBlock{
+    struct ArenaBlock* next;
+    size_t size;   // Usable bytes in data
+    size_t used;   // Bytes handed out since the last reset
+    char data[];
+} ArenaBlock;
+
+// Bump allocator that owns everything belonging to one command line
+typedef struct{
+    ArenaBlock* head;        // First block, reused after every reset
+    ArenaBlock* current;     // Block allocations are currently served from
+    unsigned long mallocCalls;      // Blocks ever requested from malloc
+    unsigned long lineMallocCalls;  // Blocks requested since the last reset
+    size_t lineBytes;               // Bytes handed out since the last reset
+} Arena;
+
+Arena lineArena;  // Reset in one step after each command finishes
+
+// Bytes that end a plain run inside a word: whitespace, operators, quotes,
+// '$' and glob characters. '\f' is left out, see NextToken
+#define WORD_SPECIAL_CHARS " \t\n\r\v<>|&\\'\"$*?["
+
+// Single pass lexer state over one input line
+typedef struct{
+    char* pos;           // Next unread byte
+    TokenKind pending;   // Operator that ended the previous word, or TOKEN_END
+    Arena* arena;        // Holds a word that no longer fits in place
+    char* limit;         // End of the arena copy of the current word, NULL while it is in place
+    const char* wordEnd; // End of the current word in the input, NULL until needed
+    int checked;         // The current word has been checked for needing escapes
+    int escaping;        // Quoted glob characters of the current word are written escaped
+    int quoted;          // The current word had quotes or a backslash
+    int substituted;     // A variable was expanded in the current word
+    int commandWord;     // Set by the parser while a NAME= word would be an assignment
+} Lexer;
+
+// Slot states of the variable table
+typedef enum{
+    VARIABLE_EMPTY,    // Never used, ends a probe
+    VARIABLE_USED,
+    VARIABLE_DELETED   // Unset, probes continue past it
+} VariableState;
+
+// A shell variable, kept as "NAME=value" so it can go into an environment as is
+typedef struct{
+    char* entry;          // "NAME=value", malloc'd
+    uint32_t hash;        // Hash of the name
+    uint32_t nameLength;
+    VariableState state;
+    int exported;         // Passed on to commands
+    int isSet;            // Has a value, 'export NAME' alone declares one without
+} Variable;
+
+// Open-addressing table of every variable, with linear probing
+typedef struct{
+    Variable* slots;
+    size_t capacity;     // A power of two
+    size_t count;        // Variables in use
+    size_t used;         // Slots in use or deleted, what probing has to walk past
+    char** environment;  // Exported entries handed to new processes
+    int dirty;           // An exported variable changed since environment was built
+} VariableTable;
+
+VariableTable variables = { NULL, 0, 0, 0, NULL, 1 };
+unsigned long environmentRebuilds = 0;  // Times the environment array was rebuilt
+pid_t shellPid;                         // Value of $$, the same in forked copies
+
+// Strategies for starting external commands
+typedef enum{
+    LAUNCH_SPAWN,  // posix_spawn(), which glibc implements with clone(CLONE_VM|CLONE_VFORK)
+    LAUNCH_VFORK,  // vfork() + execv(), the child borrows our address space until exec
+    LAUNCH_FORK,   // fork() + execv(), copies our page tables so cost grows with RSS
+    LAUNCH_ZYGOTE  // A small helper forked at startup clones the command for us
+} LaunchMode;
+
+LaunchMode launchMode = LAUNCH_SPAWN;  // Selected with --launch=MODE or TECHSHELL_LAUNCH
+
+#define ZYGOTE_MAX_FDS 64  // Descriptors one launch request can pass to the zygote
+
+// Fixed part of a launch request sent to the zygote. It is followed by
+// actionCount FdActions, then the path, the arguments and the environment
+// as NUL terminated strings. The descriptors travel as SCM_RIGHTS: first
+// the shell's working directory, then the shell's own descriptors named
+// in inherited, then one per action whose source the shell opened, which
+// that action's source indexes
+typedef struct{
+    uint32_t bodyLength;   // Bytes after this header
+    int32_t pgid;          // Process group to join, as for LaunchProcess
+    uint32_t argCount;
+    uint32_t envCount;
+    uint32_t actionCount;
+    uint32_t inherited;    // Bit n set when the shell's descriptor n (0-9) is passed
+    uint32_t redirected;   // The plan's redirected mask
+} ZygoteRequest;
+
+// The zygote's answer to a request
+typedef struct{
+    int32_t pid;    // The command, a child of the shell, or -1
+    int32_t error;  // errno from clone or execve, 0 if the command is running
+} ZygoteReply;
+
+int zygoteFd = -1;        // Shell's end of the zygote socket, -1 when there is no zygote
+pid_t zygoteOwner = -1;   // Process that started the zygote, forked copies cannot use it
+char* zygoteBuffer = NULL;    // Body of the launch request being sent
+size_t zygoteBufferSize = 0;
+
+#define SERVER_FRAME_LIMIT (64 << 20)  // Largest frame payload --server and --client accept
+#define SERVER_QUEUE_LIMIT (256 << 10)  // Output a --server request may have waiting before its pipes stop being read
+
+// Frame types of the --server protocol. Every frame is a FrameHeader and
+// its payload. A client sends ARG, ENV, CWD and STDIN frames in any order
+// and then RUN, and can have several requests in flight on one
+// connection under different ids
+typedef enum{
+    FRAME_ARG = 1,  // One argument of the command, in order
+    FRAME_ENV,      // NAME=value, set for the command only
+    FRAME_CWD,      // Directory to run the command in
+    FRAME_STDIN,    // Bytes for the command's stdin, all of it arrives before RUN
+    FRAME_RUN,      // The request is complete, no payload
+    FRAME_STDOUT,   // Server: bytes the command wrote to stdout
+    FRAME_STDERR,   // Server: bytes it wrote to stderr
+    FRAME_EXIT      // Server: its exit status as an int32_t, the request's last frame
+} FrameType;
+
+typedef struct{
+    uint32_t type;    // A FrameType
+    uint32_t id;      // The request the frame belongs to, chosen by the client
+    uint32_t length;  // Payload bytes that follow
+} FrameHeader;
+
+// Where a --server request is in its life
+typedef enum{
+    REQUEST_READING,  // Frames are still arriving
+    REQUEST_QUEUED,   // Complete, waiting for a free slot
+    REQUEST_RUNNING,  // Started, output is being forwarded
+    REQUEST_FINISHED  // The exit status is queued, waiting for the client to take it
+} RequestState;
+
+// A --server connection. Its socket never blocks: frames are put back
+// together from whatever each read returns, and output waits in the
+// requests' queues until the socket has room
+typedef struct ServerClient{
+    int fd;
+    FrameHeader header;    // The frame being received
+    size_t headerBytes;    // Bytes of header received so far
+    char* payload;         // Its payload, allocated once the header is complete
+    size_t payloadBytes;   // Bytes of payload received so far
+    struct ServerRequest* writer;  // Request partway through sending a frame, the others wait for it
+    int waiting;           // Some request has output queued for it
+    int broken;            // Closed or broke the protocol, dropped at the end of the pass
+    struct ServerClient* next;
+} ServerClient;
+
+// A request received by --server, from its first frame until its exit
+// status has been sent
+typedef struct ServerRequest{
+    ServerClient* client;  // Connection to answer on, NULL once nobody is listening
+    uint32_t id;
+    RequestState state;
+    char** args;           // NULL terminated, malloc'd like everything here
+    int argCount;
+    char** env;            // NAME=value overrides, NULL terminated
+    int envCount;
+    char* cwd;             // NULL to run in the server's directory
+    char* input;           // The stdin payload, freed once the command has started
+    size_t inputLength;
+    size_t inputCapacity;
+    char* error;           // A bad ENV entry, reported instead of running
+    Job* job;              // The background job, NULL if none was started
+    int status;            // Exit status when there is no job
+    int outFd;             // Read ends of the command's stdout and stderr, -1 at end of file
+    int errFd;
+    char* output;          // Frames waiting to be sent to the client
+    size_t outputStart;    // First byte not sent yet
+    size_t outputEnd;
+    size_t outputCapacity;
+    size_t frameLeft;      // Bytes still owed of the frame at outputStart, 0 between frames
+    struct ServerRequest* next;
+} ServerRequest;
+
+// Remembers where a command was found in $PATH, or that it was not found at all
+typedef struct PathHashEntry{
+    char* name;    // Command name as typed
+    char* path;    // Resolved absolute path, NULL for a cached miss
+    unsigned int hits;
+    struct PathHashEntry* next;
+} PathHashEntry;
+
+PathHashEntry* pathHash[PATH_HASH_SIZE];
+char* pathHashPath = NULL;  // The $PATH value the table was filled from
+int pathHashRelative = 0;   // pathHashPath has an empty or relative entry, so the table is not used
+
+#define BUILTIN_NEEDS_PARENT 0x1   // Changes the shell's own state, which a forked copy cannot do
+#define BUILTIN_PIPELINE_SAFE 0x2  // Still useful in a forked copy, as a pipeline stage or in the background, even if it needs the parent
+#define BUILTIN_OWN_REDIRECTS 0x4  // Passes its redirections on to the commands it runs instead of taking them
+
+// A command implemented by the shell itself
+typedef struct{
+    const char* name;
+    int (*run)(struct ShellCommand* command);  // Returns the exit status
+    int flags;                                 // BUILTIN_* flags
+} Builtin;
+
+const Builtin* builtinTable[BUILTIN_TABLE_SIZE];  // Perfect hash of the registry, filled by InitBuiltins
+unsigned int builtinSeed = 0;                     // Hash seed giving every builtin its own slot
+
+// Incremental SHA-256, used to key the memo cache by content
+typedef struct{
+    uint32_t state[8];
+    uint64_t length;           // Bytes hashed so far
+    unsigned char buffer[64];  // Partial block
+    size_t used;
+} Sha256;
+
+// A memo cache file, as seen while trimming the cache
+typedef struct{
+    char name[65];          // Hex SHA-256 key
+    struct timespec used;   // mtime, refreshed by every hit
+    off_t size;
+} MemoEntry;
+
+unsigned long memoHits = 0;       // Counters for 'memo --stats', for this shell
+unsigned long memoMisses = 0;
+unsigned long memoEvictions = 0;
+// Header of a history record, followed by the cwd and the command
+// (neither NUL terminated) and padding to a multiple of 8 bytes
+typedef struct{
+    uint32_t magic;          // HISTORY_MAGIC
+    uint32_t size;           // Whole record, header and padding included
+    int64_t started;         // Unix time in milliseconds
+    uint32_t duration;       // Milliseconds
+    int32_t status;          // Exit status
+    uint32_t cwdLength;
+    uint32_t commandLength;
+} HistoryRecord;
+
+// The persistent history: an append-only log of records and an index
+// of their offsets, both mapped read-only and appended to with write()
+typedef struct{
+    int logFd;
+    int indexFd;
+    char* log;              // Mapping of the log
+    size_t logMapped;       // Bytes of the log mapped
+    uint64_t* index;        // Mapping of the index, one offset per entry
+    size_t count;           // Entries in the mapped index
+} History;
+
+History history = { -1, -1, NULL, 0, NULL, 0 };
+
+int pipedStdin = 0;               // Set in a forked builtin whose stdin is a pipe or a file, not the shell's
+
+// Keys the line editor decodes from escape sequences, above any byte value
+enum{
+    KEY_NONE = -1,  // End of input
+    KEY_UP = 1000,
+    KEY_DOWN,
+    KEY_LEFT,
+    KEY_RIGHT,
+    KEY_HOME,
+    KEY_END,
+    KEY_DELETE,
+    KEY_WORD_LEFT,
+    KEY_WORD_RIGHT
+};
+
+// State of the interactive line editor, kept between lines so its
+// buffers are reused
+typedef struct{
+    char* text;              // The line being edited, NUL terminated
+    size_t length;
+    size_t capacity;
+    size_t cursor;           // Byte offset of the cursor in text
+    const char* prompt;      // The whole rendered prompt
+    size_t promptLength;
+    const char* head;        // What precedes text on its row: the prompt's last line or the search prompt
+    size_t headLength;
+    char* shown;             // head and text as they are on screen
+    char* want;              // head and text as they should be, swapped with shown after a refresh
+    size_t displayCapacity;  // Bytes allocated for shown and want each
+    size_t shownLength;
+    size_t shownColumns;     // Columns shown takes
+    size_t screenCursor;     // Column of the terminal cursor, counted from the start of head
+    int columns;             // Terminal width at the last refresh
+    long historyEntry;       // Entry shown while walking the history, -1 when editing a new line
+    char* saved;             // The new line, kept while walking the history
+    int lastKey;
+    int pendingKey;          // A key to decode again, 0 if none
+    char input[64];          // Bytes read from the terminal but not yet decoded
+    ssize_t inputStart;
+    ssize_t inputEnd;
+    struct{
+        char* data;
+        size_t length;
+        size_t capacity;
+    } out;                   // Output queued for a single write()
+} Editor;
+
+Editor editor;
+int lineEditing = 0;  // Interactive input goes through EditLine
+
+// Node of the command-name trie. Children are a sibling list sorted by byte
+typedef struct TrieNode{
+    struct TrieNode* child;
+    struct TrieNode* sibling;
+    uint64_t dirs;       // Bit n: the name is an executable in $PATH directory n, bit 63: a builtin
+    unsigned char byte;
+} TrieNode;
+
+// Every builtin and $PATH executable, for completion, kept current by inotify
+typedef struct{
+    TrieNode* root;
+    Arena arena;                  // Owns the nodes, reset when $PATH changes
+    char* path;                   // $PATH the trie was built from
+    char* dirs[TRIE_MAX_DIRS];
+    int watches[TRIE_MAX_DIRS];   // inotify watch of each directory
+    int dirCount;
+    int watchFd;                  // inotify descriptor, polled while waiting for input
+} CommandTrie;
+
+CommandTrie commandTrie = { NULL, { 0 }, NULL, { NULL }, { 0 }, 0, -1 };
+
+// A completion candidate
+typedef struct{
+    const char* name;
+    int directory;
+} Completion;
+
+typedef struct{
+    Completion* items;
+    size_t count;
+    size_t capacity;
+} CompletionList;
+
+// Directory entry, type is the d_type the kernel reported
+typedef struct{
+    char* name;
+    uint16_t length;
+    unsigned char type;
+} DirEntry;
+
+// Cached listing of a directory, valid while its mtime is unchanged.
+// Shared by glob expansion and file name completion
+typedef struct{
+    dev_t device;
+    ino_t inode;
+    struct timespec modified;
+    int racy;              // Read too soon after the mtime to be trusted again
+    unsigned long used;    // dirCacheClock at the last lookup, for LRU replacement
+    DirEntry* entries;     // In directory order
+    size_t count;
+    size_t capacity;
+    char* storage;         // The names, packed
+    size_t storageSize;
+} DirListing;
+
+DirListing dirCache[DIR_CACHE_SIZE];
+unsigned long dirCacheClock = 0;
+char* direntBuffer = NULL;  // GETDENTS_BUFFER_SIZE bytes for getdents64, allocated on first use
+
+// Steps of a compiled glob component
+typedef enum{
+    GLOB_LITERAL,  // Bytes that must match exactly
+    GLOB_ANY,      // ?
+    GLOB_SET,      // [...]
+    GLOB_STAR      // *
+} GlobOpKind;
+
+typedef struct{
+    GlobOpKind kind;
+    size_t length;              // Bytes of text, for GLOB_LITERAL
+    const char* text;
+    const unsigned char* set;   // 256-bit membership, for GLOB_SET
+} GlobOp;
+
+typedef enum{
+    GLOB_PART_LITERAL,    // No glob characters, used as is
+    GLOB_PART_MATCH,      // Matched against each directory entry
+    GLOB_PART_RECURSIVE   // **
+} GlobPartKind;
+
+// One path component of a compiled glob pattern
+typedef struct{
+    GlobPartKind kind;
+    const char* text;       // Unescaped text of a literal component
+    GlobOp* ops;
+    int opCount;
+    int dotted;             // Starts with a literal '.', so hidden names may match
+    size_t minLength;       // Shortest name that can match
+    const char* suffix;     // Literal every match ends with, checked first
+    size_t suffixLength;
+} GlobPart;
+
+// A glob expansion in progress
+typedef struct{
+    GlobPart* parts;
+    int count;
+    int directoriesOnly;    // The pattern ends in '/'
+    int recursiveTail;      // The pattern ends in '**', which is not among parts
+    char** matches;
+    size_t matchCount;
+    size_t matchCapacity;
+    Arena* arena;
+} Glob;
+
+// Octal escape forms accepted by WriteEscape
+typedef enum{
+    ESCAPE_OCTAL_PLAIN,  // \nnn, as in printf formats
+    ESCAPE_OCTAL_ZERO,   // \0nnn, as in echo -e
+    ESCAPE_OCTAL_EITHER  // Both, as in printf's %b
+} EscapeOctal;
+
+// Position of the 'test' builtin's recursive descent over its words
+typedef struct{
+    char** words;  // The expression, without 'test'/'[' and ']'
+    int count;
+    int pos;       // Next word to look at
+    int error;     // Set once a syntax error has been reported
+} TestParser;
+
 // Function prototypes
 char* CommandPrompt();
-ShellCommand ParseCommandLine(char* input);
-void ExecuteCommand(ShellCommand command);
+char* EditCommandLine(const char* prompt, size_t length);
+void CompilePrompt(const char* template);
+void RefreshCwd();
+ShellCommand ParseCommandLine(char* input, Arena* arena);
+void LexerInit(Lexer* lexer, char* input, Arena* arena);
+Redirect* AddRedirect(ShellCommand* stage, Redirect** last, RedirectKind kind, int fd, Arena* arena);
+const char* OperatorText(TokenKind kind);
+char* LexerLiteral(Lexer* lexer, Token* token, char* write, const char* rest, char quote, char c);
+char* LexerExpand(Lexer* lexer, Token* token, char* write, char** read, char quote);
+char* LexerReserve(Lexer* lexer, Token* token, char* write, const char* rest, char quote, size_t extra);
+const char* VariableReference(const char* text, const char** end, char* number);
+const char* ScanRawWord(const char* text, char quote, int* glob);
+size_t ExpandGlob(const char* pattern, Arena* arena, char*** matches);
+void CompileGlobPart(GlobPart* part, const char* text, size_t length, Arena* arena);
+size_t CompileGlobSet(const char* text, size_t length, size_t start, unsigned char* set);
+int GlobMatch(const GlobPart* part, const char* name, size_t length);
+void GlobWalk(Glob* glob, int index, char* path, size_t length);
+void GlobAddTree(Glob* glob, char* path, size_t length, int top);
+void GlobAddMatch(Glob* glob, const char* path, size_t length);
+void GlobUnescape(char* text);
+int CompareStrings(const void* a, const void* b);
+const DirListing* ListDirectory(const char* path);
+char* ReadLine(LineReader* reader, const char* continuationPrompt);
+int ReadPhysicalLine(LineReader* reader, size_t* length);
+void ReaderFromString(LineReader* reader, const char* text);
+int ReaderFromFile(LineReader* reader, const char* path);
+Token NextToken(Lexer* lexer);
+TokenKind OperatorKind(char** read);
+int ExecuteCommand(ShellCommand command);
+unsigned int HashBuiltinName(const char* name, unsigned int seed);
+void InitBuiltins();
+const Builtin* FindBuiltin(const char* name);
+int CdBuiltin(ShellCommand* command);
+int ExitBuiltin(ShellCommand* command);
+int TrueBuiltin(ShellCommand* command);
+int FalseBuiltin(ShellCommand* command);
+int RunPipeline(ShellCommand* first);
+Job* StartPipeline(ShellCommand* first, pid_t pgid, int nullStdin);
+int ParallelBuiltin(ShellCommand* command);
+int BenchBuiltin(ShellCommand* command);
+pid_t StartStage(ShellCommand* stage, int inFd, int outFd, pid_t pgid, int* status);
+int StatusFromWait(int status);
+int SetBuiltin(ShellCommand* command);
+int RunBuiltinInShell(const Builtin* builtin, ShellCommand command);
+int EchoBuiltin(ShellCommand* command);
+int WriteEscape(const char** text, EscapeOctal octal);
+int WriteEscaped(const char* text, EscapeOctal octal);
+int PwdBuiltin(ShellCommand* command);
+int TestBuiltin(ShellCommand* command);
+int TestOr(TestParser* parser);
+int TestAnd(TestParser* parser);
+int TestNot(TestParser* parser);
+int TestUnary(char op, const char* operand, int* error);
+int TestBinaryKnown(const char* op);
+int TestBinary(const char* left, const char* op, const char* right, int* error);
+int PrintfBuiltin(ShellCommand* command);
+long long PrintfNumber(const char* text, int* status);
+void InitJobControl();
+Job* CreateJob(ShellCommand* first, int count);
+Job* KeepJob(Job* job);
+void RemoveJob(Job* job);
+int JobStatus(Job* job);
+int WaitForJob(Job* job, int foreground);
+void MarkChild(pid_t pid, int status, struct rusage* usage);
+double ElapsedSince(struct timespec* start);
+void PrintUsage(CommandUsage* usage, const char* label);
+void InitTrace(const char* path);
+uint64_t TraceBegin();
+void TraceEnd(const char* name, uint64_t start, const char* detail);
+void WriteTrace();
+void ReapChildren();
+void NotifyJobs();
+void WaitForInput(int fd);
+Job* FindJob(const char* spec, const char* builtin);
+int JobsBuiltin(ShellCommand* command);
+int FgBuiltin(ShellCommand* command);
+int BgBuiltin(ShellCommand* command);
+int WaitBuiltin(ShellCommand* command);
+int ParseLaunchMode(const char* name, LaunchMode* mode);
+int BuildFdPlan(ShellCommand* command, int inFd, int outFd, FdPlan* plan);
+void CloseFdPlan(FdPlan* plan);
+void ApplyFdPlan(const FdPlan* plan, int closeOthers);
+int RedirectsFd(const ShellCommand* command, int fd);
+int FormatRedirect(char* out, size_t size, const Redirect* redirect);
+int HereDocumentFd(const char* text, size_t length);
+void ReadHereDocuments(ShellCommand* first);
+char* ReadHereLine();
+char* HereAppend(char* body, size_t* length, size_t* capacity, const char* bytes, size_t count);
+pid_t LaunchProcess(const char* path, char** args, char** envp, const FdPlan* plan, pid_t pgid);
+void PrepareChild(pid_t pgid);
+int StartZygote();
+void ZygoteMain(int fd);
+ZygoteReply ZygoteClone(const ZygoteRequest* request, char* body, int* fds, int fdCount);
+int ZygoteLaunch(const char* path, char** args, char** envp, const FdPlan* plan, pid_t pgid, pid_t* pid);
+int SendFully(int fd, const void* data, size_t length);
+int ReceiveFully(int fd, void* data, size_t length);
+int ServerMain(const char* path, long limit);
+int ServerListen(const char* path);
+void ServerReceive(ServerClient* client, ServerRequest** requests);
+void ServerAddFrame(ServerRequest** requests, ServerClient* client, FrameHeader* header, char* payload);
+void ServerStart(ServerRequest* request, int home);
+void ServerForward(ServerRequest* request, int* fd, FrameType type);
+char* ServerReserve(ServerRequest* request, size_t length);
+void ServerQueue(ServerRequest* request, FrameType type, const void* data, uint32_t length);
+void ServerFlush(ServerRequest* request);
+void ServerFlushClient(ServerClient* client, ServerRequest* requests);
+void ServerDropClient(ServerClient* client, ServerRequest** requests);
+void FreeServerRequest(ServerRequest* request);
+char** AppendString(char** list, int* count, char* text);
+int SendFrame(int fd, FrameType type, uint32_t id, const void* data, uint32_t length);
+int ClientMain(int argc, char* argv[]);
+const char* ResolveCommand(const char* name);
+char* SearchPath(const char* name, const char* path);
+void ForgetCommand(const char* name);
+void ClearPathHash();
+int HashBuiltin(ShellCommand* command);
+void* ArenaAlloc(Arena* arena, size_t size);
+char* ArenaStrdup(Arena* arena, const char* str);
+void ArenaReset(Arena* arena);
+int AllocStatBuiltin(ShellCommand* command);
+void Sha256Block(Sha256* sha, const unsigned char* block);
+void Sha256Init(Sha256* sha);
+void Sha256Update(Sha256* sha, const void* data, size_t length);
+void Sha256Final(Sha256* sha, unsigned char digest[32]);
+int MemoBuiltin(ShellCommand* command);
+const char* MemoDirectory();
+unsigned long long MemoLimit();
+int MemoInput(int useStdin);
+void MemoHashEnvironment(Sha256* sha);
+void MemoHashVariable(Sha256* sha, const char* name, size_t length);
+int MemoHashInput(Sha256* sha, int fd);
+int MemoReplay(int fd);
+int CopyToStdout(int fd, off_t length);
+void MemoTrim(const char* dir, unsigned long long limit, unsigned long* entries, unsigned long long* bytes);
+int CompareMemoEntries(const void* a, const void* b);
+int MakeDirectories(char* path);
+void HistoryOpen();
+void HistoryRefresh();
+void HistoryIndexFrom(uint64_t offset);
+const HistoryRecord* HistoryGet(size_t entry);
+void HistoryAppend(const char* line, int64_t started, uint32_t duration, int status, const char* cwd);
+long HistorySearch(const char* text, size_t before);
+const char* HistoryCommand(const HistoryRecord* record);
+int HistoryBuiltin(ShellCommand* command);
+char* EditLine(const char* prompt, size_t promptLength);
+int EditorReadKey();
+int EditorReadByte(int timeout);
+void EditorSetText(const char* text, size_t length);
+void EditorInsert(size_t at, const char* bytes, size_t length);
+void EditorDelete(size_t from, size_t to);
+size_t EditorPreviousChar(size_t at);
+size_t EditorNextChar(size_t at);
+size_t EditorWordStart(size_t at);
+size_t DisplayColumns(const char* text, size_t length);
+void EditorRepaint();
+void EditorRefresh();
+void EditorMoveColumn(size_t from, size_t to);
+void EditorLeaveLine(const char* mark);
+void EditorOutput(const char* bytes, size_t length);
+void EditorFlush(const char* bytes, size_t length);
+void EditorHistory(int direction);
+int EditorReverseSearch();
+void EditorComplete(int list);
+void EditorListCandidates(CompletionList* candidates);
+void AddCandidate(CompletionList* list, const char* name, int directory);
+void CompleteCommand(const char* prefix, CompletionList* candidates);
+void CollectTrie(TrieNode* node, char* name, size_t length, CompletionList* candidates);
+void BuildCommandTrie();
+int IsExecutableIn(int dir, const char* name);
+TrieNode* TrieNewNode(unsigned char byte);
+void TrieSetBit(const char* name, int bit, int set);
+void TrieClearDirectory(TrieNode* node, int bit);
+void ApplyPathChanges();
+void CompleteFile(const char* word, size_t dirLength, CompletionList* candidates);
+void InitVariables();
+uint32_t HashVariableName(const char* name, size_t length);
+Variable* FindVariable(const char* name, size_t length);
+const char* GetVariable(const char* name);
+void SetVariable(const char* name, size_t nameLength, const char* value, int exported);
+void UnsetVariable(const char* name, size_t length);
+void ResizeVariables(size_t capacity);
+char** VariableEnvironment();
+char** StageEnvironment(ShellCommand* stage);
+void ApplyAssignments(char** assignments, int exported);
+Variable* SaveAssignments(char** assignments);
+void RestoreAssignments(char** assignments, Variable* saved);
+int IsVariableName(const char* name, size_t length);
+void PrintVariable(const char* prefix, const Variable* variable);
+int CompareVariables(const void* a, const void* b);
+int ExportBuiltin(ShellCommand* command);
+int UnsetBuiltin(ShellCommand* command);
 
-int main(){
+// Builtin registry, new builtins only need an entry here
+Builtin builtins[] = {
+    { "cd",        CdBuiltin,        BUILTIN_NEEDS_PARENT },
+    { "exit",      ExitBuiltin,      BUILTIN_NEEDS_PARENT },
+    { "set",       SetBuiltin,       BUILTIN_NEEDS_PARENT | BUILTIN_PIPELINE_SAFE },
+    { "export",    ExportBuiltin,    BUILTIN_NEEDS_PARENT | BUILTIN_PIPELINE_SAFE },
+    { "unset",     UnsetBuiltin,     BUILTIN_NEEDS_PARENT | BUILTIN_PIPELINE_SAFE },
+    { "hash",      HashBuiltin,      BUILTIN_NEEDS_PARENT | BUILTIN_PIPELINE_SAFE },
+    { "jobs",      JobsBuiltin,      BUILTIN_NEEDS_PARENT | BUILTIN_PIPELINE_SAFE },
+    { "fg",        FgBuiltin,        BUILTIN_NEEDS_PARENT },
+    { "bg",        BgBuiltin,        BUILTIN_NEEDS_PARENT },
+    { "wait",      WaitBuiltin,      BUILTIN_NEEDS_PARENT },
+    { "allocstat", AllocStatBuiltin, BUILTIN_PIPELINE_SAFE },
+    { "parallel",  ParallelBuiltin,  BUILTIN_PIPELINE_SAFE },
+    { "bench",     BenchBuiltin,     BUILTIN_PIPELINE_SAFE | BUILTIN_OWN_REDIRECTS },
+    { "memo",      MemoBuiltin,      BUILTIN_PIPELINE_SAFE },
+    { "history",   HistoryBuiltin,   BUILTIN_PIPELINE_SAFE },
+    { "echo",      EchoBuiltin,      BUILTIN_PIPELINE_SAFE },
+    { "printf",    PrintfBuiltin,    BUILTIN_PIPELINE_SAFE },
+    { "pwd",       PwdBuiltin,       BUILTIN_PIPELINE_SAFE },
+    { "true",      TrueBuiltin,      BUILTIN_PIPELINE_SAFE },
+    { "false",     FalseBuiltin,     BUILTIN_PIPELINE_SAFE },
+    { "test",      TestBuiltin,      BUILTIN_PIPELINE_SAFE },
+    { "[",         TestBuiltin,      BUILTIN_PIPELINE_SAFE },
+};
+
+#ifndef TECHSHELL_NO_MAIN  // Benchmarks include this file and provide their own main()
+int main(int argc, char* argv[]){
     char* input;
     ShellCommand command;
 
+    const char* commandString = NULL;
+    const char* scriptPath = NULL;
+    const char* serverPath = NULL;
+    long serverJobs = sysconf(_SC_NPROCESSORS_ONLN);
+
+    // Everything below reads its settings from the variable table
+    InitVariables();
+    const char* traceFile = GetVariable("TECHSHELL_TRACE");
+
+    // Pick the launch engine, the command line overrides the environment
+    const char* mode = GetVariable("TECHSHELL_LAUNCH");
+    if(mode && !ParseLaunchMode(mode, &launchMode)){
+        fprintf(stderr, "Error: Unknown launch mode '%s' in TECHSHELL_LAUNCH\n", mode);
+    }
+    for(int i = 1; i < argc; i++){
+        if(strncmp(argv[i], "--trace=", 8) == 0){
+            traceFile = argv[i] + 8;
+        }
+        else if(strncmp(argv[i], "--launch=", 9) == 0){
+            if(!ParseLaunchMode(argv[i] + 9, &launchMode)){
+                fprintf(stderr, "Error: Unknown launch mode '%s' (expected spawn, vfork, fork or zygote)\n", argv[i] + 9);
+                exit(EXIT_FAILURE);
+            }
+        }
+        else if(strcmp(argv[i], "--server") == 0 && i + 1 < argc){
+            serverPath = argv[++i];
+        }
+        else if(strncmp(argv[i], "--jobs=", 7) == 0 && atol(argv[i] + 7) > 0){
+            serverJobs = atol(argv[i] + 7);
+        }
+        else if(strcmp(argv[i], "--client") == 0){
+            exit(ClientMain(argc - i - 1, argv + i + 1));
+        }
+        else if(strcmp(argv[i], "-c") == 0 && i + 1 < argc && scriptPath == NULL && commandString == NULL){
+            commandString = argv[++i];
+        }
+        else if(argv[i][0] != '-' && scriptPath == NULL && commandString == NULL){
+            scriptPath = argv[i];
+        }
+        else{
+            fprintf(stderr, "Usage: %s [--launch=spawn|vfork|fork|zygote] [--trace=file.json] [-c commands | script | --server SOCKET [--jobs=N]]\n"
+                            "       %s --client SOCKET [-n] [-C dir] [-e NAME=value]... [--] cmd args...\n", argv[0], argv[0]);
+            exit(EXIT_FAILURE);
+        }
+    }
+
+    // Only a terminal on stdin gets prompts, everything else is batch input
+    if(commandString){
+        ReaderFromString(&inputReader, commandString);
+    }
+    else if(scriptPath){
+        if(ReaderFromFile(&inputReader, scriptPath) != 0){
+            fprintf(stderr, "Error: Cannot open script '%s': %s\n", scriptPath, strerror(errno));
+            exit(127);
+        }
+    }
+    else if(serverPath == NULL){
+        interactive = isatty(STDIN_FILENO);
+    }
+
+    if(traceFile && *traceFile){
+        InitTrace(traceFile);
+    }
+    InitBuiltins();
+    InitJobControl();
+
+    // Started before anything else grows the shell, the zygote stays small
+    if(launchMode == LAUNCH_ZYGOTE && StartZygote() != 0){
+        launchMode = LAUNCH_SPAWN;
+    }
+
+    if(serverPath){
+        exit(ServerMain(serverPath, serverJobs));
+    }
+
+    if(interactive){
+        const char* template = GetVariable("TECHSHELL_PROMPT");
+        CompilePrompt(template ? template : "\\w$ ");
+        RefreshCwd();
+        HistoryOpen();
+
+        // Raw-mode editing needs a terminal that understands cursor movement
+        const char* term = GetVariable("TERM");
+        lineEditing = isatty(STDOUT_FILENO) && term && *term && strcmp(term, "dumb") != 0;
+    }
+
     for(;;){
+        // Everything the previous line allocated is released in one step
+        uint64_t traceStart = TraceBegin();
+        ArenaReset(&lineArena);
+        TraceEnd("reset", traceStart, NULL);
+
+        // Collect finished background jobs and report them before the prompt
+        if(jobCount > 0){
+            ReapChildren();
+            NotifyJobs();
+        }
+
         // Get user input from the command line
+        traceStart = TraceBegin();
         input = CommandPrompt();
+        TraceEnd("prompt", traceStart, NULL);
         if(input == NULL){
-            continue;  // Skips processing if there's no input
+            if(interactive){
+                printf("\n");  // Leave the terminal on a fresh line after Ctrl+D
+            }
+            break;
         }
 
-        // Parse the command input
-        command = ParseCommandLine(input);
+        // The lexer works in place, so history needs its own copy of the line
+        char* historyLine = NULL;
+        char* historyCwd = NULL;
+        if(history.logFd != -1 && input[strspn(input, " \t")] != '\0'){
+            historyLine = ArenaStrdup(&lineArena, input);
+            historyCwd = ArenaStrdup(&lineArena, cachedCwd ? cachedCwd : "");
+        }
 
-        // Execute the parsed command
-        ExecuteCommand(command);
+        // Reading a here-document's body reuses the line buffer the parsed words live in
+        if(strstr(input, "<<")){
+            input = ArenaStrdup(&lineArena, input);
+        }
 
-        // Free dynamically allocated memory after execution is finished
-        free(input);
-        if(command.inputFile){
-            free(command.inputFile);
+        // Parse the command input
+        traceStart = TraceBegin();
+        command = ParseCommandLine(input, &lineArena);
+        TraceEnd("parse", traceStart, NULL);
+        if(!command.syntaxError){
+            ReadHereDocuments(&command);
         }
-        if(command.outputFile){
-            free(command.outputFile);
+
+        // Blank lines and comments are not errors in scripts
+        if(!interactive && command.args[0] == NULL && !command.syntaxError && !command.background &&
+           command.redirects == NULL && command.assignments == NULL){
+            continue;
         }
-        if(command.args){
-            for(int i = 0; command.args[i] != NULL; i++){
-                free(command.args[i]);
-            }
-            free(command.args);
+
+        // Execute the parsed command
+        struct timespec wallStart, started;
+        clock_gettime(CLOCK_REALTIME, &wallStart);
+        clock_gettime(CLOCK_MONOTONIC, &started);
+        traceStart = TraceBegin();
+        lastStatus = ExecuteCommand(command);
+        TraceEnd("execute", traceStart, command.args[0]);
+
+        if(historyLine){
+            HistoryAppend(historyLine, wallStart.tv_sec * 1000LL + wallStart.tv_nsec / 1000000,
+                          (uint32_t)(ElapsedSince(&started) * 1000), lastStatus, historyCwd);
         }
     }
-    exit(0);
+    exit(lastStatus);
 }
+#endif
 
 
 /*
  * Function: CommandPrompt
  * --------------------------
- * Displays the current working directory and prompts the user for input
+ * Displays the prompt, by default the current working directory followed
+ * by '$', and reads the user's input. The prompt is rendered from the
+ * compiled template and the cached working directory and goes out in a
+ * single write(), or is handed to the line editor on a capable terminal.
+ * No prompt is shown when the shell is not interactive
  *
  * Parameters:
  *   None
  * 
  * Returns:
- *   A string containing the user's input
+ *   A string containing the user's input, valid until the next prompt,
+ *   or NULL at end of input
  */
 char* CommandPrompt(){
-    char* cwd = getcwd(NULL, 0);  // Get current working directory
-    if(cwd){
-        printf("%s$ ", cwd);  // Display the prompt with the current directory ($)
-        free(cwd);  // Free allocated memory from getcwd()
-    }
-    else{
-        perror("getcwd failed");
+    // Batch input skips rendering the prompt entirely
+    if(!interactive){
+        return ReadLine(&inputReader, NULL);
     }
-    fflush(stdout);
 
-    // Allocate memory for user input
-    char* input = (char*)malloc(MAX_INPUT_SIZE);
-    if(!input){
-        perror("Memory allocation failed");
-        exit(EXIT_FAILURE);
+    char status[16];
+    int statusLength = snprintf(status, sizeof(status), "%d", lastStatus);
+    const char* base = strrchr(cachedCwd, '/');
+    base = (base && base[1] != '\0') ? base + 1 : cachedCwd;
+
+    // Size the reusable buffer for the worst case before copying anything
+    size_t needed = 1;
+    for(int i = 0; i < promptPieceCount; i++){
+        needed += promptPieces[i].kind == PROMPT_LITERAL ? promptPieces[i].length : cachedCwdLength + sizeof(status);
+    }
+    if(needed > promptBufferSize){
+        promptBuffer = (char*)realloc(promptBuffer, needed);
+        if(!promptBuffer){
+            perror("Memory reallocation failed");
+            exit(EXIT_FAILURE);
+        }
+        promptBufferSize = needed;
     }
 
-    // Read user input from stdin
-    if(fgets(input, MAX_INPUT_SIZE, stdin) == NULL){
-        perror("Error reading input");
-        free(input);
-        return NULL;
+    size_t length = 0;
+    for(int i = 0; i < promptPieceCount; i++){
+        const char* text = promptPieces[i].text;
+        size_t textLength = promptPieces[i].length;
+        if(promptPieces[i].kind == PROMPT_CWD){
+            text = cachedCwd;
+            textLength = cachedCwdLength;
+        }
+        else if(promptPieces[i].kind == PROMPT_CWD_BASE){
+            text = base;
+            textLength = strlen(base);
+        }
+        else if(promptPieces[i].kind == PROMPT_STATUS){
+            text = status;
+            textLength = statusLength;
+        }
+        memcpy(promptBuffer + length, text, textLength);
+        length += textLength;
     }
 
-    // Remove trailing newline character from input
-    input[strcspn(input, "\n")] = 0;
+    // Anything builtins left in stdio must come out before the prompt
+    fflush(stdout);
+    if(lineEditing){
+        return EditCommandLine(promptBuffer, length);
+    }
+    if(write(STDOUT_FILENO, promptBuffer, length) == -1 && errno != EPIPE){
+        perror("Error writing prompt");
+    }
 
-    return input;
+    // Read user input from stdin, however long it is
+    return ReadLine(&inputReader, "> ");
 }
 
 
 /*
- * Function: ParseCommandLine
- * --------------------------
- * Parses the user input into a ShellCommand struct, extracting the command,
- * arguments, and input/output files
+ * Function: EditCommandLine
+ * -------------------------
+ * Reads a command with the line editor. A line ending in an unescaped
+ * backslash continues on the next, edited under a "> " prompt
  *
  * Parameters:
- *   input - The raw user input string
+ *   prompt - The rendered prompt
+ *   length - Its length
  *
  * Returns:
- *   A ShellCommand struct containing parsed command data
+ *   The joined line, allocated in the line arena, or NULL at end of input
  */
-ShellCommand ParseCommandLine(char* input) {
-    ShellCommand command;
-    command.inputFile = NULL;
-    command.outputFile = NULL;
-    command.args = NULL;
-
-    int capacity = INITIAL_ARG_SIZE;
-    int count = 0;
-
-    // Allocate memory for argument list
-    command.args = (char**)malloc(capacity * sizeof(char*));
-    if(!command.args){
-        perror("Memory allocation failed");
-        exit(EXIT_FAILURE);
-    }
+char* EditCommandLine(const char* prompt, size_t length){
+    char* joined = NULL;
+    size_t joinedLength = 0;
+    char* line = EditLine(prompt, length);
 
-    char* token;
-    char* rest = input;
-
-    // Tokenize the input string
-    while((token = strtok_r(rest, " ", &rest))){
-        // Check for input redirection
-        if(strcmp(token, "<") == 0){
-            token = strtok_r(NULL, " ", &rest);
-            if(token != NULL){
-                command.inputFile = strdup(token);  // Store input file
-            }
-            else{
-                fprintf(stderr, "Error: Expected filename after '<'\n");
-                command.args[0] = NULL;
-                return command;
-            }
+    while(line){
+        size_t lineLength = strlen(line);
+        size_t slashes = 0;
+        while(slashes < lineLength && line[lineLength - 1 - slashes] == '\\'){
+            slashes++;
         }
-        // Check for output redirection
-        else if (strcmp(token, ">") == 0) {
-            token = strtok_r(NULL, " ", &rest);
-            if(token != NULL){
-                command.outputFile = strdup(token);  // Store output file
-            }
-            else{
-                fprintf(stderr, "Error: Expected filename after '>'\n");
-                command.args[0] = NULL;
-                return command;
-            }
-        } 
-        else{
-            // Resize argument list if needed
-            if(count >= capacity - 1){
-                capacity *= 2;
-                command.args = (char**)realloc(command.args, capacity * sizeof(char*));
-                if(!command.args){
-                    perror("Memory reallocation failed");
-                    exit(EXIT_FAILURE);
-                }
-            }
-            command.args[count++] = strdup(token);
+        int continued = slashes % 2 == 1;
+        if(continued){
+            lineLength--;
         }
-    }
 
-    if(count == 0 || (count == 1 && strlen(command.args[0]) == 0)){  
-        command.args[0] = NULL;  // Ensure args[0] is NULL if no command is entered
-    }
-    else{
-        command.args[count] = NULL; // Null-terminate the argument list
+        char* grown = (char*)ArenaAlloc(&lineArena, joinedLength + lineLength + 1);
+        if(joinedLength){
+            memcpy(grown, joined, joinedLength);
+        }
+        memcpy(grown + joinedLength, line, lineLength);
+        joinedLength += lineLength;
+        grown[joinedLength] = '\0';
+        joined = grown;
+
+        if(!continued){
+            return joined;
+        }
+        line = EditLine("> ", 2);
     }
-    
-    return command;
+    return joined;
 }
 
 
 /*
- * Function: ExecuteCommand
+ * Function: AddPromptPiece
  * ------------------------
- * Executes the parsed command using fork() and execvp()
- * Handles input/output redirection
+ * Appends a piece to the compiled prompt, merging neighbouring literals
  *
  * Parameters:
- *   command - A ShellCommand struct containing the parsed command data
- * 
+ *   kind   - The piece kind
+ *   text   - Literal text, ignored for the dynamic kinds
+ *   length - Length of text
+ *
  * Returns:
  *   None
  */
-void ExecuteCommand(ShellCommand command){
-    // Check for empty command
-    if(command.args[0] == NULL){
-        fprintf(stderr, "Error: No command entered\n");
+void AddPromptPiece(PromptPieceKind kind, const char* text, size_t length){
+    PromptPiece* last = promptPieceCount > 0 ? &promptPieces[promptPieceCount - 1] : NULL;
+
+    if(kind == PROMPT_LITERAL && last && last->kind == PROMPT_LITERAL){
+        last->text = (char*)realloc(last->text, last->length + length + 1);
+        if(!last->text){
+            perror("Memory reallocation failed");
+            exit(EXIT_FAILURE);
+        }
+        memcpy(last->text + last->length, text, length);
+        last->length += length;
+        last->text[last->length] = '\0';
         return;
     }
 
-    // Handles 'exit' command
-    if(strcmp(command.args[0], "exit") == 0){
-        exit(0);
+    promptPieces = (PromptPiece*)realloc(promptPieces, (promptPieceCount + 1) * sizeof(PromptPiece));
+    if(!promptPieces){
+        perror("Memory reallocation failed");
+        exit(EXIT_FAILURE);
     }
-
-    // Handle 'cd' command
-    if(strcmp(command.args[0], "cd") == 0){
-        if(command.args[1] == NULL){
-            // If no directory is specified, go to the home directory
-            const char *home = getenv("HOME");
-            if(home == NULL){
-                home = "/";
-            }
-            if(chdir(home) != 0){
-                perror("cd failed");
-            }
+    PromptPiece* piece = &promptPieces[promptPieceCount++];
+    piece->kind = kind;
+    piece->text = NULL;
+    piece->length = 0;
+    if(kind == PROMPT_LITERAL){
+        piece->text = strndup(text, length);
+        if(!piece->text){
+            perror("Memory allocation failed");
+            exit(EXIT_FAILURE);
         }
-        else{
-            char path[MAX_INPUT_SIZE] = "";
+        piece->length = length;
+    }
+}
 
-            // Check if the argument starts with a quote
-            if(command.args[1][0] == '"'){
-                // Concatenate arguments inside the quotes
-                strcat(path, command.args[1] + 1); // Skip the opening quote
 
-                for(int i = 2; command.args[i] != NULL; i++){
-                    strcat(path, " "); // Add spaces between words
-                    strcat(path, command.args[i]);
+/*
+ * Function: CompilePrompt
+ * -----------------------
+ * Turns a prompt template into a list of pieces once at startup, so
+ * drawing the prompt is only a few memcpy calls. Supported escapes:
+ *   \w  working directory      \W  its last component
+ *   \u  user name              \h  host name up to the first '.'
+ *   \?  last exit status       \$  '#' for root, '$' otherwise
+ *   \n  newline                \\  backslash
+ * User, host and \$ never change, so they become literal text
+ *
+ * Parameters:
+ *   template - The template, e.g. "\w$ " (the default)
+ *
+ * Returns:
+ *   None
+ */
+void CompilePrompt(const char* template){
+    const char* literal = template;
 
-                    // Check if this argument ends with a closing quote
-                    int len = strlen(command.args[i]);
-                    if(command.args[i][len - 1] == '"'){
-                        path[strlen(path) - 1] = '\0'; // Remove closing quote
-                        break;
-                    }
+    for(const char* p = template; *p; p++){
+        if(*p != '\\' || p[1] == '\0'){
+            continue;
+        }
+        AddPromptPiece(PROMPT_LITERAL, literal, p - literal);
+        p++;
+
+        switch(*p){
+            case 'w':
+                AddPromptPiece(PROMPT_CWD, NULL, 0);
+                break;
+            case 'W':
+                AddPromptPiece(PROMPT_CWD_BASE, NULL, 0);
+                break;
+            case '?':
+                AddPromptPiece(PROMPT_STATUS, NULL, 0);
+                break;
+            case 'u':{
+                const char* user = GetVariable("USER");
+                if(user == NULL){
+                    user = getlogin();
                 }
+                if(user){
+                    AddPromptPiece(PROMPT_LITERAL, user, strlen(user));
+                }
+                break;
             }
-            else{
-                // Normal single-word directory
-                strcpy(path, command.args[1]);
-            }
-
-            // Attempt to change directory
-            if(chdir(path) != 0){
-                perror("cd failed");
+            case 'h':{
+                char host[256] = "";
+                gethostname(host, sizeof(host) - 1);
+                AddPromptPiece(PROMPT_LITERAL, host, strcspn(host, "."));
+                break;
             }
+            case '$':
+                AddPromptPiece(PROMPT_LITERAL, geteuid() == 0 ? "#" : "$", 1);
+                break;
+            case 'n':
+                AddPromptPiece(PROMPT_LITERAL, "\n", 1);
+                break;
+            case '\\':
+                AddPromptPiece(PROMPT_LITERAL, "\\", 1);
+                break;
+            default:
+                // Unknown escapes are shown as they were written
+                AddPromptPiece(PROMPT_LITERAL, p - 1, 2);
+                break;
         }
-        return;  // Return after handling `cd`
+        literal = p + 1;
     }
+    AddPromptPiece(PROMPT_LITERAL, literal, strlen(literal));
+}
 
 
-    // Fork a new process to execute external commands
-    pid_t pid = fork();
-
-    if(pid == -1){
-        perror("Fork failed");
-        return;
-    }
-    else if(pid == 0){ // Child process
-        if(command.inputFile){
-            if(strlen(command.inputFile) == 0){
-                fprintf(stderr, "Error: No input filename specified\n");
-                exit(EXIT_FAILURE);
-            }
-            int fd = open(command.inputFile, O_RDONLY);
-            if(fd == -1){
-                fprintf(stderr, "Error: Cannot open input file '%s': %s\n", command.inputFile, strerror(errno));
-                exit(EXIT_FAILURE);
-            }
-            dup2(fd, STDIN_FILENO);
-            close(fd);
+/*
+ * Function: RefreshCwd
+ * --------------------
+ * Re-reads the working directory into the prompt's cache. Called at
+ * startup and after cd succeeds, which is the only way it can change
+ *
+ * Parameters:
+ *   None
+ *
+ * Returns:
+ *   None
+ */
+void RefreshCwd(){
+    char* cwd = getcwd(NULL, 0);
+    if(cwd == NULL){
+        perror("getcwd failed");
+        cwd = strdup("?");
+        if(!cwd){
+            perror("Memory allocation failed");
+            exit(EXIT_FAILURE);
         }
+    }
+    free(cachedCwd);
+    cachedCwd = cwd;
+    cachedCwdLength = strlen(cwd);
+}
 
-        if(command.outputFile){
-            if(strlen(command.outputFile) == 0){  // Prevents empty filenames
-                fprintf(stderr, "Error: No output filename specified\n");
-                exit(EXIT_FAILURE);
+
+/*
+ * Function: ReaderFromString
+ * --------------------------
+ * Points a line reader at an in-memory string, used for -c
+ *
+ * Parameters:
+ *   reader - The line reader
+ *   text   - The commands to run, one per line
+ *
+ * Returns:
+ *   None
+ */
+void ReaderFromString(LineReader* reader, const char* text){
+    reader->fd = -1;
+    reader->buffer = (char*)text;  // Only ever read from
+    reader->start = 0;
+    reader->end = strlen(text);
+    reader->eof = 1;
+}
+
+
+/*
+ * Function: ReaderFromFile
+ * ------------------------
+ * Points a line reader at a script file. Regular files are mapped into
+ * memory whole so reading them costs no read() calls, anything else
+ * (such as a FIFO) falls back to buffered reads
+ *
+ * Parameters:
+ *   reader - The line reader
+ *   path   - The script to run
+ *
+ * Returns:
+ *   0 on success, -1 with errno set if the file cannot be opened
+ */
+int ReaderFromFile(LineReader* reader, const char* path){
+    int fd = open(path, O_RDONLY | O_CLOEXEC);
+    if(fd == -1){
+        return -1;
+    }
+
+    struct stat st;
+    if(fstat(fd, &st) == 0 && S_ISREG(st.st_mode)){
+        if(st.st_size == 0){
+            close(fd);
+            ReaderFromString(reader, "");
+            return 0;
+        }
+        void* map = mmap(NULL, st.st_size, PROT_READ, MAP_PRIVATE, fd, 0);
+        if(map != MAP_FAILED){
+            madvise(map, st.st_size, MADV_SEQUENTIAL);
+            close(fd);
+            reader->fd = -1;
+            reader->buffer = (char*)map;
+            reader->start = 0;
+            reader->end = st.st_size;
+            reader->eof = 1;
+            return 0;
+        }
+    }
+
+    reader->fd = fd;
+    return 0;
+}
+
+
+/*
+ * Function: ReadPhysicalLine
+ * --------------------------
+ * Appends one newline terminated line from the reader's buffer to the
+ * line buffer, refilling the buffer with large read() calls as needed
+ *
+ * Parameters:
+ *   reader - The line reader
+ *   length - Length of the text already in reader->line, updated on return
+ *
+ * Returns:
+ *   1 if anything was read, 0 at end of input with nothing read
+ */
+int ReadPhysicalLine(LineReader* reader, size_t* length){
+    int gotAny = 0;
+
+    if(reader->buffer == NULL){
+        reader->buffer = (char*)malloc(READ_BUFFER_SIZE);
+        if(!reader->buffer){
+            perror("Memory allocation failed");
+            exit(EXIT_FAILURE);
+        }
+    }
+
+    for(;;){
+        if(reader->start == reader->end){
+            if(reader->eof){
+                return gotAny;
+            }
+            // Keep reaping background jobs while waiting for more input
+            if(jobCount > 0){
+                WaitForInput(reader->fd);
+            }
+            ssize_t n = read(reader->fd, reader->buffer, READ_BUFFER_SIZE);
+            if(n < 0){
+                if(errno == EINTR){
+                    continue;
+                }
+                perror("Error reading input");
+                n = 0;
+            }
+            if(n == 0){
+                reader->eof = 1;
+                return gotAny;
             }
+            reader->start = 0;
+            reader->end = n;
+        }
+        gotAny = 1;
+
+        // Copy up to the newline, or everything buffered if there is none yet
+        char* chunk = reader->buffer + reader->start;
+        size_t available = reader->end - reader->start;
+        char* newline = (char*)memchr(chunk, '\n', available);
+        size_t take = newline ? (size_t)(newline - chunk) : available;
 
-            int fd = open(command.outputFile, O_WRONLY | O_CREAT | O_TRUNC, 0644);
-            if(fd == -1){
-                fprintf(stderr, "Error: Cannot open output file '%s': %s\n", command.outputFile, strerror(errno));
+        if(*length + take + 1 > reader->lineSize){
+            size_t size = reader->lineSize ? reader->lineSize : INITIAL_LINE_SIZE;
+            while(*length + take + 1 > size){
+                size *= 2;
+            }
+            reader->line = (char*)realloc(reader->line, size);
+            if(!reader->line){
+                perror("Memory reallocation failed");
                 exit(EXIT_FAILURE);
             }
-            dup2(fd, STDOUT_FILENO);
-            close(fd);
+            reader->lineSize = size;
+        }
+        memcpy(reader->line + *length, chunk, take);
+        *length += take;
+        reader->line[*length] = '\0';
+
+        if(newline){
+            reader->start += take + 1;  // Consume the newline too
+            return 1;
         }
+        reader->start = reader->end;
+    }
+}
 
-        // Execute the command using execvp
-        execvp(command.args[0], command.args);
-        fprintf(stderr, "Error: Command '%s' not found\n", command.args[0]);
-        exit(127);
 
+/*
+ * Function: ReadLine
+ * ------------------
+ * Reads one logical line with no length limit. A line ending in an
+ * unescaped backslash continues on the next line, with the backslash and
+ * newline removed. The returned buffer is reused by the next call
+ *
+ * Parameters:
+ *   reader             - The line reader
+ *   continuationPrompt - Printed before each continuation line, or NULL
+ *
+ * Returns:
+ *   The line without its newline, or NULL at end of input
+ */
+char* ReadLine(LineReader* reader, const char* continuationPrompt){
+    size_t length = 0;
+
+    if(!ReadPhysicalLine(reader, &length)){
+        return NULL;
     }
-    else{ // Parent process waits for child to finish
-        int status;
-        waitpid(pid, &status, 0);
+
+    for(;;){
+        if(length > 0 && reader->line[length - 1] == '\r'){
+            reader->line[--length] = '\0';  // Tolerate CRLF scripts
+        }
+
+        // An odd number of trailing backslashes escapes the newline
+        size_t slashes = 0;
+        while(slashes < length && reader->line[length - 1 - slashes] == '\\'){
+            slashes++;
+        }
+        if(slashes % 2 == 0){
+            return reader->line;
+        }
+
+        reader->line[--length] = '\0';
+        if(continuationPrompt){
+            fflush(stdout);
+            if(write(STDOUT_FILENO, continuationPrompt, strlen(continuationPrompt)) == -1 && errno != EPIPE){
+                perror("Error writing prompt");
+            }
+        }
+        if(!ReadPhysicalLine(reader, &length)){
+            return reader->line;  // End of input right after the backslash
+        }
+    }
+}
+
+
+/*
+ * Function: ReadHereDocuments
+ * ---------------------------
+ * Reads the bodies of a line's '<<' redirections from the input, one
+ * after the other, each up to a line holding only its delimiter. With
+ * an unquoted delimiter variables are expanded and '\\' escapes '$'
+ * and '\\'. The bodies stay in the line arena
+ *
+ * Parameters:
+ *   first - The parsed line, stages follow through next
+ *
+ * Returns:
+ *   None
+ */
+void ReadHereDocuments(ShellCommand* first){
+    for(ShellCommand* stage = first; stage; stage = stage->next){
+        for(Redirect* redirect = stage->redirects; redirect; redirect = redirect->next){
+            if(redirect->hereEnd == NULL){
+                continue;
+            }
+
+            size_t length = 0;
+            size_t capacity = 0;
+            char* body = NULL;
+            char number[24];
+            for(;;){
+                char* line = ReadHereLine();
+                if(line == NULL){
+                    fprintf(stderr, "Warning: Here-document ended by end of input (wanted '%s')\n", redirect->hereEnd);
+                    break;
+                }
+                if(redirect->hereFlags & HERE_STRIP_TABS){
+                    line += strspn(line, "\t");
+                }
+                if(strcmp(line, redirect->hereEnd) == 0){
+                    break;
+                }
+                if(!(redirect->hereFlags & HERE_EXPAND)){
+                    body = HereAppend(body, &length, &capacity, line, strlen(line));
+                    body = HereAppend(body, &length, &capacity, "\n", 1);
+                    continue;
+                }
+
+                // Copy the runs between references, expanding each reference
+                const char* start = line;
+                const char* c = line;
+                while(*c){
+                    if(*c == '\\' && (c[1] == '$' || c[1] == '\\')){
+                        body = HereAppend(body, &length, &capacity, start, c - start);
+                        start = c + 1;
+                        c += 2;
+                    }
+                    else if(*c == '$'){
+                        body = HereAppend(body, &length, &capacity, start, c - start);
+                        const char* end;
+                        const char* value = VariableReference(c, &end, number);
+                        if(end == NULL || end == c + 1){
+                            start = c;  // Not a reference, the '$' stays
+                            c++;
+                            continue;
+                        }
+                        if(value){
+                            body = HereAppend(body, &length, &capacity, value, strlen(value));
+                        }
+                        start = end;
+                        c = end;
+                    }
+                    else{
+                        c++;
+                    }
+                }
+                body = HereAppend(body, &length, &capacity, start, c - start);
+                body = HereAppend(body, &length, &capacity, "\n", 1);
+            }
+            if(body){
+                redirect->path = body;
+                redirect->length = length;
+            }
+        }
+    }
+}
+
+
+/*
+ * Function: ReadHereLine
+ * ----------------------
+ * Reads one line of a here-document body, under a "> " prompt when
+ * interactive. Backslashes at the end of the line are kept
+ *
+ * Parameters:
+ *   None
+ *
+ * Returns:
+ *   The line without its newline, valid until the next read, or NULL at
+ *   end of input
+ */
+char* ReadHereLine(){
+    if(interactive && lineEditing){
+        return EditLine("> ", 2);
+    }
+    if(interactive){
+        fflush(stdout);
+        if(write(STDOUT_FILENO, "> ", 2) == -1 && errno != EPIPE){
+            perror("Error writing prompt");
+        }
+    }
+
+    size_t length = 0;
+    if(!ReadPhysicalLine(&inputReader, &length)){
+        return NULL;
+    }
+    if(length > 0 && inputReader.line[length - 1] == '\r'){
+        inputReader.line[--length] = '\0';  // Tolerate CRLF scripts
+    }
+    return inputReader.line;
+}
+
+
+/*
+ * Function: HereAppend
+ * --------------------
+ * Appends bytes to a here-document body in the line arena, moving it to
+ * a block twice the size when it is full
+ *
+ * Parameters:
+ *   body     - The body so far, NULL before the first append
+ *   length   - Bytes in body, updated
+ *   capacity - Bytes body has room for, updated
+ *   bytes    - What to append
+ *   count    - How many bytes
+ *
+ * Returns:
+ *   The body, NUL terminated, possibly moved
+ */
+char* HereAppend(char* body, size_t* length, size_t* capacity, const char* bytes, size_t count){
+    if(*length + count + 1 > *capacity){
+        size_t size = *capacity ? *capacity : INITIAL_LINE_SIZE;
+        while(*length + count + 1 > size){
+            size *= 2;
+        }
+        char* grown = (char*)ArenaAlloc(&lineArena, size);
+        if(*length){
+            memcpy(grown, body, *length);
+        }
+        body = grown;
+        *capacity = size;
+    }
+    memcpy(body + *length, bytes, count);
+    *length += count;
+    body[*length] = '\0';
+    return body;
+}
+
+
+/*
+ * Function: ParseCommandLine
+ * --------------------------
+ * Parses the user input into a ShellCommand struct, extracting the command,
+ * arguments, and input/output files. Stages separated by '|' are chained
+ * through the next field
+ *
+ * Parameters:
+ *   input - The raw user input string
+ *   arena - Arena that owns the parsed strings and argument array
+ *
+ * Returns:
+ *   A ShellCommand struct containing parsed command data, the first
+ *   stage when the line is a pipeline
+ */
+ShellCommand ParseCommandLine(char* input, Arena* arena) {
+    ShellCommand command;
+    ShellCommand* stage = &command;
+
+    Lexer lexer;
+    LexerInit(&lexer, input, arena);
+
+    // Each pass of the outer loop fills one pipeline stage
+    for(;;){
+        stage->redirects = NULL;
+        stage->syntaxError = 0;
+        stage->background = 0;
+        stage->assignments = NULL;
+        stage->next = NULL;
+
+        int capacity = INITIAL_ARG_SIZE;
+        int count = 0;
+        int assignmentCount = 0;
+        Redirect* lastRedirect = NULL;
+
+        // Allocate memory for argument list
+        stage->args = (char**)ArenaAlloc(arena, capacity * sizeof(char*));
+        stage->args[0] = NULL;
+
+        // Tokens are slices of the input line, nothing is copied here
+        Token token;
+        for(;;){
+            lexer.commandWord = count == 0;
+            token = NextToken(&lexer);
+            if(token.kind == TOKEN_END || token.kind == TOKEN_PIPE){
+                break;
+            }
+            if(token.kind == TOKEN_BACKGROUND){
+                // '&' may only end the line
+                if(NextToken(&lexer).kind != TOKEN_END){
+                    fprintf(stderr, "Error: '&' must end the command line\n");
+                    command.args[0] = NULL;
+                    command.next = NULL;
+                    command.syntaxError = 1;
+                    return command;
+                }
+                command.background = 1;
+                token.kind = TOKEN_END;
+                break;
+            }
+            if(token.kind == TOKEN_ERROR){
+                command.args[0] = NULL;
+                command.next = NULL;
+                command.syntaxError = 1;
+                return command;
+            }
+
+            // Redirections are kept in order, '<<' only notes its delimiter until the line has been read
+            if(token.kind >= TOKEN_REDIRECT_IN && token.kind <= TOKEN_HERE_STRING){
+                Token word = NextToken(&lexer);
+                if(word.kind != TOKEN_WORD){
+                    if(word.kind != TOKEN_ERROR){
+                        fprintf(stderr, "Error: Expected %s after '%s'\n", token.kind >= TOKEN_DUP_IN ? "a word" : "a filename",
+                                OperatorText(token.kind));
+                    }
+                    command.args[0] = NULL;
+                    command.next = NULL;
+                    command.syntaxError = 1;
+                    return command;
+                }
+
+                if(token.kind == TOKEN_DUP_IN || token.kind == TOKEN_DUP_OUT){
+                    int fd = token.fd != -1 ? token.fd : token.kind == TOKEN_DUP_IN ? 0 : 1;
+                    if(strcmp(word.text, "-") == 0){
+                        AddRedirect(stage, &lastRedirect, REDIRECT_CLOSE, fd, arena);
+                        continue;
+                    }
+                    if(isdigit((unsigned char)word.text[0]) && word.text[1] == '\0'){
+                        AddRedirect(stage, &lastRedirect, REDIRECT_DUP, fd, arena)->source = word.text[0] - '0';
+                        continue;
+                    }
+                    if(token.kind == TOKEN_DUP_IN || token.fd != -1){
+                        fprintf(stderr, "Error: Bad file descriptor '%s'\n", word.text);
+                        command.args[0] = NULL;
+                        command.next = NULL;
+                        command.syntaxError = 1;
+                        return command;
+                    }
+                    token.kind = TOKEN_REDIRECT_ALL;  // '>&file' is '&>file'
+                }
+
+                if(token.kind >= TOKEN_HERE_DOC){
+                    if(word.glob){
+                        GlobUnescape(word.text);  // Neither a delimiter nor a here-string is a pattern
+                    }
+                    Redirect* redirect = AddRedirect(stage, &lastRedirect, REDIRECT_HERE, token.fd != -1 ? token.fd : 0, arena);
+                    if(token.kind == TOKEN_HERE_STRING){
+                        // The word is the text, with a newline added
+                        size_t length = strlen(word.text);
+                        redirect->path = (char*)ArenaAlloc(arena, length + 2);
+                        memcpy(redirect->path, word.text, length);
+                        redirect->path[length] = '\n';
+                        redirect->path[length + 1] = '\0';
+                        redirect->length = length + 1;
+                    }
+                    else{
+                        redirect->path = ArenaStrdup(arena, "");  // Empty until ReadHereDocuments reads the body
+                        redirect->hereEnd = word.text;
+                        redirect->hereFlags = (lexer.quoted ? 0 : HERE_EXPAND) | (token.kind == TOKEN_HERE_DOC_TABS ? HERE_STRIP_TABS : 0);
+                    }
+                    continue;
+                }
+
+                if(word.glob){
+                    // A pattern may name one file, or be taken as typed when it matches none
+                    char** matches;
+                    size_t found = ExpandGlob(word.text, arena, &matches);
+                    if(found > 1){
+                        fprintf(stderr, "Error: Ambiguous redirect '%s'\n", word.text);
+                        command.args[0] = NULL;
+                        command.next = NULL;
+                        command.syntaxError = 1;
+                        return command;
+                    }
+                    if(found == 1){
+                        word.text = matches[0];
+                    }
+                    else{
+                        GlobUnescape(word.text);
+                    }
+                }
+
+                Redirect* redirect;
+                switch(token.kind){
+                    case TOKEN_REDIRECT_IN:
+                        redirect = AddRedirect(stage, &lastRedirect, REDIRECT_READ, token.fd != -1 ? token.fd : 0, arena);
+                        break;
+                    case TOKEN_REDIRECT_READ_WRITE:
+                        redirect = AddRedirect(stage, &lastRedirect, REDIRECT_READ_WRITE, token.fd != -1 ? token.fd : 0, arena);
+                        break;
+                    case TOKEN_REDIRECT_OUT:
+                    case TOKEN_REDIRECT_ALL:
+                        redirect = AddRedirect(stage, &lastRedirect, REDIRECT_WRITE, token.fd != -1 ? token.fd : 1, arena);
+                        break;
+                    default:
+                        redirect = AddRedirect(stage, &lastRedirect, REDIRECT_APPEND, token.fd != -1 ? token.fd : 1, arena);
+                        break;
+                }
+                redirect->path = word.text;
+                if(token.kind == TOKEN_REDIRECT_ALL || token.kind == TOKEN_REDIRECT_APPEND_ALL){
+                    AddRedirect(stage, &lastRedirect, REDIRECT_DUP, STDERR_FILENO, arena)->source = STDOUT_FILENO;
+                }
+                continue;
+            }
+
+            if(token.assignment){
+                // NAME=value before the command, its value is never a pattern
+                if(token.glob){
+                    GlobUnescape(token.text);
+                }
+                if((assignmentCount & (assignmentCount + 1)) == 0){
+                    // Full at 0, 1, 3, 7... entries, so grow to the next power of two
+                    char** grown = (char**)ArenaAlloc(arena, 2 * (assignmentCount + 1) * sizeof(char*));
+                    if(assignmentCount > 0){
+                        memcpy(grown, stage->assignments, assignmentCount * sizeof(char*));
+                    }
+                    stage->assignments = grown;
+                }
+                stage->assignments[assignmentCount++] = token.text;
+                stage->assignments[assignmentCount] = NULL;
+            }
+            else{
+                // A pattern is replaced by its matches, or taken as typed when it matches none
+                char** words = &token.text;
+                size_t found = 1;
+                if(token.glob){
+                    found = ExpandGlob(token.text, arena, &words);
+                    if(found == 0){
+                        GlobUnescape(token.text);
+                        words = &token.text;
+                        found = 1;
+                    }
+                }
+
+                // Resize argument list if needed
+                if(count + found >= (size_t)capacity){
+                    while(count + found >= (size_t)capacity){
+                        capacity *= 2;
+                    }
+                    char** grown = (char**)ArenaAlloc(arena, capacity * sizeof(char*));
+                    memcpy(grown, stage->args, count * sizeof(char*));
+                    stage->args = grown;
+                }
+                memcpy(stage->args + count, words, found * sizeof(char*));
+                count += found;
+            }
+        }
+        stage->args[count] = NULL; // Null-terminate the argument list
+
+        // Every stage of a pipeline needs a command, and so does '&'
+        int piped = token.kind == TOKEN_PIPE || stage != &command;
+        if(command.background && count == 0){
+            fprintf(stderr, "Error: Missing command before '&'\n");
+            command.args[0] = NULL;
+            command.next = NULL;
+            command.syntaxError = 1;
+            return command;
+        }
+        if(piped && count == 0){
+            fprintf(stderr, "Error: Missing command %s '|'\n", token.kind == TOKEN_PIPE ? "before" : "after");
+            command.args[0] = NULL;
+            command.next = NULL;
+            command.syntaxError = 1;
+            return command;
+        }
+
+        if(token.kind == TOKEN_END){
+            return command;
+        }
+        stage->next = (ShellCommand*)ArenaAlloc(arena, sizeof(ShellCommand));
+        stage = stage->next;
+    }
+}
+
+
+/*
+ * Function: AddRedirect
+ * ---------------------
+ * Appends a redirection to a stage's list
+ *
+ * Parameters:
+ *   stage - The stage being parsed
+ *   last  - The stage's last redirection so far, updated
+ *   kind  - What the redirection does
+ *   fd    - The descriptor it redirects
+ *   arena - Arena the redirection is allocated in
+ *
+ * Returns:
+ *   The new redirection, with everything else zeroed
+ */
+Redirect* AddRedirect(ShellCommand* stage, Redirect** last, RedirectKind kind, int fd, Arena* arena){
+    Redirect* redirect = (Redirect*)ArenaAlloc(arena, sizeof(Redirect));
+    memset(redirect, 0, sizeof(Redirect));
+    redirect->kind = kind;
+    redirect->fd = fd;
+    redirect->source = -1;
+    if(*last){
+        (*last)->next = redirect;
+    }
+    else{
+        stage->redirects = redirect;
+    }
+    *last = redirect;
+    return redirect;
+}
+
+
+/*
+ * Function: OperatorText
+ * ----------------------
+ * Spells out a redirection operator for error messages
+ *
+ * Parameters:
+ *   kind - A redirection token kind
+ *
+ * Returns:
+ *   The operator as typed
+ */
+const char* OperatorText(TokenKind kind){
+    static const char* const texts[] = { "<", ">", ">>", "<>", "&>", "&>>", "<&", ">&", "<<", "<<-", "<<<" };
+    return texts[kind - TOKEN_REDIRECT_IN];
+}
+
+
+/*
+ * Function: LexerInit
+ * -------------------
+ * Prepares a lexer to walk an input line
+ *
+ * Parameters:
+ *   lexer - The lexer to initialise
+ *   input - The line to tokenize, it is modified in place
+ *   arena - Arena for the rare glob word that has to grow
+ *
+ * Returns:
+ *   None
+ */
+void LexerInit(Lexer* lexer, char* input, Arena* arena){
+    lexer->pos = input;
+    lexer->pending = TOKEN_END;
+    lexer->arena = arena;
+    lexer->commandWord = 0;
+}
+
+
+/*
+ * Function: OperatorKind
+ * ----------------------
+ * Reads an operator and maps it to its token kind
+ *
+ * Parameters:
+ *   read - Points at '<', '>', '|' or '&', moved past the operator
+ *
+ * Returns:
+ *   The matching TokenKind
+ */
+TokenKind OperatorKind(char** read){
+    char c = *(*read)++;
+    switch(c){
+        case '<':
+            if(**read == '>'){
+                (*read)++;
+                return TOKEN_REDIRECT_READ_WRITE;
+            }
+            if(**read == '&'){
+                (*read)++;
+                return TOKEN_DUP_IN;
+            }
+            if(**read != '<'){
+                return TOKEN_REDIRECT_IN;
+            }
+            (*read)++;
+            if(**read == '<'){
+                (*read)++;
+                return TOKEN_HERE_STRING;
+            }
+            if(**read == '-'){
+                (*read)++;
+                return TOKEN_HERE_DOC_TABS;
+            }
+            return TOKEN_HERE_DOC;
+        case '>':
+            if(**read == '>'){
+                (*read)++;
+                return TOKEN_REDIRECT_APPEND;
+            }
+            if(**read == '&'){
+                (*read)++;
+                return TOKEN_DUP_OUT;
+            }
+            if(**read == '|'){
+                (*read)++;  // '>|' overrides noclobber elsewhere, here it is just '>'
+            }
+            return TOKEN_REDIRECT_OUT;
+        case '|':
+            return TOKEN_PIPE;
+        default:
+            if(**read == '>'){
+                (*read)++;
+                if(**read == '>'){
+                    (*read)++;
+                    return TOKEN_REDIRECT_APPEND_ALL;
+                }
+                return TOKEN_REDIRECT_ALL;
+            }
+            return TOKEN_BACKGROUND;
     }
-}
\ No newline at end of file
+}
+
+
+/*
+ * Function: NextToken
+ * -------------------
+ * Returns the next token of the line in a single pass. Words are NUL
+ * terminated in place, and bytes are only moved when quotes or
+ * backslashes have to be removed, so plain words cost no copying at all.
+ * Any run of spaces, tabs or other whitespace separates words, and an
+ * unquoted '#' at the start of a word begins a comment. A word with an
+ * unquoted '*', '?' or '[' is flagged as a glob pattern, in which quoted
+ * glob characters are kept behind a backslash. Variables are expanded
+ * outside quotes and inside double quotes, and an unquoted word that
+ * expands to nothing is dropped. A single digit directly in front of
+ * '<' or '>' is not a word but the descriptor the operator redirects
+ *
+ * Parameters:
+ *   lexer - The lexer state
+ *
+ * Returns:
+ *   The next token, TOKEN_END at the end of the line
+ */
+Token NextToken(Lexer* lexer){
+    Token token = { TOKEN_END, NULL, 0, 0, -1 };
+
+    // An operator may already have been consumed while ending a word
+    if(lexer->pending != TOKEN_END){
+        token.kind = lexer->pending;
+        lexer->pending = TOKEN_END;
+        return token;
+    }
+
+    char* read = lexer->pos;
+    while(*read == ' ' || *read == '\t' || *read == '\n' || *read == '\r' || *read == '\v' || *read == '\f'){
+        read++;
+    }
+
+    // A '#' starting a word comments out the rest of the line
+    if(*read == '\0' || *read == '#'){
+        lexer->pos = read + strlen(read);
+        return token;
+    }
+    if(*read == '<' || *read == '>' || *read == '|' || *read == '&'){
+        token.kind = OperatorKind(&read);
+        lexer->pos = read;
+        return token;
+    }
+
+    // Before the command name a word starting with NAME= is an assignment
+    if(lexer->commandWord){
+        const char* name = read;
+        while(isalnum((unsigned char)*name) || *name == '_'){
+            name++;
+        }
+        token.assignment = *name == '=' && name > read && !isdigit((unsigned char)*read);
+    }
+
+    // Scan a word, compacting it over removed quote and escape bytes
+    char* write = read;
+    token.kind = TOKEN_WORD;
+    token.text = read;
+    lexer->limit = NULL;
+    lexer->wordEnd = NULL;
+    lexer->checked = 0;
+    lexer->escaping = 0;
+    lexer->quoted = 0;
+    lexer->substituted = 0;
+
+    for(;;){
+        char c = *read;
+
+        if(c == '\0'){
+            break;
+        }
+        if(c == ' ' || c == '\t' || c == '\n' || c == '\r' || c == '\v' || c == '\f'){
+            read++;
+            break;
+        }
+        if((c == '<' || c == '>') && read == token.text + 1 && write == read && isdigit((unsigned char)*token.text)){
+            // A lone digit right before '<' or '>' names the descriptor to redirect
+            token.fd = *token.text - '0';
+            token.text = NULL;
+            token.kind = OperatorKind(&read);
+            lexer->pos = read;
+            return token;
+        }
+        if(c == '<' || c == '>' || c == '|' || c == '&'){
+            // The operator byte may be overwritten by the terminator below
+            lexer->pending = OperatorKind(&read);
+            break;
+        }
+
+        if(c == '\\'){
+            // A backslash keeps the next byte literally
+            lexer->quoted = 1;
+            read++;
+            if(*read == '\0'){
+                break;
+            }
+            write = LexerLiteral(lexer, &token, write, read + 1, 0, *read);
+            read++;
+        }
+        else if(c == '\''){
+            // Single quotes keep everything up to the closing quote
+            lexer->quoted = 1;
+            read++;
+            while(*read != '\''){
+                if(*read == '\0'){
+                    fprintf(stderr, "Error: Unterminated single quote\n");
+                    token.kind = TOKEN_ERROR;
+                    token.text = NULL;
+                    return token;
+                }
+                write = LexerLiteral(lexer, &token, write, read + 1, '\'', *read);
+                read++;
+            }
+            read++;
+        }
+        else if(c == '"'){
+            // Double quotes expand variables and only let a backslash escape '"', '\\' and '$'
+            lexer->quoted = 1;
+            read++;
+            while(*read != '"'){
+                if(*read == '\0'){
+                    fprintf(stderr, "Error: Unterminated double quote\n");
+                    token.kind = TOKEN_ERROR;
+                    token.text = NULL;
+                    return token;
+                }
+                if(*read == '$'){
+                    write = LexerExpand(lexer, &token, write, &read, '"');
+                    if(write == NULL){
+                        token.kind = TOKEN_ERROR;
+                        token.text = NULL;
+                        return token;
+                    }
+                    continue;
+                }
+                if(*read == '\\' && (read[1] == '"' || read[1] == '\\' || read[1] == '$')){
+                    read++;
+                }
+                write = LexerLiteral(lexer, &token, write, read + 1, '"', *read);
+                read++;
+            }
+            read++;
+        }
+        else if(c == '$'){
+            write = LexerExpand(lexer, &token, write, &read, 0);
+            if(write == NULL){
+                token.kind = TOKEN_ERROR;
+                token.text = NULL;
+                return token;
+            }
+        }
+        else{
+            // Take the whole run of bytes that need no attention at once
+            size_t run = 1;
+            if(c == '*' || c == '?' || c == '['){
+                token.glob = 1;
+            }
+            else{
+                // strcspn() has a vector path for up to 16 bytes, so the rare '\f' is found separately
+                run = strcspn(read, WORD_SPECIAL_CHARS);
+                const char* formFeed = (const char*)memchr(read, '\f', run);
+                if(formFeed){
+                    run = formFeed - read;
+                }
+            }
+            if(write != read){
+                memmove(write, read, run);
+            }
+            // Otherwise nothing has been removed yet, so the bytes are already in place
+            write += run;
+            read += run;
+        }
+    }
+
+    *write = '\0';
+    lexer->pos = read;
+
+    // "$EMPTY" is an empty argument, $EMPTY is none at all
+    if(write == token.text && lexer->substituted && !lexer->quoted){
+        return NextToken(lexer);
+    }
+    return token;
+}
+
+
+/*
+ * Function: LexerLiteral
+ * ----------------------
+ * Writes a quoted, escaped or expanded byte of a word. Once a word turns
+ * out to be a glob pattern, glob characters and backslashes written this
+ * way get a backslash in front so they only match themselves. Whether a
+ * word is a pattern is decided at its first such byte, by looking ahead.
+ * The escapes may not fit where the quotes were, so the word then moves
+ * to the arena
+ *
+ * Parameters:
+ *   lexer - The lexer state
+ *   token - The word being scanned
+ *   write - Where the byte goes
+ *   rest  - The unread input after the byte
+ *   quote - The quote the byte is inside of, or 0
+ *   c     - The byte
+ *
+ * Returns:
+ *   Where the next byte goes
+ */
+char* LexerLiteral(Lexer* lexer, Token* token, char* write, const char* rest, char quote, char c){
+    if(c == '*' || c == '?' || c == '[' || c == ']' || c == '\\'){
+        if(!lexer->checked){
+            lexer->checked = 1;
+            int glob = 0;
+            ScanRawWord(rest, quote, &glob);
+            if(token->glob || glob){
+                lexer->escaping = 1;
+                write = LexerReserve(lexer, token, write, rest, quote, 2);
+            }
+        }
+        if(lexer->escaping){
+            *write++ = '\\';
+        }
+    }
+    *write++ = c;
+    return write;
+}
+
+
+/*
+ * Function: LexerExpand
+ * ---------------------
+ * Expands the variable reference at *read. The value is written as if
+ * it had been quoted, so it is neither split into words nor taken as a pattern.
+ * A '$' that starts none of these is kept as typed
+ *
+ * Parameters:
+ *   lexer - The lexer state
+ *   token - The word being scanned
+ *   write - Where the value goes
+ *   read  - Points at the '$', moved past the reference
+ *   quote - The quote the reference is inside of, or 0
+ *
+ * Returns:
+ *   Where the next byte goes, or NULL after printing an error
+ */
+char* LexerExpand(Lexer* lexer, Token* token, char* write, char** read, char quote){
+    const char* end;
+    char number[24];
+    const char* value = VariableReference(*read, &end, number);
+    if(end == NULL){
+        return NULL;
+    }
+    if(end == *read + 1){
+        // Only one byte was read, so even in place it fits
+        (*read)++;
+        *write++ = '$';
+        return write;
+    }
+
+    *read = (char*)end;
+    lexer->substituted = 1;
+    if(value == NULL || *value == '\0'){
+        return write;
+    }
+
+    // Decide on escaping before writing, the whole value has to fit either way
+    size_t length = strlen(value);
+    if(!lexer->checked && strpbrk(value, "*?[]\\")){
+        lexer->checked = 1;
+        int glob = 0;
+        ScanRawWord(end, quote, &glob);
+        lexer->escaping = token->glob || glob;
+    }
+    write = LexerReserve(lexer, token, write, end, quote, lexer->escaping ? 2 * length : length);
+    for(size_t i = 0; i < length; i++){
+        write = LexerLiteral(lexer, token, write, end, quote, value[i]);
+    }
+    return write;
+}
+
+
+/*
+ * Function: VariableReference
+ * ---------------------------
+ * Looks up the variable reference starting at a '$': $NAME, ${NAME}, $?
+ * (the last status) or $$ (the shell's pid)
+ *
+ * Parameters:
+ *   text   - Points at the '$'
+ *   end    - Receives the byte after the reference, text + 1 if there is
+ *            none, or NULL after a malformed ${...} (an error is printed)
+ *   number - Room for 24 bytes, holds the value of $? and $$
+ *
+ * Returns:
+ *   The value, or NULL if the variable is unset or there is no reference
+ */
+const char* VariableReference(const char* text, const char** end, char* number){
+    const char* name = text + 1;
+    *end = name;
+    if(*name == '?' || *name == '$'){
+        snprintf(number, 24, "%d", *name == '?' ? lastStatus : (int)shellPid);
+        *end = name + 1;
+        return number;
+    }
+
+    size_t length;
+    if(*name == '{'){
+        name++;
+        const char* close = strchr(name, '}');
+        if(close == NULL || !IsVariableName(name, close - name)){
+            fprintf(stderr, "Error: Bad substitution\n");
+            *end = NULL;
+            return NULL;
+        }
+        length = close - name;
+        *end = close + 1;
+    }
+    else{
+        const char* scan = name;
+        if(isalpha((unsigned char)*scan) || *scan == '_'){
+            while(isalnum((unsigned char)*scan) || *scan == '_'){
+                scan++;
+            }
+        }
+        if(scan == name){
+            return NULL;  // A '$' starting no name is kept as typed
+        }
+        length = scan - name;
+        *end = scan;
+    }
+
+    Variable* variable = FindVariable(name, length);
+    return variable && variable->isSet ? variable->entry + length + 1 : NULL;
+}
+
+
+/*
+ * Function: LexerReserve
+ * ----------------------
+ * Makes room for extra bytes in the word being scanned. A word is written
+ * over its own input while nothing it writes can overtake the unread
+ * bytes. Otherwise it moves to the arena, with room for the rest of the
+ * word even if every byte gets escaped
+ *
+ * Parameters:
+ *   lexer - The lexer state
+ *   token - The word being scanned
+ *   write - Where the next byte goes
+ *   rest  - The unread input
+ *   quote - The quote rest starts inside of, or 0
+ *   extra - Bytes about to be written
+ *
+ * Returns:
+ *   Where the next byte goes, which is in the arena if the word moved
+ */
+char* LexerReserve(Lexer* lexer, Token* token, char* write, const char* rest, char quote, size_t extra){
+    if(lexer->limit == NULL && !lexer->escaping && write + extra <= rest){
+        return write;
+    }
+    if(lexer->wordEnd == NULL){
+        lexer->wordEnd = ScanRawWord(rest, quote, NULL);
+    }
+
+    size_t used = write - token->text;
+    size_t needed = used + extra + 2 * (lexer->wordEnd - rest) + 1;
+    if(lexer->limit && token->text + needed <= lexer->limit){
+        return write;
+    }
+
+    // Doubling keeps a word with many long expansions linear
+    char* moved = (char*)ArenaAlloc(lexer->arena, 2 * needed);
+    memcpy(moved, token->text, used);
+    token->text = moved;
+    lexer->limit = moved + 2 * needed;
+    return moved + used;
+}
+
+
+/*
+ * Function: ScanRawWord
+ * ---------------------
+ * Looks ahead through the unread part of a word, without changing
+ * anything, for where it ends and for an unquoted glob character
+ *
+ * Parameters:
+ *   text  - The unread input
+ *   quote - The quote text starts inside of, or 0
+ *   glob  - Set to 1 if the word has an unquoted '*', '?' or '[', may be NULL
+ *
+ * Returns:
+ *   The byte ending the word
+ */
+const char* ScanRawWord(const char* text, char quote, int* glob){
+    for(; *text; text++){
+        if(quote){
+            if(*text == quote){
+                quote = 0;
+            }
+            else if(quote == '"' && *text == '\\' && text[1] != '\0'){
+                text++;
+            }
+            continue;
+        }
+        switch(*text){
+            case ' ': case '\t': case '\n': case '\r': case '\v': case '\f':
+            case '<': case '>': case '|': case '&':
+                return text;
+            case '*': case '?': case '[':
+                if(glob){
+                    *glob = 1;
+                }
+                break;
+            case '\'': case '"':
+                quote = *text;
+                break;
+            case '$':
+                // $? is the last status, not a pattern
+                if(text[1] == '?' || text[1] == '$'){
+                    text++;
+                }
+                break;
+            case '\\':
+                if(text[1] != '\0'){
+                    text++;
+                }
+                break;
+        }
+    }
+    return text;
+}
+
+
+/*
+ * Function: ExpandGlob
+ * --------------------
+ * Expands a glob pattern against the file system. '*' matches any run of
+ * bytes and '?' any one character within a path component, '[...]' one
+ * byte from a set ('!' or '^' negates, ranges and [:class:] allowed) and
+ * a component that is exactly '**' any number of directories. Hidden
+ * names only match a component starting with a literal '.', and '.' and
+ * '..' are never matched. The pattern is compiled once, and directories
+ * come from the listing cache
+ *
+ * Parameters:
+ *   pattern - The pattern, a backslash makes the next byte literal
+ *   arena   - Arena that owns the compiled pattern and the matches
+ *   matches - Receives the matching paths, sorted
+ *
+ * Returns:
+ *   The number of matches
+ */
+size_t ExpandGlob(const char* pattern, Arena* arena, char*** matches){
+    Glob glob;
+    memset(&glob, 0, sizeof(glob));
+    glob.arena = arena;
+
+    // One part per path component, an empty one keeps a "//" as typed
+    size_t patternLength = strlen(pattern);
+    glob.parts = (GlobPart*)ArenaAlloc(arena, (patternLength + 2) * sizeof(GlobPart));
+    const char* start = pattern[0] == '/' ? pattern + 1 : pattern;
+    while(*start){
+        const char* end = start;
+        while(*end && *end != '/'){
+            end += (*end == '\\' && end[1]) ? 2 : 1;
+        }
+        CompileGlobPart(&glob.parts[glob.count++], start, end - start, arena);
+        if(*end == '\0'){
+            break;
+        }
+        glob.directoriesOnly = end[1] == '\0';
+        start = end + 1;
+    }
+
+    // A trailing '**' matches the directory and everything below it
+    if(glob.count > 0 && glob.parts[glob.count - 1].kind == GLOB_PART_RECURSIVE){
+        glob.count--;
+        glob.recursiveTail = 1;
+    }
+
+    char path[PATH_MAX];
+    size_t length = 0;
+    if(pattern[0] == '/'){
+        path[length++] = '/';
+    }
+    path[length] = '\0';
+    if(glob.count > 0 || glob.recursiveTail){
+        GlobWalk(&glob, 0, path, length);
+    }
+
+    qsort(glob.matches, glob.matchCount, sizeof(char*), CompareStrings);
+    *matches = glob.matches;
+    return glob.matchCount;
+}
+
+
+/*
+ * Function: CompileGlobPart
+ * -------------------------
+ * Turns one path component of a pattern into a list of match steps:
+ * literal runs, '?', sets and '*'. A component without glob characters
+ * stays a literal and costs no directory read at all
+ *
+ * Parameters:
+ *   part   - Receives the compiled component
+ *   text   - The component, with backslash escapes
+ *   length - Its length
+ *   arena  - Arena for the steps and literal text
+ *
+ * Returns:
+ *   None
+ */
+void CompileGlobPart(GlobPart* part, const char* text, size_t length, Arena* arena){
+    memset(part, 0, sizeof(GlobPart));
+    if(length == 2 && text[0] == '*' && text[1] == '*'){
+        part->kind = GLOB_PART_RECURSIVE;
+        return;
+    }
+
+    // Unescaped literal bytes are gathered here, steps point into it
+    char* literal = (char*)ArenaAlloc(arena, length + 1);
+    size_t literalLength = 0;
+    part->ops = (GlobOp*)ArenaAlloc(arena, (length + 1) * sizeof(GlobOp));
+    part->dotted = text[0] == '.' || (text[0] == '\\' && text[1] == '.');
+    int wild = 0;
+
+    for(size_t i = 0; i < length; i++){
+        GlobOp* op = part->opCount ? &part->ops[part->opCount - 1] : NULL;
+        char c = text[i];
+
+        if(c == '*'){
+            if(!op || op->kind != GLOB_STAR){
+                part->ops[part->opCount++] = (GlobOp){ GLOB_STAR, 0, NULL, NULL };
+            }
+            wild = 1;
+            continue;
+        }
+        if(c == '?'){
+            part->ops[part->opCount++] = (GlobOp){ GLOB_ANY, 0, NULL, NULL };
+            part->minLength++;
+            wild = 1;
+            continue;
+        }
+        if(c == '['){
+            unsigned char* set = (unsigned char*)ArenaAlloc(arena, 32);
+            size_t end = CompileGlobSet(text, length, i, set);
+            if(end != 0){
+                part->ops[part->opCount++] = (GlobOp){ GLOB_SET, 0, NULL, set };
+                part->minLength++;
+                wild = 1;
+                i = end;
+                continue;
+            }
+            // An unclosed '[' is an ordinary byte
+        }
+
+        if(c == '\\' && i + 1 < length){
+            c = text[++i];
+        }
+        if(op && op->kind == GLOB_LITERAL && op->text + op->length == literal + literalLength){
+            op->length++;
+        }
+        else{
+            part->ops[part->opCount++] = (GlobOp){ GLOB_LITERAL, 1, literal + literalLength, NULL };
+        }
+        literal[literalLength++] = c;
+        part->minLength++;
+    }
+    literal[literalLength] = '\0';
+
+    if(!wild){
+        part->kind = GLOB_PART_LITERAL;
+        part->text = literal;
+        return;
+    }
+    part->kind = GLOB_PART_MATCH;
+
+    // "*.log" style patterns reject most names on their last bytes alone
+    GlobOp* last = &part->ops[part->opCount - 1];
+    if(last->kind == GLOB_LITERAL && part->opCount > 1){
+        part->suffix = last->text;
+        part->suffixLength = last->length;
+    }
+}
+
+
+/*
+ * Function: CompileGlobSet
+ * ------------------------
+ * Compiles a bracket expression into a 256-bit set of bytes
+ *
+ * Parameters:
+ *   text   - The pattern component
+ *   length - Its length
+ *   start  - Offset of the '['
+ *   set    - Receives the set, 32 bytes
+ *
+ * Returns:
+ *   Offset of the closing ']', or 0 if there is none
+ */
+size_t CompileGlobSet(const char* text, size_t length, size_t start, unsigned char* set){
+    static const struct{
+        const char* name;
+        int (*test)(int);
+    } classes[] = {
+        { "alnum", isalnum }, { "alpha", isalpha }, { "blank", isblank }, { "cntrl", iscntrl },
+        { "digit", isdigit }, { "graph", isgraph }, { "lower", islower }, { "print", isprint },
+        { "punct", ispunct }, { "space", isspace }, { "upper", isupper }, { "xdigit", isxdigit },
+    };
+
+    memset(set, 0, 32);
+    size_t i = start + 1;
+    int negate = i < length && (text[i] == '!' || text[i] == '^');
+    if(negate){
+        i++;
+    }
+
+    // A ']' right after the '[' (and any '!') is a member, not the end
+    for(size_t first = i; i < length; i++){
+        unsigned char low = text[i];
+        if(low == ']' && i > first){
+            break;
+        }
+        if(low == '[' && i + 1 < length && text[i + 1] == ':'){
+            const char* close = strstr(text + i + 2, ":]");
+            if(close && close < text + length){
+                size_t nameLength = close - (text + i + 2);
+                for(size_t k = 0; k < sizeof(classes) / sizeof(classes[0]); k++){
+                    if(strlen(classes[k].name) == nameLength && strncmp(classes[k].name, text + i + 2, nameLength) == 0){
+                        for(int b = 0; b < 128; b++){
+                            if(classes[k].test(b)){
+                                set[b >> 3] |= 1 << (b & 7);
+                            }
+                        }
+                    }
+                }
+                i = close + 1 - text;
+                continue;
+            }
+        }
+        if(low == '\\' && i + 1 < length){
+            low = text[++i];
+        }
+        unsigned char high = low;
+        if(i + 2 < length && text[i + 1] == '-' && text[i + 2] != ']'){
+            i += 2;
+            if(text[i] == '\\' && i + 1 < length){
+                i++;
+            }
+            high = text[i];
+        }
+        for(unsigned int b = low; b <= high; b++){
+            set[b >> 3] |= 1 << (b & 7);
+        }
+    }
+    if(i >= length){
+        return 0;
+    }
+
+    if(negate){
+        for(int b = 0; b < 32; b++){
+            set[b] = ~set[b];
+        }
+    }
+    set[0] &= ~1;  // Never NUL
+    set['/' >> 3] &= ~(1 << ('/' & 7));
+    return i;
+}
+
+
+/*
+ * Function: GlobMatch
+ * -------------------
+ * Matches a name against a compiled component. Only the most recent '*'
+ * is ever backtracked to, so a match takes time proportional to the name
+ * times the steps at worst, without recursion
+ *
+ * Parameters:
+ *   part   - The compiled component
+ *   name   - The name
+ *   length - Its length
+ *
+ * Returns:
+ *   1 on a match, 0 otherwise
+ */
+int GlobMatch(const GlobPart* part, const char* name, size_t length){
+    if(length < part->minLength){
+        return 0;
+    }
+    if(part->suffixLength && memcmp(name + length - part->suffixLength, part->suffix, part->suffixLength) != 0){
+        return 0;
+    }
+
+    int op = 0, starOp = -1;
+    size_t pos = 0, starPos = 0;
+    for(;;){
+        if(op < part->opCount){
+            const GlobOp* step = &part->ops[op];
+            if(step->kind == GLOB_STAR){
+                starOp = op++;
+                starPos = pos;
+                continue;
+            }
+            if(pos < length){
+                unsigned char c = name[pos];
+                if(step->kind == GLOB_LITERAL){
+                    if(length - pos >= step->length && memcmp(name + pos, step->text, step->length) == 0){
+                        pos += step->length;
+                        op++;
+                        continue;
+                    }
+                }
+                else if(step->kind == GLOB_ANY){
+                    // One character, all of a UTF-8 sequence
+                    pos++;
+                    while(c >= 0xC0 && pos < length && ((unsigned char)name[pos] & 0xC0) == 0x80){
+                        pos++;
+                    }
+                    op++;
+                    continue;
+                }
+                else if(step->set[c >> 3] & (1 << (c & 7))){
+                    pos++;
+                    op++;
+                    continue;
+                }
+            }
+        }
+        else if(pos == length){
+            return 1;
+        }
+
+        // Let the last '*' swallow one more byte and try again
+        if(starOp == -1 || starPos >= length){
+            return 0;
+        }
+        pos = ++starPos;
+        op = starOp + 1;
+    }
+}
+
+
+/*
+ * Function: GlobWalk
+ * ------------------
+ * Matches the pattern's components from one onwards below a path,
+ * adding every complete match
+ *
+ * Parameters:
+ *   glob   - The expansion in progress
+ *   index  - The component to match next
+ *   path   - The path so far, PATH_MAX bytes, extended and restored here
+ *   length - Length of path
+ *
+ * Returns:
+ *   None
+ */
+void GlobWalk(Glob* glob, int index, char* path, size_t length){
+    if(index == glob->count){
+        if(glob->recursiveTail){
+            GlobAddTree(glob, path, length, 1);
+        }
+        else{
+            GlobAddMatch(glob, path, length);
+        }
+        return;
+    }
+
+    // Names go after a '/' unless path is empty or the root. The '/' is only
+    // written in front of a name, so path itself can still be listed
+    const GlobPart* part = &glob->parts[index];
+    size_t base = length > 0 && !(length == 1 && path[0] == '/') ? length + 1 : length;
+
+    if(part->kind == GLOB_PART_LITERAL){
+        size_t textLength = strlen(part->text);
+        if(base + textLength < PATH_MAX){
+            path[length] = '/';
+            memcpy(path + base, part->text, textLength + 1);
+            GlobWalk(glob, index + 1, path, base + textLength);
+        }
+        path[length] = '\0';
+        return;
+    }
+
+    const DirListing* listing = ListDirectory(length ? path : ".");
+    if(listing == NULL){
+        path[length] = '\0';
+        return;
+    }
+    int last = index + 1 == glob->count;
+    int recursive = part->kind == GLOB_PART_RECURSIVE;
+
+    // Deeper levels reuse the cache, so take what is needed from this listing first
+    char** names = NULL;
+    size_t count = 0;
+    if(!last || recursive){
+        names = (char**)ArenaAlloc(glob->arena, (listing->count + 1) * sizeof(char*));
+    }
+    for(size_t i = 0; i < listing->count; i++){
+        const DirEntry* entry = &listing->entries[i];
+        if(entry->name[0] == '.' && (recursive || !part->dotted || (entry->length <= 2 && (entry->length == 1 || entry->name[1] == '.')))){
+            continue;  // Hidden names need a literal '.', and '.' and '..' never match
+        }
+        if(recursive){
+            int directory = entry->type == DT_DIR;
+            if(entry->type == DT_UNKNOWN && base + entry->length < PATH_MAX){
+                struct stat info;
+                path[length] = '/';
+                memcpy(path + base, entry->name, entry->length + 1);
+                directory = lstat(path, &info) == 0 && S_ISDIR(info.st_mode);
+            }
+            if(directory){
+                names[count++] = ArenaStrdup(glob->arena, entry->name);
+            }
+        }
+        else if(GlobMatch(part, entry->name, entry->length) && base + entry->length < PATH_MAX){
+            path[length] = '/';
+            if(last){
+                memcpy(path + base, entry->name, entry->length + 1);
+                GlobAddMatch(glob, path, base + entry->length);
+            }
+            else{
+                names[count++] = ArenaStrdup(glob->arena, entry->name);
+            }
+        }
+    }
+
+    // '**' matches no directory at all as well as any number of them
+    if(recursive){
+        path[length] = '\0';
+        GlobWalk(glob, index + 1, path, length);
+    }
+    for(size_t i = 0; i < count; i++){
+        size_t nameLength = strlen(names[i]);
+        if(base + nameLength < PATH_MAX){
+            path[length] = '/';
+            memcpy(path + base, names[i], nameLength + 1);
+            GlobWalk(glob, recursive ? index : index + 1, path, base + nameLength);
+        }
+    }
+    path[length] = '\0';
+}
+
+
+/*
+ * Function: GlobAddTree
+ * ---------------------
+ * Adds everything below a directory that is not hidden, for a pattern
+ * ending in '**'. Like other shells the directory itself comes first,
+ * as "dir/"
+ *
+ * Parameters:
+ *   glob   - The expansion in progress
+ *   path   - The directory, PATH_MAX bytes, extended and restored here
+ *   length - Length of path
+ *   top    - 1 for the directory the '**' started from
+ *
+ * Returns:
+ *   None
+ */
+void GlobAddTree(Glob* glob, char* path, size_t length, int top){
+    const DirListing* listing = ListDirectory(length ? path : ".");
+    if(listing == NULL){
+        return;
+    }
+    int root = length == 1 && path[0] == '/';
+    if(top && length > 0 && !root){
+        if(glob->directoriesOnly){
+            GlobAddMatch(glob, path, length);
+        }
+        else{
+            path[length] = '/';
+            path[length + 1] = '\0';
+            GlobAddMatch(glob, path, length + 1);
+            path[length] = '\0';
+        }
+    }
+
+    size_t base = length > 0 && !root ? length + 1 : length;
+    char** names = (char**)ArenaAlloc(glob->arena, (listing->count + 1) * sizeof(char*));
+    size_t count = 0;
+    for(size_t i = 0; i < listing->count; i++){
+        const DirEntry* entry = &listing->entries[i];
+        if(entry->name[0] == '.' || base + entry->length + 1 >= PATH_MAX){
+            continue;
+        }
+        path[length] = '/';
+        memcpy(path + base, entry->name, entry->length + 1);
+
+        int directory = entry->type == DT_DIR;
+        if(entry->type == DT_UNKNOWN){
+            struct stat info;
+            directory = lstat(path, &info) == 0 && S_ISDIR(info.st_mode);
+        }
+        if(!glob->directoriesOnly || directory || entry->type == DT_LNK){
+            GlobAddMatch(glob, path, base + entry->length);
+        }
+        if(directory){
+            names[count++] = ArenaStrdup(glob->arena, entry->name);
+        }
+    }
+
+    // Symbolic links to directories are listed but not followed
+    for(size_t i = 0; i < count; i++){
+        size_t nameLength = strlen(names[i]);
+        path[length] = '/';
+        memcpy(path + base, names[i], nameLength + 1);
+        GlobAddTree(glob, path, base + nameLength, 0);
+    }
+    path[length] = '\0';
+}
+
+
+/*
+ * Function: GlobAddMatch
+ * ----------------------
+ * Adds a path that matched every component, once it is known to exist
+ *
+ * Parameters:
+ *   glob   - The expansion in progress
+ *   path   - The matching path
+ *   length - Its length
+ *
+ * Returns:
+ *   None
+ */
+void GlobAddMatch(Glob* glob, const char* path, size_t length){
+    // Names read from a directory exist, a literal last component may not
+    struct stat info;
+    if(glob->directoriesOnly){
+        if(stat(path, &info) != 0 || !S_ISDIR(info.st_mode)){
+            return;
+        }
+    }
+    else if(!glob->recursiveTail && glob->parts[glob->count - 1].kind == GLOB_PART_LITERAL && lstat(path, &info) != 0){
+        return;
+    }
+
+    if(glob->matchCount == glob->matchCapacity){
+        glob->matchCapacity = glob->matchCapacity ? glob->matchCapacity * 2 : 16;
+        char** grown = (char**)ArenaAlloc(glob->arena, glob->matchCapacity * sizeof(char*));
+        if(glob->matchCount){
+            memcpy(grown, glob->matches, glob->matchCount * sizeof(char*));
+        }
+        glob->matches = grown;
+    }
+    char* match = (char*)ArenaAlloc(glob->arena, length + 2);
+    memcpy(match, path, length);
+    if(glob->directoriesOnly){
+        match[length++] = '/';
+    }
+    match[length] = '\0';
+    glob->matches[glob->matchCount++] = match;
+}
+
+
+/*
+ * Function: GlobUnescape
+ * ----------------------
+ * Turns a pattern that matched nothing back into the word as typed, by
+ * removing the backslashes the lexer put in front of quoted bytes
+ *
+ * Parameters:
+ *   text - The pattern, changed in place
+ *
+ * Returns:
+ *   None
+ */
+void GlobUnescape(char* text){
+    char* write = text;
+    for(char* read = text; *read; read++){
+        if(*read == '\\' && read[1] != '\0'){
+            read++;
+        }
+        *write++ = *read;
+    }
+    *write = '\0';
+}
+
+
+/*
+ * Function: CompareStrings
+ * ------------------------
+ * qsort comparator ordering strings bytewise
+ *
+ * Parameters:
+ *   a - Pointer to the first string
+ *   b - Pointer to the second string
+ *
+ * Returns:
+ *   Negative, zero or positive like strcmp
+ */
+int CompareStrings(const void* a, const void* b){
+    return strcmp(*(char* const*)a, *(char* const*)b);
+}
+
+
+/*
+ * Function: ListDirectory
+ * -----------------------
+ * Returns a directory's entries, reading the directory only when it is
+ * not cached or its mtime shows entries were added or removed since.
+ * Entries are read with getdents64 into a large buffer, so a directory
+ * of half a million files takes a few dozen system calls. A listing read
+ * within DIR_CACHE_RACY_NS of the directory's mtime is read again next
+ * time, as a change in the same clock tick would not move the mtime.
+ * The least recently used listing is replaced when all DIR_CACHE_SIZE
+ * slots are taken
+ *
+ * Parameters:
+ *   path - The directory
+ *
+ * Returns:
+ *   The listing, in directory order and valid until the next call, or
+ *   NULL if it cannot be read
+ */
+const DirListing* ListDirectory(const char* path){
+    struct stat info;
+    if(stat(path, &info) != 0 || !S_ISDIR(info.st_mode)){
+        return NULL;
+    }
+
+    DirListing* slot = &dirCache[0];
+    for(int i = 0; i < DIR_CACHE_SIZE; i++){
+        DirListing* listing = &dirCache[i];
+        if(listing->entries && listing->device == info.st_dev && listing->inode == info.st_ino){
+            if(!listing->racy && listing->modified.tv_sec == info.st_mtim.tv_sec &&
+               listing->modified.tv_nsec == info.st_mtim.tv_nsec){
+                listing->used = ++dirCacheClock;
+                return listing;
+            }
+            slot = listing;
+            break;
+        }
+        if(listing->used < slot->used){
+            slot = listing;
+        }
+    }
+
+    struct timespec readStart;
+    clock_gettime(CLOCK_REALTIME, &readStart);
+    int fd = open(path, O_RDONLY | O_DIRECTORY | O_CLOEXEC);
+    if(fd == -1){
+        return NULL;
+    }
+    if(direntBuffer == NULL){
+        direntBuffer = (char*)malloc(GETDENTS_BUFFER_SIZE);
+        if(direntBuffer == NULL){
+            perror("Memory allocation failed");
+            exit(EXIT_FAILURE);
+        }
+    }
+
+    // The slot's blocks are reused, names are packed into one of them
+    size_t capacity = slot->capacity ? slot->capacity : 64;
+    size_t storageSize = slot->storageSize ? slot->storageSize : 4096;
+    DirEntry* entries = slot->entries ? slot->entries : (DirEntry*)malloc(capacity * sizeof(DirEntry));
+    char* storage = slot->storage ? slot->storage : (char*)malloc(storageSize);
+    if(entries == NULL || storage == NULL){
+        perror("Memory allocation failed");
+        exit(EXIT_FAILURE);
+    }
+    size_t count = 0, storageUsed = 0;
+
+    ssize_t n;
+    while((n = getdents64(fd, direntBuffer, GETDENTS_BUFFER_SIZE)) > 0){
+        for(ssize_t offset = 0; offset < n; ){
+            struct dirent64* entry = (struct dirent64*)(direntBuffer + offset);
+            offset += entry->d_reclen;
+
+            size_t length = strlen(entry->d_name);
+            if(count == capacity){
+                capacity *= 2;
+                entries = (DirEntry*)realloc(entries, capacity * sizeof(DirEntry));
+            }
+            while(storageUsed + length + 1 > storageSize){
+                storageSize *= 2;
+                storage = (char*)realloc(storage, storageSize);
+            }
+            if(entries == NULL || storage == NULL){
+                perror("Memory allocation failed");
+                exit(EXIT_FAILURE);
+            }
+
+            // Offsets for now, the storage may still move
+            memcpy(storage + storageUsed, entry->d_name, length + 1);
+            entries[count].name = (char*)(uintptr_t)storageUsed;
+            entries[count].length = length;
+            entries[count].type = entry->d_type;
+            storageUsed += length + 1;
+            count++;
+        }
+    }
+    close(fd);
+    if(n == -1){
+        free(entries);
+        free(storage);
+        memset(slot, 0, sizeof(DirListing));
+        return NULL;
+    }
+
+    for(size_t i = 0; i < count; i++){
+        entries[i].name = storage + (uintptr_t)entries[i].name;
+    }
+    slot->entries = entries;
+    slot->capacity = capacity;
+    slot->storage = storage;
+    slot->storageSize = storageSize;
+    slot->count = count;
+    slot->device = info.st_dev;
+    slot->inode = info.st_ino;
+    slot->modified = info.st_mtim;
+    slot->racy = (readStart.tv_sec - info.st_mtim.tv_sec) * 1000000000LL +
+                 (readStart.tv_nsec - info.st_mtim.tv_nsec) < DIR_CACHE_RACY_NS;
+    slot->used = ++dirCacheClock;
+    return slot;
+}
+
+
+/*
+ * Function: ExecuteCommand
+ * ------------------------
+ * Executes the parsed command with the selected launch engine
+ * Builtins run inside the shell, everything else goes through RunPipeline
+ *
+ * Parameters:
+ *   command - A ShellCommand struct containing the parsed command data
+ * 
+ * Returns:
+ *   The command's exit status: 127 if it was not found, 128 + the
+ *   signal number if it was killed, 2 for a syntax error
+ */
+int ExecuteCommand(ShellCommand command){
+    // The parser has already explained what was wrong with the line
+    if(command.syntaxError){
+        return 2;
+    }
+
+    // A line of only NAME=value words sets shell variables
+    if(command.args[0] == NULL && command.assignments && command.next == NULL){
+        ApplyAssignments(command.assignments, -1);
+        return 0;
+    }
+
+    // Check for empty command
+    if(command.args[0] == NULL){
+        fprintf(stderr, "Error: No command entered\n");
+        return 1;
+    }
+
+    // 'time' is a prefix so it can cover a whole pipeline
+    int timed = 0;
+    if(strcmp(command.args[0], "time") == 0){
+        command.args++;
+        timed = 1;
+        if(command.args[0] == NULL){
+            fprintf(stderr, "time: missing command\n");
+            return 2;
+        }
+    }
+
+    // A lone builtin has to run in the shell itself to have any effect
+    const Builtin* builtin = command.next == NULL && !command.background ? FindBuiltin(command.args[0]) : NULL;
+    if(builtin){
+        if(!timed){
+            return RunBuiltinInShell(builtin, command);
+        }
+
+        // The builtin's cost is the shell's own, measured around it
+        struct rusage before, after;
+        struct timespec started;
+        getrusage(RUSAGE_SELF, &before);
+        clock_gettime(CLOCK_MONOTONIC, &started);
+        int status = RunBuiltinInShell(builtin, command);
+        getrusage(RUSAGE_SELF, &after);
+
+        CommandUsage usage;
+        usage.wall = ElapsedSince(&started);
+        usage.user = (after.ru_utime.tv_sec - before.ru_utime.tv_sec) + (after.ru_utime.tv_usec - before.ru_utime.tv_usec) / 1e6;
+        usage.sys = (after.ru_stime.tv_sec - before.ru_stime.tv_sec) + (after.ru_stime.tv_usec - before.ru_stime.tv_usec) / 1e6;
+        usage.maxRss = after.ru_maxrss;
+        usage.voluntarySwitches = after.ru_nvcsw - before.ru_nvcsw;
+        usage.involuntarySwitches = after.ru_nivcsw - before.ru_nivcsw;
+        PrintUsage(&usage, NULL);
+        return status;
+    }
+
+    lastUsage.wall = -1;
+    int status = RunPipeline(&command);
+
+    // REPORTTIME=seconds reports every command that takes at least that long
+    if(!command.background && lastUsage.wall >= 0){
+        const char* reportTime = GetVariable("REPORTTIME");
+        if(timed){
+            PrintUsage(&lastUsage, NULL);
+        }
+        else if(reportTime && *reportTime && lastUsage.wall >= atof(reportTime)){
+            PrintUsage(&lastUsage, command.args[0]);
+        }
+    }
+    return status;
+}
+
+
+/*
+ * Function: ElapsedSince
+ * ----------------------
+ * Measures wall time on the monotonic clock
+ *
+ * Parameters:
+ *   start - The starting point
+ *
+ * Returns:
+ *   Seconds since start
+ */
+double ElapsedSince(struct timespec* start){
+    struct timespec now;
+    clock_gettime(CLOCK_MONOTONIC, &now);
+    return (now.tv_sec - start->tv_sec) + (now.tv_nsec - start->tv_nsec) / 1e9;
+}
+
+
+/*
+ * Function: PrintUsage
+ * --------------------
+ * Prints a command's resource usage to stderr, for 'time' and REPORTTIME
+ *
+ * Parameters:
+ *   usage - The usage to print
+ *   label - Command name to show first, or NULL
+ *
+ * Returns:
+ *   None
+ */
+void PrintUsage(CommandUsage* usage, const char* label){
+    if(label){
+        fprintf(stderr, "\n%s\n", label);
+    }
+    else{
+        fprintf(stderr, "\n");
+    }
+    fprintf(stderr, "real\t%dm%.3fs\n", (int)(usage->wall / 60), usage->wall - 60 * (int)(usage->wall / 60));
+    fprintf(stderr, "user\t%dm%.3fs\n", (int)(usage->user / 60), usage->user - 60 * (int)(usage->user / 60));
+    fprintf(stderr, "sys\t%dm%.3fs\n", (int)(usage->sys / 60), usage->sys - 60 * (int)(usage->sys / 60));
+    fprintf(stderr, "maxrss\t%ld KB\n", usage->maxRss);
+    fprintf(stderr, "ctxsw\t%ld voluntary, %ld involuntary\n", usage->voluntarySwitches, usage->involuntarySwitches);
+}
+
+
+/*
+ * Function: HashBuiltinName
+ * -------------------------
+ * Hashes a command name into a slot of the builtin table (seeded FNV-1a)
+ *
+ * Parameters:
+ *   name - The command name
+ *   seed - The seed InitBuiltins found to be collision free
+ *
+ * Returns:
+ *   A slot index below BUILTIN_TABLE_SIZE
+ */
+unsigned int HashBuiltinName(const char* name, unsigned int seed){
+    unsigned int hash = 2166136261u ^ seed;
+    for(; *name; name++){
+        hash ^= (unsigned char)*name;
+        hash *= 16777619u;
+    }
+    return (hash ^ (hash >> 16)) & (BUILTIN_TABLE_SIZE - 1);
+}
+
+
+/*
+ * Function: InitBuiltins
+ * ----------------------
+ * Builds a perfect hash of the builtin registry by trying seeds until
+ * every name lands in its own slot, so FindBuiltin needs exactly one
+ * hash and one strcmp. With the table a few times larger than the
+ * registry this takes a handful of tries
+ *
+ * Parameters:
+ *   None
+ *
+ * Returns:
+ *   None
+ */
+void InitBuiltins(){
+    int count = sizeof(builtins) / sizeof(builtins[0]);
+
+    for(unsigned int seed = 0; seed < 1000000; seed++){
+        memset(builtinTable, 0, sizeof(builtinTable));
+        int placed = 0;
+        for(; placed < count; placed++){
+            unsigned int slot = HashBuiltinName(builtins[placed].name, seed);
+            if(builtinTable[slot] != NULL){
+                break;
+            }
+            builtinTable[slot] = &builtins[placed];
+        }
+        if(placed == count){
+            builtinSeed = seed;
+            return;
+        }
+    }
+
+    // Only reachable if the registry outgrows BUILTIN_TABLE_SIZE
+    fprintf(stderr, "Error: No perfect hash for %d builtins in %d slots\n", count, BUILTIN_TABLE_SIZE);
+    exit(EXIT_FAILURE);
+}
+
+
+/*
+ * Function: FindBuiltin
+ * ---------------------
+ * Looks a command name up in the builtin registry
+ *
+ * Parameters:
+ *   name - The command name
+ *
+ * Returns:
+ *   The builtin's registry entry, or NULL if it is not a builtin
+ */
+const Builtin* FindBuiltin(const char* name){
+    const Builtin* builtin = builtinTable[HashBuiltinName(name, builtinSeed)];
+    if(builtin && strcmp(builtin->name, name) == 0){
+        return builtin;
+    }
+    return NULL;
+}
+
+
+/*
+ * Function: CdBuiltin
+ * -------------------
+ * Implements 'cd [directory]', going home without a directory, and
+ * keeps PWD and OLDPWD up to date
+ *
+ * Parameters:
+ *   command - The parsed command, args[0] is the builtin's name
+ *
+ * Returns:
+ *   0 on success, 1 if the directory could not be entered
+ */
+int CdBuiltin(ShellCommand* command){
+    if(command->args[1] == NULL){
+        // If no directory is specified, go to the home directory
+        const char *home = GetVariable("HOME");
+        if(home == NULL){
+            home = "/";
+        }
+        if(chdir(home) != 0){
+            perror("cd failed");
+            return 1;
+        }
+    }
+    else{
+        // Quoted names such as "My Dir" already arrive as one argument
+        if(chdir(command->args[1]) != 0){
+            perror("cd failed");
+            return 1;
+        }
+    }
+
+    // OLDPWD takes the old value before PWD's entry is replaced
+    const char* previous = GetVariable("PWD");
+    if(previous){
+        SetVariable("OLDPWD", 6, previous, -1);
+    }
+    char* cwd = getcwd(NULL, 0);
+    if(cwd){
+        SetVariable("PWD", 3, cwd, -1);
+        free(cwd);
+    }
+    if(interactive){
+        RefreshCwd();  // The prompt's copy is only updated here
+    }
+    return 0;
+}
+
+
+/*
+ * Function: ExitBuiltin
+ * ---------------------
+ * Implements 'exit [status]', by default with the last command's status
+ *
+ * Parameters:
+ *   command - The parsed command, args[0] is the builtin's name
+ *
+ * Returns:
+ *   Does not return
+ */
+int ExitBuiltin(ShellCommand* command){
+    exit(command->args[1] ? atoi(command->args[1]) : lastStatus);
+}
+
+
+/*
+ * Function: TrueBuiltin
+ * ---------------------
+ * Implements 'true'
+ *
+ * Parameters:
+ *   command - The parsed command, arguments are ignored
+ *
+ * Returns:
+ *   0
+ */
+int TrueBuiltin(ShellCommand* command){
+    (void)command;
+    return 0;
+}
+
+
+/*
+ * Function: FalseBuiltin
+ * ----------------------
+ * Implements 'false'
+ *
+ * Parameters:
+ *   command - The parsed command, arguments are ignored
+ *
+ * Returns:
+ *   1
+ */
+int FalseBuiltin(ShellCommand* command){
+    (void)command;
+    return 1;
+}
+
+
+/*
+ * Function: RunBuiltinInShell
+ * ---------------------------
+ * Runs a builtin in the shell process itself, honouring its '<' and '>'
+ * redirections by pointing stdin/stdout at the files for the duration
+ * and then putting the shell's own descriptors back. NAME=value prefixes
+ * are exported for the duration in the same way. Builtins flagged
+ * BUILTIN_OWN_REDIRECTS get the redirections left in place for them
+ *
+ * Parameters:
+ *   builtin - The builtin's registry entry
+ *   command - The parsed command
+ *
+ * Returns:
+ *   The builtin's exit status, 1 if a redirection could not be opened
+ */
+int RunBuiltinInShell(const Builtin* builtin, ShellCommand command){
+    // NAME=value prefixes only last while the builtin runs
+    if(command.assignments){
+        char** assignments = command.assignments;
+        Variable* saved = SaveAssignments(assignments);
+        ApplyAssignments(assignments, 1);
+        command.assignments = NULL;
+        int status = RunBuiltinInShell(builtin, command);
+        RestoreAssignments(assignments, saved);
+        return status;
+    }
+
+    // Flushing after every builtin keeps its output in order with stderr
+    // and with later commands, and a write() is still far cheaper than a fork
+    if(command.redirects == NULL || (builtin->flags & BUILTIN_OWN_REDIRECTS)){
+        int status = builtin->run(&command);
+        fflush(stdout);
+        return status;
+    }
+
+    FdPlan plan;
+    if(BuildFdPlan(&command, -1, -1, &plan) != 0){
+        return 1;
+    }
+
+    // Output buffered so far belongs to the old stdout
+    fflush(stdout);
+    fflush(stderr);
+
+    // Keep close-on-exec copies of the descriptors the plan replaces, -1 if one was not open
+    int* saved = (int*)ArenaAlloc(&lineArena, plan.count * sizeof(int));
+    for(int i = 0; i < plan.count; i++){
+        saved[i] = fcntl(plan.actions[i].fd, F_DUPFD_CLOEXEC, REDIRECT_FD_LIMIT);
+    }
+    ApplyFdPlan(&plan, 0);
+    CloseFdPlan(&plan);
+
+    int status = builtin->run(&command);
+    fflush(stdout);
+    fflush(stderr);
+
+    // Undo in reverse, so a descriptor changed twice ends up as it started
+    for(int i = plan.count - 1; i >= 0; i--){
+        if(saved[i] != -1){
+            dup2(saved[i], plan.actions[i].fd);
+            close(saved[i]);
+        }
+        else{
+            close(plan.actions[i].fd);
+        }
+    }
+    return status;
+}
+
+/*
+ * Function: RunPipeline
+ * ---------------------
+ * Runs a pipeline as a job, in the foreground unless the line ended
+ * in '&'. With job control the stages share one process group, which
+ * gets the terminal while the pipeline runs in the foreground
+ *
+ * Parameters:
+ *   first - The first stage, later stages follow through next
+ *
+ * Returns:
+ *   The last stage's status, or with pipefail the status of the last
+ *   stage that failed. 0 for a background job
+ */
+int RunPipeline(ShellCommand* first){
+    // Without job control a background job must not compete for our stdin
+    Job* job = StartPipeline(first, jobControl ? 0 : -1, first->background && !jobControl);
+
+    if(first->background){
+        if(interactive){
+            printf("[%d] %d\n", job->id, (int)job->pids[0]);
+        }
+        return 0;
+    }
+
+    // Wait for the whole group
+    return WaitForJob(job, 1);
+}
+
+
+/*
+ * Function: StartPipeline
+ * -----------------------
+ * Starts every stage of a pipeline before waiting for any of them, so
+ * the stages run concurrently. Stages are connected with close-on-exec
+ * pipes, which only survive in a child as its dup2'd stdin/stdout
+ *
+ * Parameters:
+ *   first     - The first stage, later stages follow through next
+ *   pgid      - 0 to give the job its own process group, -1 to stay in ours
+ *   nullStdin - Give the first stage /dev/null as stdin unless it redirects it
+ *
+ * Returns:
+ *   The job, already in the job table
+ */
+Job* StartPipeline(ShellCommand* first, pid_t pgid, int nullStdin){
+    int count = 0;
+    for(ShellCommand* stage = first; stage; stage = stage->next){
+        count++;
+    }
+
+    Job* job = CreateJob(first, count);
+
+    // Anything buffered now would otherwise be duplicated by forked builtins
+    fflush(stdout);
+
+    int readEnd = -1;  // Read end of the pipe feeding the next stage
+    if(nullStdin){  // A redirection of the stage's own stdin still wins
+        readEnd = open("/dev/null", O_RDONLY | O_CLOEXEC);
+    }
+
+    int i = 0;
+    for(ShellCommand* stage = first; stage; stage = stage->next, i++){
+        int pipeFds[2] = { -1, -1 };
+        if(stage->next && pipe2(pipeFds, O_CLOEXEC) == -1){
+            perror("pipe failed");
+        }
+
+        if(!stage->next || pipeFds[1] != -1){
+            job->pids[i] = StartStage(stage, readEnd, pipeFds[1], pgid, &job->statuses[i]);
+        }
+        if(job->pids[i] != -1){
+            job->remaining++;
+            if(pgid == 0){
+                pgid = job->pids[i];
+                job->pgid = pgid;
+            }
+        }
+
+        // The children hold their own copies now
+        if(readEnd != -1){
+            close(readEnd);
+        }
+        if(pipeFds[1] != -1){
+            close(pipeFds[1]);
+        }
+        readEnd = pipeFds[0];
+    }
+
+    if(job->remaining == 0){
+        job->state = JOB_DONE;
+        job->usage.wall = ElapsedSince(&job->started);
+    }
+    return job;
+}
+
+
+/*
+ * Function: StartStage
+ * --------------------
+ * Starts one stage of a pipeline. The stage's own redirections take
+ * precedence over the pipe ends it is given. Builtins get a forked copy
+ * of the shell to run in, since they cannot be exec'd
+ *
+ * Parameters:
+ *   stage  - The stage to start
+ *   inFd   - Pipe to read from, or -1 to inherit stdin
+ *   outFd  - Pipe to write to, or -1 to inherit stdout
+ *   pgid   - Process group to join, 0 for a new one, -1 to stay in ours
+ *   status - Receives the exit status when nothing could be started
+ *
+ * Returns:
+ *   The child's pid, or -1 if it could not be started
+ */
+pid_t StartStage(ShellCommand* stage, int inFd, int outFd, pid_t pgid, int* status){
+    const Builtin* builtin = FindBuiltin(stage->args[0]);
+
+    // Open redirection files up front so every launch mode reports errors the same way
+    FdPlan plan;
+    ShellCommand piped = *stage;
+    if(builtin && (builtin->flags & BUILTIN_OWN_REDIRECTS)){
+        piped.redirects = NULL;  // Only the pipe ends, the builtin opens the rest itself
+    }
+    if(BuildFdPlan(&piped, inFd, outFd, &plan) != 0){
+        *status = 1;
+        return -1;
+    }
+
+    pid_t pid;
+    if(builtin && (builtin->flags & BUILTIN_NEEDS_PARENT) && !(builtin->flags & BUILTIN_PIPELINE_SAFE)){
+        // A forked copy would change nothing but itself
+        fprintf(stderr, "Error: '%s' cannot be used in a pipeline or in the background\n", builtin->name);
+        pid = -1;
+        *status = 1;
+    }
+    else if(builtin){
+        pid = fork();
+        if(pid == 0){ // Child process runs the builtin and exits with its status
+            PrepareChild(pgid);
+            interactive = 0;
+            jobControl = 0;
+            ApplyFdPlan(&plan, 0);
+            if(plan.redirected & (1u << STDIN_FILENO)){
+                pipedStdin = 1;
+            }
+            if(stage->assignments){
+                ApplyAssignments(stage->assignments, 1);
+            }
+            int builtinStatus = builtin->run(stage);
+            fflush(NULL);
+            _exit(builtinStatus);
+        }
+        if(pid == -1){
+            perror("Fork failed");
+            *status = 1;
+        }
+        else if(pgid != -1){
+            setpgid(pid, pgid == 0 ? pid : pgid);  // Also done by the child, whoever runs first wins
+        }
+    }
+    else{
+        // A PATH=... prefix changes where this one command is looked up, bypassing the table
+        const char* searchPath = NULL;
+        for(int i = 0; stage->assignments && stage->assignments[i]; i++){
+            if(strncmp(stage->assignments[i], "PATH=", 5) == 0){
+                searchPath = stage->assignments[i] + 5;
+            }
+        }
+        if(strchr(stage->args[0], '/')){
+            searchPath = NULL;
+        }
+
+        // Look the command up in the parent so unknown commands never get a process
+        uint64_t traceStart = TraceBegin();
+        const char* path;
+        if(searchPath){
+            char* found = SearchPath(stage->args[0], searchPath);
+            path = found ? ArenaStrdup(&lineArena, found) : NULL;
+            free(found);
+        }
+        else{
+            path = ResolveCommand(stage->args[0]);
+        }
+        TraceEnd("resolve", traceStart, stage->args[0]);
+        pid = -1;
+        errno = ENOENT;
+        if(path){
+            traceStart = TraceBegin();
+            pid = LaunchProcess(path, stage->args, StageEnvironment(stage), &plan, pgid);
+            TraceEnd("spawn", traceStart, stage->args[0]);
+        }
+        if(pid == -1 && errno == ENOENT){
+            if(path && searchPath == NULL && strchr(stage->args[0], '/') == NULL){
+                // The cached binary went away, look it up again once
+                ForgetCommand(stage->args[0]);
+                path = ResolveCommand(stage->args[0]);
+                errno = ENOENT;
+                if(path){
+                    pid = LaunchProcess(path, stage->args, StageEnvironment(stage), &plan, pgid);
+                }
+            }
+            if(pid == -1 && errno == ENOENT){
+                fprintf(stderr, "Error: Command '%s' not found\n", stage->args[0]);
+                errno = ENOENT;
+            }
+        }
+        if(pid == -1){
+            *status = errno == ENOENT ? 127 : 126;
+        }
+    }
+
+    // The child holds its own copies now
+    CloseFdPlan(&plan);
+    return pid;
+}
+
+
+/*
+ * Function: StatusFromWait
+ * ------------------------
+ * Converts a waitpid() status into a shell exit status
+ *
+ * Parameters:
+ *   status - The raw status from waitpid()
+ *
+ * Returns:
+ *   The exit code, or 128 + the signal number if the child was killed
+ */
+int StatusFromWait(int status){
+    if(WIFSIGNALED(status)){
+        return 128 + WTERMSIG(status);
+    }
+    return WEXITSTATUS(status);
+}
+
+
+/*
+ * Function: SetBuiltin
+ * --------------------
+ * Implements the 'set' builtin, currently only for shell options:
+ *   set -o pipefail / set +o pipefail
+ *   set -o          - list the options and whether they are on
+ *
+ * Parameters:
+ *   command - The parsed command, args[0] is the builtin's name
+ *
+ * Returns:
+ *   0 on success, 1 for an unknown option
+ */
+int SetBuiltin(ShellCommand* command){
+    char** args = command->args;
+    if(args[1] == NULL || (strcmp(args[1], "-o") == 0 && args[2] == NULL)){
+        printf("pipefail\t%s\n", pipefail ? "on" : "off");
+        return 0;
+    }
+
+    for(int i = 1; args[i] != NULL; i++){
+        int enable = strcmp(args[i], "-o") == 0;
+        if((!enable && strcmp(args[i], "+o") != 0) || args[i + 1] == NULL){
+            fprintf(stderr, "set: usage: set [-o|+o] option\n");
+            return 1;
+        }
+        i++;
+        if(strcmp(args[i], "pipefail") == 0){
+            pipefail = enable;
+        }
+        else{
+            fprintf(stderr, "set: %s: unknown option\n", args[i]);
+            return 1;
+        }
+    }
+    return 0;
+}
+
+
+/*
+ * Function: EchoBuiltin
+ * ---------------------
+ * Implements 'echo [-neE] [word...]' inside the shell. -n drops the
+ * trailing newline, -e interprets backslash escapes and -E turns that off
+ *
+ * Parameters:
+ *   command - The parsed command, args[0] is the builtin's name
+ *
+ * Returns:
+ *   Always 0
+ */
+int EchoBuiltin(ShellCommand* command){
+    char** args = command->args;
+    int newline = 1;
+    int escapes = 0;
+    int i = 1;
+
+    // Leading words made only of n, e and E letters are options
+    for(; args[i] && args[i][0] == '-' && args[i][1] != '\0'; i++){
+        const char* flag = args[i] + 1;
+        if(flag[strspn(flag, "neE")] != '\0'){
+            break;
+        }
+        for(; *flag; flag++){
+            if(*flag == 'n'){
+                newline = 0;
+            }
+            else{
+                escapes = *flag == 'e';
+            }
+        }
+    }
+
+    for(int first = i; args[i]; i++){
+        if(i > first){
+            putchar(' ');
+        }
+        if(!escapes){
+            fputs(args[i], stdout);
+        }
+        else if(WriteEscaped(args[i], ESCAPE_OCTAL_ZERO)){
+            return 0;  // '\c' ends the output, newline included
+        }
+    }
+    if(newline){
+        putchar('\n');
+    }
+    return 0;
+}
+
+
+/*
+ * Function: WriteEscape
+ * ---------------------
+ * Writes the character for one backslash escape to stdout
+ *
+ * Parameters:
+ *   text  - Points just past the backslash, left on the escape's last byte
+ *   octal - Which octal escapes are understood: \nnn (printf formats),
+ *           \0nnn (echo) or either one (printf's %b)
+ *
+ * Returns:
+ *   1 for '\c', which stops all further output, 0 otherwise
+ */
+int WriteEscape(const char** text, EscapeOctal octal){
+    const char* c = *text;
+    int value = 0;
+    int digits = 0;
+
+    switch(*c){
+        case 'a': putchar('\a'); break;
+        case 'b': putchar('\b'); break;
+        case 'e': putchar('\033'); break;
+        case 'f': putchar('\f'); break;
+        case 'n': putchar('\n'); break;
+        case 'r': putchar('\r'); break;
+        case 't': putchar('\t'); break;
+        case 'v': putchar('\v'); break;
+        case '\\': putchar('\\'); break;
+        case 'c':
+            return 1;
+        case 'x':
+            while(digits < 2 && isxdigit((unsigned char)c[1])){
+                c++;
+                value = value * 16 + (isdigit((unsigned char)*c) ? *c - '0' : tolower((unsigned char)*c) - 'a' + 10);
+                digits++;
+            }
+            if(digits == 0){
+                fputs("\\x", stdout);
+            }
+            else{
+                putchar(value);
+            }
+            break;
+        case '\0':
+            // A trailing backslash is kept as it is
+            putchar('\\');
+            c--;
+            break;
+        default:
+            if(*c >= '0' && *c <= '7' && (octal != ESCAPE_OCTAL_ZERO || *c == '0')){
+                if(*c != '0' || octal == ESCAPE_OCTAL_PLAIN){
+                    value = *c - '0';
+                    digits = 1;
+                }
+                while(digits < 3 && c[1] >= '0' && c[1] <= '7'){
+                    c++;
+                    value = value * 8 + *c - '0';
+                    digits++;
+                }
+                putchar(value & 0xff);
+            }
+            else{
+                putchar('\\');
+                putchar(*c);
+            }
+    }
+    *text = c;
+    return 0;
+}
+
+
+/*
+ * Function: WriteEscaped
+ * ----------------------
+ * Writes a string to stdout, interpreting backslash escapes
+ *
+ * Parameters:
+ *   text  - The string
+ *   octal - As for WriteEscape
+ *
+ * Returns:
+ *   1 if a '\c' stopped the output, 0 otherwise
+ */
+int WriteEscaped(const char* text, EscapeOctal octal){
+    for(const char* c = text; *c; c++){
+        if(*c != '\\'){
+            putchar(*c);
+        }
+        else{
+            c++;
+            if(WriteEscape(&c, octal)){
+                return 1;
+            }
+        }
+    }
+    return 0;
+}
+
+
+/*
+ * Function: PwdBuiltin
+ * --------------------
+ * Implements 'pwd', printing the current working directory
+ *
+ * Parameters:
+ *   command - The parsed command, arguments are ignored
+ *
+ * Returns:
+ *   0 on success, 1 if the directory could not be read
+ */
+int PwdBuiltin(ShellCommand* command){
+    (void)command;
+    char cwd[PATH_MAX];
+    if(getcwd(cwd, sizeof(cwd)) == NULL){
+        perror("pwd failed");
+        return 1;
+    }
+    puts(cwd);
+    return 0;
+}
+
+
+/*
+ * Function: TestBuiltin
+ * ---------------------
+ * Implements 'test expr' and '[ expr ]': file tests (-e -f -d -r -w -x
+ * -s -L ...), string tests (-n -z = != < >), integer comparisons (-eq
+ * -ne -lt -le -gt -ge), file comparisons (-nt -ot -ef) combined with
+ * '!', -a, -o and parentheses
+ *
+ * Parameters:
+ *   command - The parsed command, args[0] is the builtin's name
+ *
+ * Returns:
+ *   0 if the expression is true, 1 if it is false, 2 on a syntax error
+ */
+int TestBuiltin(ShellCommand* command){
+    char** args = command->args;
+    int count = 0;
+    while(args[count]){
+        count++;
+    }
+    if(strcmp(args[0], "[") == 0){
+        if(strcmp(args[count - 1], "]") != 0){
+            fprintf(stderr, "[: missing ']'\n");
+            return 2;
+        }
+        count--;
+    }
+
+    // No expression at all is false
+    TestParser parser = { args + 1, count - 1, 0, 0 };
+    if(parser.count == 0){
+        return 1;
+    }
+
+    int result = TestOr(&parser);
+    if(!parser.error && parser.pos < parser.count){
+        fprintf(stderr, "%s: %s: unexpected argument\n", args[0], parser.words[parser.pos]);
+        parser.error = 1;
+    }
+    if(parser.error){
+        return 2;
+    }
+    return result ? 0 : 1;
+}
+
+
+/*
+ * Function: TestOr
+ * ----------------
+ * Evaluates 'expr -o expr ...' for TestBuiltin
+ *
+ * Parameters:
+ *   parser - The words and the position reached
+ *
+ * Returns:
+ *   1 if true, 0 if false
+ */
+int TestOr(TestParser* parser){
+    int result = TestAnd(parser);
+    while(!parser->error && parser->pos < parser->count && strcmp(parser->words[parser->pos], "-o") == 0){
+        parser->pos++;
+        result = TestAnd(parser) || result;
+    }
+    return result;
+}
+
+
+/*
+ * Function: TestAnd
+ * -----------------
+ * Evaluates 'expr -a expr ...' for TestBuiltin, -a binds tighter than -o
+ *
+ * Parameters:
+ *   parser - The words and the position reached
+ *
+ * Returns:
+ *   1 if true, 0 if false
+ */
+int TestAnd(TestParser* parser){
+    int result = TestNot(parser);
+    while(!parser->error && parser->pos < parser->count && strcmp(parser->words[parser->pos], "-a") == 0){
+        parser->pos++;
+        result = TestNot(parser) && result;
+    }
+    return result;
+}
+
+
+/*
+ * Function: TestNot
+ * -----------------
+ * Evaluates '! expr', '( expr )' and single tests for TestBuiltin
+ *
+ * Parameters:
+ *   parser - The words and the position reached
+ *
+ * Returns:
+ *   1 if true, 0 if false
+ */
+int TestNot(TestParser* parser){
+    if(parser->pos >= parser->count){
+        fprintf(stderr, "test: argument expected\n");
+        parser->error = 1;
+        return 0;
+    }
+
+    char** word = parser->words + parser->pos;
+    int left = parser->count - parser->pos;
+
+    // A binary test wins, so '[ ! = x ]' compares strings
+    if(left >= 3 && TestBinaryKnown(word[1])){
+        parser->pos += 3;
+        return TestBinary(word[0], word[1], word[2], &parser->error);
+    }
+    // '!' or '(' alone is just a non-empty string
+    if(left >= 2 && strcmp(word[0], "!") == 0){
+        parser->pos++;
+        return !TestNot(parser);
+    }
+    if(left >= 2 && strcmp(word[0], "(") == 0){
+        parser->pos++;
+        int result = TestOr(parser);
+        if(!parser->error && (parser->pos >= parser->count || strcmp(parser->words[parser->pos], ")") != 0)){
+            fprintf(stderr, "test: missing ')'\n");
+            parser->error = 1;
+        }
+        parser->pos++;
+        return result;
+    }
+    if(left >= 2 && word[0][0] == '-' && word[0][1] != '\0' && word[0][2] == '\0' && strchr("bcdefghknprstuwxzGLOS", word[0][1])){
+        parser->pos += 2;
+        return TestUnary(word[0][1], word[1], &parser->error);
+    }
+
+    parser->pos++;
+    return word[0][0] != '\0';
+}
+
+
+/*
+ * Function: TestUnary
+ * -------------------
+ * Evaluates a unary test such as '-f file' or '-n string'
+ *
+ * Parameters:
+ *   op      - The operator letter
+ *   operand - The word it applies to
+ *   error   - Set to 1 on an invalid operand
+ *
+ * Returns:
+ *   1 if true, 0 if false
+ */
+int TestUnary(char op, const char* operand, int* error){
+    struct stat info;
+
+    switch(op){
+        case 'n':
+            return operand[0] != '\0';
+        case 'z':
+            return operand[0] == '\0';
+        case 't':{
+            char* end;
+            long fd = strtol(operand, &end, 10);
+            if(*operand == '\0' || *end != '\0'){
+                fprintf(stderr, "test: %s: integer expression expected\n", operand);
+                *error = 1;
+                return 0;
+            }
+            return isatty(fd);
+        }
+        case 'r':
+            return access(operand, R_OK) == 0;
+        case 'w':
+            return access(operand, W_OK) == 0;
+        case 'x':
+            return access(operand, X_OK) == 0;
+        case 'h':
+        case 'L':
+            return lstat(operand, &info) == 0 && S_ISLNK(info.st_mode);
+    }
+
+    if(stat(operand, &info) != 0){
+        return 0;
+    }
+    switch(op){
+        case 'b': return S_ISBLK(info.st_mode);
+        case 'c': return S_ISCHR(info.st_mode);
+        case 'd': return S_ISDIR(info.st_mode);
+        case 'f': return S_ISREG(info.st_mode);
+        case 'p': return S_ISFIFO(info.st_mode);
+        case 'S': return S_ISSOCK(info.st_mode);
+        case 's': return info.st_size > 0;
+        case 'g': return (info.st_mode & S_ISGID) != 0;
+        case 'u': return (info.st_mode & S_ISUID) != 0;
+        case 'k': return (info.st_mode & S_ISVTX) != 0;
+        case 'O': return info.st_uid == geteuid();
+        case 'G': return info.st_gid == getegid();
+        default: return 1;  // -e
+    }
+}
+
+
+/*
+ * Function: TestBinaryKnown
+ * -------------------------
+ * Checks whether a word is one of test's binary operators
+ *
+ * Parameters:
+ *   op - The word
+ *
+ * Returns:
+ *   1 if it is, 0 otherwise
+ */
+int TestBinaryKnown(const char* op){
+    static const char* const operators[] = {
+        "=", "==", "!=", "<", ">", "-eq", "-ne", "-lt", "-le", "-gt", "-ge", "-nt", "-ot", "-ef", NULL
+    };
+    for(int i = 0; operators[i]; i++){
+        if(strcmp(op, operators[i]) == 0){
+            return 1;
+        }
+    }
+    return 0;
+}
+
+
+/*
+ * Function: TestBinary
+ * --------------------
+ * Evaluates a binary test such as 'a = b', '3 -lt 4' or 'f1 -nt f2'
+ *
+ * Parameters:
+ *   left  - The left operand
+ *   op    - The operator, TestBinaryKnown must accept it
+ *   right - The right operand
+ *   error - Set to 1 when an integer operand is not a number
+ *
+ * Returns:
+ *   1 if true, 0 if false
+ */
+int TestBinary(const char* left, const char* op, const char* right, int* error){
+    if(op[0] != '-'){
+        int order = strcmp(left, right);
+        switch(op[0]){
+            case '!': return order != 0;
+            case '<': return order < 0;
+            case '>': return order > 0;
+            default: return order == 0;
+        }
+    }
+
+    if(strcmp(op, "-nt") == 0 || strcmp(op, "-ot") == 0 || strcmp(op, "-ef") == 0){
+        struct stat a, b;
+        int haveA = stat(left, &a) == 0;
+        int haveB = stat(right, &b) == 0;
+        if(op[1] == 'e'){
+            return haveA && haveB && a.st_dev == b.st_dev && a.st_ino == b.st_ino;
+        }
+        // A missing file is older than any existing one
+        if(!haveA || !haveB){
+            return op[1] == 'n' ? haveA : haveB;
+        }
+        long long difference = (a.st_mtim.tv_sec - b.st_mtim.tv_sec) * 1000000000LL + (a.st_mtim.tv_nsec - b.st_mtim.tv_nsec);
+        return op[1] == 'n' ? difference > 0 : difference < 0;
+    }
+
+    // Integer comparisons, surrounding blanks are allowed as in other shells
+    char* endLeft;
+    char* endRight;
+    long long a = strtoll(left, &endLeft, 10);
+    long long b = strtoll(right, &endRight, 10);
+    endLeft += strspn(endLeft, " \t");
+    endRight += strspn(endRight, " \t");
+    if(left[strspn(left, " \t")] == '\0' || *endLeft != '\0'){
+        fprintf(stderr, "test: %s: integer expression expected\n", left);
+        *error = 1;
+        return 0;
+    }
+    if(right[strspn(right, " \t")] == '\0' || *endRight != '\0'){
+        fprintf(stderr, "test: %s: integer expression expected\n", right);
+        *error = 1;
+        return 0;
+    }
+    if(strcmp(op, "-eq") == 0) return a == b;
+    if(strcmp(op, "-ne") == 0) return a != b;
+    if(strcmp(op, "-lt") == 0) return a < b;
+    if(strcmp(op, "-le") == 0) return a <= b;
+    if(strcmp(op, "-gt") == 0) return a > b;
+    return a >= b;
+}
+
+
+/*
+ * Function: PrintfBuiltin
+ * -----------------------
+ * Implements 'printf format [argument...]'. The format understands
+ * backslash escapes and %s %b %c %d %i %u %o %x %X %e %f %g %a with
+ * flags, width and precision. Like other shells the format is reused
+ * until every argument has been consumed, and missing arguments count
+ * as empty strings or zero
+ *
+ * Parameters:
+ *   command - The parsed command, args[0] is the builtin's name
+ *
+ * Returns:
+ *   0 on success, 1 if an argument was not a valid number or the
+ *   format was invalid, 2 without a format
+ */
+int PrintfBuiltin(ShellCommand* command){
+    char** args = command->args;
+    if(args[1] == NULL){
+        fprintf(stderr, "printf: usage: printf format [arguments]\n");
+        return 2;
+    }
+
+    const char* format = args[1];
+    char** next = args + 2;
+    int status = 0;
+
+    for(;;){
+        char** passStart = next;
+        for(const char* f = format; *f; f++){
+            if(*f == '\\'){
+                f++;
+                if(WriteEscape(&f, ESCAPE_OCTAL_PLAIN)){
+                    return status;
+                }
+                continue;
+            }
+            if(*f != '%'){
+                putchar(*f);
+                continue;
+            }
+            if(f[1] == '%'){
+                putchar('%');
+                f++;
+                continue;
+            }
+
+            // Copy flags, width and precision into a format of our own
+            size_t length = strspn(f + 1, "-+ #0123456789.");
+            char conversion = f[1 + length];
+            char spec[32];
+            if(length > sizeof(spec) - 5 || conversion == '\0'){
+                fprintf(stderr, "printf: %s: invalid format\n", f);
+                return 1;
+            }
+            memcpy(spec, f, length + 1);
+            f += length + 1;
+            char* out = spec + length + 1;
+            const char* value = *next ? *next++ : "";
+
+            switch(conversion){
+                case 's':
+                case 'c':{
+                    // %c prints the argument's first byte, nothing for an empty one
+                    char first[2] = { value[0], '\0' };
+                    strcpy(out, "s");
+                    printf(spec, conversion == 's' ? value : first);
+                    break;
+                }
+                case 'b':
+                    if(WriteEscaped(value, ESCAPE_OCTAL_EITHER)){
+                        return status;
+                    }
+                    break;
+                case 'd':
+                case 'i':
+                    sprintf(out, "ll%c", conversion);
+                    printf(spec, (long long)PrintfNumber(value, &status));
+                    break;
+                case 'u':
+                case 'o':
+                case 'x':
+                case 'X':
+                    sprintf(out, "ll%c", conversion);
+                    printf(spec, (unsigned long long)PrintfNumber(value, &status));
+                    break;
+                case 'e': case 'E': case 'f': case 'F': case 'g': case 'G': case 'a': case 'A':{
+                    char* end;
+                    double number = strtod(value, &end);
+                    if(*end != '\0'){
+                        fprintf(stderr, "printf: %s: invalid number\n", value);
+                        status = 1;
+                    }
+                    sprintf(out, "%c", conversion);
+                    printf(spec, number);
+                    break;
+                }
+                default:
+                    fprintf(stderr, "printf: %%%c: invalid directive\n", conversion);
+                    return 1;
+            }
+        }
+
+        // Repeat the format for leftover arguments, if it used any at all
+        if(*next == NULL || next == passStart){
+            break;
+        }
+    }
+    return status;
+}
+
+
+/*
+ * Function: PrintfNumber
+ * ----------------------
+ * Converts a printf argument to an integer. Decimal, 0x hex and 0 octal
+ * are accepted, and a leading quote gives the next character's code
+ *
+ * Parameters:
+ *   text   - The argument
+ *   status - Set to 1 if the argument is not a valid number
+ *
+ * Returns:
+ *   The number, as much of it as could be read
+ */
+long long PrintfNumber(const char* text, int* status){
+    if(text[0] == '\'' || text[0] == '"'){
+        return (unsigned char)text[1];
+    }
+    if(text[0] == '\0'){
+        return 0;
+    }
+
+    char* end;
+    errno = 0;
+    long long number = strtoll(text, &end, 0);
+    if(*end != '\0' || errno == ERANGE){
+        fprintf(stderr, "printf: %s: invalid number\n", text);
+        *status = 1;
+    }
+    return number;
+}
+
+
+/*
+ * Function: ParseLaunchMode
+ * -------------------------
+ * Converts a launch mode name into its LaunchMode value
+ *
+ * Parameters:
+ *   name - "spawn", "vfork", "fork" or "zygote"
+ *   mode - Receives the matching mode
+ *
+ * Returns:
+ *   1 if the name was recognised, 0 otherwise
+ */
+int ParseLaunchMode(const char* name, LaunchMode* mode){
+    if(strcmp(name, "spawn") == 0){
+        *mode = LAUNCH_SPAWN;
+    }
+    else if(strcmp(name, "vfork") == 0){
+        *mode = LAUNCH_VFORK;
+    }
+    else if(strcmp(name, "fork") == 0){
+        *mode = LAUNCH_FORK;
+    }
+    else if(strcmp(name, "zygote") == 0){
+        *mode = LAUNCH_ZYGOTE;
+    }
+    else{
+        return 0;
+    }
+    return 1;
+}
+
+
+/*
+ * Function: BuildFdPlan
+ * ---------------------
+ * Turns a command's pipe ends and redirections into the list of
+ * descriptor operations its child applies before exec, in order: the
+ * pipe ends first, then every redirection as written. Files are opened
+ * here in the parent, so every launch mode reports errors the same way,
+ * and moved above descriptor 9 so no operation can overwrite a file
+ * that a later one still needs
+ *
+ * Parameters:
+ *   command - The parsed command
+ *   inFd    - Pipe to read from, or -1 to inherit stdin
+ *   outFd   - Pipe to write to, or -1 to inherit stdout
+ *   plan    - Receives the operations, release it with CloseFdPlan
+ *
+ * Returns:
+ *   0 on success, -1 if a file could not be opened (an error is printed
+ *   and nothing is left open)
+ */
+int BuildFdPlan(ShellCommand* command, int inFd, int outFd, FdPlan* plan){
+    int redirects = 0;
+    for(Redirect* redirect = command->redirects; redirect; redirect = redirect->next){
+        redirects++;
+    }
+    plan->count = 0;
+    plan->openedCount = 0;
+    plan->redirected = 0;
+    plan->actions = (FdAction*)ArenaAlloc(&lineArena, (redirects + 2) * sizeof(FdAction));
+    plan->opened = (int*)ArenaAlloc(&lineArena, (redirects + 1) * sizeof(int));
+
+    if(inFd != -1){
+        plan->actions[plan->count++] = (FdAction){ STDIN_FILENO, inFd, 1 };
+        plan->redirected |= 1u << STDIN_FILENO;
+    }
+    if(outFd != -1){
+        plan->actions[plan->count++] = (FdAction){ STDOUT_FILENO, outFd, 1 };
+        plan->redirected |= 1u << STDOUT_FILENO;
+    }
+
+    for(Redirect* redirect = command->redirects; redirect; redirect = redirect->next){
+        int source;
+        if(redirect->kind == REDIRECT_CLOSE){
+            plan->actions[plan->count++] = (FdAction){ redirect->fd, -1, 0 };
+            plan->redirected &= ~(1u << redirect->fd);
+            continue;
+        }
+        if(redirect->kind == REDIRECT_DUP){
+            // Copying one of the shell's own close-on-exec descriptors would leak it
+            source = redirect->source;
+            int flags = fcntl(source, F_GETFD);
+            if(!(plan->redirected & (1u << source)) && (flags == -1 || (flags & FD_CLOEXEC))){
+                fprintf(stderr, "Error: Bad file descriptor %d\n", source);
+                CloseFdPlan(plan);
+                return -1;
+            }
+            plan->actions[plan->count++] = (FdAction){ redirect->fd, source, 0 };
+            plan->redirected |= 1u << redirect->fd;
+            continue;
+        }
+
+        if(redirect->kind == REDIRECT_HERE){
+            source = HereDocumentFd(redirect->path, redirect->length);
+            if(source == -1){
+                CloseFdPlan(plan);
+                return -1;
+            }
+        }
+        else{
+            int reading = redirect->kind == REDIRECT_READ;
+            if(redirect->path[0] == '\0'){  // Prevents empty filenames
+                fprintf(stderr, "Error: No %s filename specified\n", reading ? "input" : "output");
+                CloseFdPlan(plan);
+                return -1;
+            }
+            int flags = redirect->kind == REDIRECT_READ ? O_RDONLY :
+                        redirect->kind == REDIRECT_WRITE ? O_WRONLY | O_CREAT | O_TRUNC :
+                        redirect->kind == REDIRECT_APPEND ? O_WRONLY | O_CREAT | O_APPEND : O_RDWR | O_CREAT;
+            source = open(redirect->path, flags | O_CLOEXEC, 0644);
+            if(source == -1){
+                fprintf(stderr, "Error: Cannot open %s file '%s': %s\n", reading ? "input" : "output", redirect->path, strerror(errno));
+                CloseFdPlan(plan);
+                return -1;
+            }
+        }
+        if(source < REDIRECT_FD_LIMIT){
+            int moved = fcntl(source, F_DUPFD_CLOEXEC, REDIRECT_FD_LIMIT);
+            if(moved != -1){
+                close(source);
+                source = moved;
+            }
+        }
+        plan->opened[plan->openedCount++] = source;
+        plan->actions[plan->count++] = (FdAction){ redirect->fd, source, 1 };
+        plan->redirected |= 1u << redirect->fd;
+    }
+    return 0;
+}
+
+
+/*
+ * Function: CloseFdPlan
+ * ---------------------
+ * Closes the shell's copies of the descriptors a plan opened, once the
+ * child has its own
+ *
+ * Parameters:
+ *   plan - The plan
+ *
+ * Returns:
+ *   None
+ */
+void CloseFdPlan(FdPlan* plan){
+    for(int i = 0; i < plan->openedCount; i++){
+        close(plan->opened[i]);
+    }
+    plan->openedCount = 0;
+}
+
+
+/*
+ * Function: ApplyFdPlan
+ * ---------------------
+ * Carries out a plan's operations in the current process. Only calls
+ * dup2, fcntl, close and close_range, so it is safe after vfork()
+ *
+ * Parameters:
+ *   plan        - The plan
+ *   closeOthers - Also close every descriptor above 2 that the plan does
+ *                 not redirect, so nothing the shell leaked survives exec.
+ *                 Those above 9 are only marked close-on-exec, which
+ *                 lets a pipe reporting exec errors stay open until exec
+ *
+ * Returns:
+ *   None
+ */
+void ApplyFdPlan(const FdPlan* plan, int closeOthers){
+    for(int i = 0; i < plan->count; i++){
+        const FdAction* action = &plan->actions[i];
+        if(action->source == -1){
+            close(action->fd);
+        }
+        else if(action->source == action->fd){
+            fcntl(action->fd, F_SETFD, 0);  // dup2 would leave close-on-exec set
+        }
+        else{
+            dup2(action->source, action->fd);
+        }
+    }
+    if(closeOthers){
+        for(int fd = STDERR_FILENO + 1; fd < REDIRECT_FD_LIMIT; fd++){
+            if(!(plan->redirected & (1u << fd))){
+                close(fd);
+            }
+        }
+        close_range(REDIRECT_FD_LIMIT, ~0U, CLOSE_RANGE_CLOEXEC);
+    }
+}
+
+
+/*
+ * Function: RedirectsFd
+ * ---------------------
+ * Checks whether a command redirects a descriptor
+ *
+ * Parameters:
+ *   command - The parsed command
+ *   fd      - The descriptor
+ *
+ * Returns:
+ *   1 if one of its redirections names fd, 0 otherwise
+ */
+int RedirectsFd(const ShellCommand* command, int fd){
+    for(const Redirect* redirect = command->redirects; redirect; redirect = redirect->next){
+        if(redirect->fd == fd){
+            return 1;
+        }
+    }
+    return 0;
+}
+
+
+/*
+ * Function: FormatRedirect
+ * ------------------------
+ * Writes a redirection back out the way it could have been typed, used
+ * for the job table's command text
+ *
+ * Parameters:
+ *   out      - Where the text goes, may be NULL to only measure it
+ *   size     - Room at out
+ *   redirect - The redirection
+ *
+ * Returns:
+ *   The length of the text, like snprintf
+ */
+int FormatRedirect(char* out, size_t size, const Redirect* redirect){
+    int fd = redirect->fd;
+    switch(redirect->kind){
+        case REDIRECT_READ:
+            return fd == 0 ? snprintf(out, size, " < %s", redirect->path) : snprintf(out, size, " %d< %s", fd, redirect->path);
+        case REDIRECT_WRITE:
+            return fd == 1 ? snprintf(out, size, " > %s", redirect->path) : snprintf(out, size, " %d> %s", fd, redirect->path);
+        case REDIRECT_APPEND:
+            return fd == 1 ? snprintf(out, size, " >> %s", redirect->path) : snprintf(out, size, " %d>> %s", fd, redirect->path);
+        case REDIRECT_READ_WRITE:
+            return snprintf(out, size, " %d<> %s", fd, redirect->path);
+        case REDIRECT_DUP:
+            return snprintf(out, size, " %d>&%d", fd, redirect->source);
+        case REDIRECT_CLOSE:
+            return snprintf(out, size, " %d>&-", fd);
+        default:
+            if(redirect->hereEnd){
+                return snprintf(out, size, " << %s", redirect->hereEnd);
+            }
+            return snprintf(out, size, " <<< %.*s", (int)redirect->length - 1, redirect->path);
+    }
+}
+
+
+/*
+ * Function: HereDocumentFd
+ * ------------------------
+ * Puts a here-document where a command can read it as stdin, without
+ * touching the file system. A body that fits in a pipe's buffer is
+ * written into a pipe, so the write never blocks, anything larger goes
+ * into a memfd
+ *
+ * Parameters:
+ *   text   - The body
+ *   length - Its length in bytes
+ *
+ * Returns:
+ *   A close-on-exec descriptor to read the body from, or -1 on error
+ *   (an error is printed)
+ */
+int HereDocumentFd(const char* text, size_t length){
+    if(length <= HERE_PIPE_LIMIT){
+        int fds[2];
+        if(pipe2(fds, O_CLOEXEC) == 0){
+            // A new pipe holds 64KB, unless the user's pipe budget has run out
+            int size = fcntl(fds[1], F_GETPIPE_SZ);
+            if(size >= 0 && (size_t)size >= length && write(fds[1], text, length) == (ssize_t)length){
+                close(fds[1]);
+                return fds[0];
+            }
+            close(fds[0]);
+            close(fds[1]);
+        }
+    }
+
+    int fd = memfd_create("techshell-heredoc", MFD_CLOEXEC);
+    if(fd == -1){
+        fprintf(stderr, "Error: Cannot create here-document: %s\n", strerror(errno));
+        return -1;
+    }
+    size_t done = 0;
+    while(done < length){
+        ssize_t wrote = write(fd, text + done, length - done);
+        if(wrote == -1 && errno == EINTR){
+            continue;
+        }
+        if(wrote <= 0){
+            fprintf(stderr, "Error: Cannot write here-document: %s\n", strerror(errno));
+            close(fd);
+            return -1;
+        }
+        done += wrote;
+    }
+    lseek(fd, 0, SEEK_SET);
+    return fd;
+}
+
+
+/*
+ * Function: LaunchProcess
+ * -----------------------
+ * Starts an external command with the engine selected by launchMode.
+ * posix_spawn, vfork and the zygote avoid copying the shell's page
+ * tables, so their cost does not grow with the shell's memory footprint
+ * like fork does
+ *
+ * Parameters:
+ *   path  - Resolved path of the program, as returned by ResolveCommand
+ *   args  - NULL terminated argument vector, args[0] is the command
+ *   envp  - NULL terminated environment, from VariableEnvironment
+ *   plan  - Descriptor operations from BuildFdPlan, or NULL to inherit ours
+ *   pgid  - Process group to join, 0 for a new one, -1 to stay in ours
+ *
+ * Returns:
+ *   The child's pid, or -1 with errno set if it could not be started.
+ *   ENOENT is left for the caller to report so it can retry the lookup
+ */
+pid_t LaunchProcess(const char* path, char** args, char** envp, const FdPlan* plan, pid_t pgid){
+    pid_t pid;
+
+    // Forked copies of the shell would get children that are not their own,
+    // they and requests the zygote cannot take fall back to posix_spawn
+    if(launchMode == LAUNCH_ZYGOTE && zygoteFd != -1 && zygoteOwner == getpid() &&
+       ZygoteLaunch(path, args, envp, plan, pgid, &pid) == 0){
+        return pid;
+    }
+
+    if(launchMode == LAUNCH_SPAWN || launchMode == LAUNCH_ZYGOTE){
+        // The child gets an empty signal mask, default dispositions and its job's group
+        posix_spawnattr_t attr;
+        posix_spawnattr_init(&attr);
+        sigset_t mask;
+        sigemptyset(&mask);
+        posix_spawnattr_setsigmask(&attr, &mask);
+        sigaddset(&mask, SIGINT);
+        sigaddset(&mask, SIGQUIT);
+        sigaddset(&mask, SIGTSTP);
+        sigaddset(&mask, SIGTTIN);
+        sigaddset(&mask, SIGTTOU);
+        sigaddset(&mask, SIGCHLD);
+        posix_spawnattr_setsigdefault(&attr, &mask);
+        short flags = POSIX_SPAWN_SETSIGMASK | POSIX_SPAWN_SETSIGDEF;
+        if(pgid != -1){
+            posix_spawnattr_setpgroup(&attr, pgid);
+            flags |= POSIX_SPAWN_SETPGROUP;
+        }
+        posix_spawnattr_setflags(&attr, flags);
+
+        // Redirections become file actions that run in the child before exec
+        posix_spawn_file_actions_t actions;
+        posix_spawn_file_actions_init(&actions);
+        if(plan){
+            for(int i = 0; i < plan->count; i++){
+                if(plan->actions[i].source == -1){
+                    posix_spawn_file_actions_addclose(&actions, plan->actions[i].fd);
+                }
+                else{
+                    posix_spawn_file_actions_adddup2(&actions, plan->actions[i].source, plan->actions[i].fd);
+                }
+            }
+            for(int fd = STDERR_FILENO + 1; fd < REDIRECT_FD_LIMIT; fd++){
+                if(!(plan->redirected & (1u << fd))){
+                    posix_spawn_file_actions_addclose(&actions, fd);
+                }
+            }
+            posix_spawn_file_actions_addclosefrom_np(&actions, REDIRECT_FD_LIMIT);
+        }
+
+        int err = posix_spawn(&pid, path, &actions, &attr, args, envp);
+        posix_spawn_file_actions_destroy(&actions);
+        posix_spawnattr_destroy(&attr);
+        if(err != 0){
+            if(err != ENOENT){
+                fprintf(stderr, "Error: Cannot execute '%s': %s\n", args[0], strerror(err));
+            }
+            errno = err;
+            return -1;
+        }
+        return pid;
+    }
+
+    if(launchMode == LAUNCH_VFORK){
+        // The child shares our memory until it execs, so it can hand errno back
+        volatile int execError = 0;
+        volatile pid_t group = pgid;  // Must survive the child running on our stack
+
+        pid = vfork();
+        if(pid == -1){
+            perror("vfork failed");
+            return -1;
+        }
+        if(pid == 0){ // Child process, only async-signal-safe calls allowed here
+            PrepareChild(group);
+            if(plan){
+                ApplyFdPlan(plan, 1);
+            }
+            execve(path, args, envp);
+            execError = errno;
+            _exit(127);
+        }
+
+        if(execError != 0){
+            waitpid(pid, NULL, 0);  // Reap the child that failed to exec
+            if(execError != ENOENT){
+                fprintf(stderr, "Error: Cannot execute '%s': %s\n", args[0], strerror(execError));
+            }
+            errno = execError;
+            return -1;
+        }
+        if(group != -1){
+            setpgid(pid, group == 0 ? pid : group);
+        }
+        return pid;
+    }
+
+    // Fork a new process to execute external commands
+    pid = fork();
+    if(pid == -1){
+        perror("Fork failed");
+        return -1;
+    }
+    if(pid == 0){ // Child process
+        PrepareChild(pgid);
+        if(plan){
+            ApplyFdPlan(plan, 1);
+        }
+
+        // Execute the already resolved program
+        execve(path, args, envp);
+        fprintf(stderr, "Error: Command '%s' not found\n", args[0]);
+        _exit(127);
+    }
+    if(pgid != -1){
+        setpgid(pid, pgid == 0 ? pid : pgid);  // Also done by the child, whoever runs first wins
+    }
+    return pid;
+}
+
+
+/*
+ * Function: PrepareChild
+ * ----------------------
+ * Undoes the shell's own signal setup in a freshly forked child and
+ * moves it into its job's process group. Safe to call after vfork()
+ *
+ * Parameters:
+ *   pgid - Process group to join, 0 for a new one, -1 to stay in ours
+ *
+ * Returns:
+ *   None
+ */
+void PrepareChild(pid_t pgid){
+    if(pgid != -1){
+        setpgid(0, pgid);
+    }
+
+    struct sigaction action;
+    memset(&action, 0, sizeof(action));
+    action.sa_handler = SIG_DFL;
+    sigemptyset(&action.sa_mask);
+    int reset[] = { SIGINT, SIGQUIT, SIGTSTP, SIGTTIN, SIGTTOU, SIGCHLD };
+    for(size_t i = 0; i < sizeof(reset) / sizeof(reset[0]); i++){
+        sigaction(reset[i], &action, NULL);
+    }
+
+    sigset_t mask;
+    sigemptyset(&mask);
+    sigprocmask(SIG_SETMASK, &mask, NULL);
+}
+
+
+/*
+ * Function: StartZygote
+ * ---------------------
+ * Forks the zygote, a helper that starts commands for the shell. It is
+ * forked while the shell is still small and never grows, so cloning it
+ * costs the same however much memory the shell itself ends up using
+ *
+ * Parameters:
+ *   None
+ *
+ * Returns:
+ *   0 on success, -1 if it could not be started (an error is printed)
+ */
+int StartZygote(){
+    int pair[2];
+    if(socketpair(AF_UNIX, SOCK_STREAM | SOCK_CLOEXEC, 0, pair) == -1){
+        perror("Cannot start launch helper");
+        return -1;
+    }
+
+    fflush(NULL);  // Nothing buffered may be written twice
+    pid_t pid = fork();
+    if(pid == -1){
+        perror("Cannot start launch helper");
+        close(pair[0]);
+        close(pair[1]);
+        return -1;
+    }
+    if(pid == 0){
+        close(pair[0]);
+        ZygoteMain(pair[1]);
+    }
+    close(pair[1]);
+    zygoteFd = pair[0];
+    zygoteOwner = getpid();
+    return 0;
+}
+
+
+/*
+ * Function: ZygoteMain
+ * --------------------
+ * The zygote's loop. Reads launch requests from the shell, starts each
+ * command and answers with its pid, until the shell closes the socket
+ *
+ * Parameters:
+ *   fd - The zygote's end of the socket
+ *
+ * Returns:
+ *   Never, the process exits when the shell goes away
+ */
+void ZygoteMain(int fd){
+    // Keep only the socket, with /dev/null as stdio so no pipe is held open
+    int sock = fcntl(fd, F_DUPFD_CLOEXEC, REDIRECT_FD_LIMIT);
+    if(sock == -1){
+        _exit(EXIT_FAILURE);
+    }
+    int null = open("/dev/null", O_RDWR);
+    for(int i = STDIN_FILENO; i <= STDERR_FILENO; i++){
+        dup2(null, i);
+    }
+    close_range(STDERR_FILENO + 1, sock - 1, 0);
+    close_range(sock + 1, ~0U, 0);
+
+    // Keyboard signals are meant for the shell's jobs
+    struct sigaction action;
+    memset(&action, 0, sizeof(action));
+    action.sa_handler = SIG_IGN;
+    sigemptyset(&action.sa_mask);
+    int ignore[] = { SIGINT, SIGQUIT, SIGTSTP, SIGTTIN, SIGTTOU };
+    for(size_t i = 0; i < sizeof(ignore) / sizeof(ignore[0]); i++){
+        sigaction(ignore[i], &action, NULL);
+    }
+
+    char* body = NULL;
+    size_t capacity = 0;
+    for(;;){
+        ZygoteRequest request;
+        int fds[ZYGOTE_MAX_FDS];
+        char control[CMSG_SPACE(sizeof(fds))];
+        struct iovec iov = { &request, sizeof(request) };
+        struct msghdr message;
+        memset(&message, 0, sizeof(message));
+        message.msg_iov = &iov;
+        message.msg_iovlen = 1;
+        message.msg_control = control;
+        message.msg_controllen = sizeof(control);
+
+        ssize_t got = recvmsg(sock, &message, MSG_CMSG_CLOEXEC);
+        if(got == -1 && errno == EINTR){
+            continue;
+        }
+        if(got <= 0 || ((size_t)got < sizeof(request) &&
+                        ReceiveFully(sock, (char*)&request + got, sizeof(request) - got) != 0)){
+            _exit(0);  // The shell has gone
+        }
+
+        int fdCount = 0;
+        for(struct cmsghdr* header = CMSG_FIRSTHDR(&message); header; header = CMSG_NXTHDR(&message, header)){
+            if(header->cmsg_level == SOL_SOCKET && header->cmsg_type == SCM_RIGHTS){
+                int count = (header->cmsg_len - CMSG_LEN(0)) / sizeof(int);
+                memcpy(fds + fdCount, CMSG_DATA(header), count * sizeof(int));
+                fdCount += count;
+            }
+        }
+
+        if(request.bodyLength > capacity){
+            capacity = request.bodyLength;
+            body = (char*)realloc(body, capacity);
+            if(!body){
+                _exit(EXIT_FAILURE);
+            }
+        }
+        if(ReceiveFully(sock, body, request.bodyLength) != 0){
+            _exit(0);
+        }
+
+        ZygoteReply reply = ZygoteClone(&request, body, fds, fdCount);
+        for(int i = 0; i < fdCount; i++){
+            close(fds[i]);
+        }
+        if(SendFully(sock, &reply, sizeof(reply)) != 0){
+            _exit(0);
+        }
+    }
+}
+
+
+/*
+ * Function: ZygoteClone
+ * ---------------------
+ * Starts the command of one launch request. It is cloned with
+ * CLONE_PARENT, so it becomes a child of the shell rather than of the
+ * zygote and the shell waits for it, reads its rusage and moves it
+ * between process groups exactly as if it had forked it itself
+ *
+ * Parameters:
+ *   request - The request's fixed part
+ *   body    - Its actions and strings
+ *   fds     - The descriptors it passed, in the zygote's numbering
+ *   fdCount - How many there are
+ *
+ * Returns:
+ *   The pid, and the errno of clone or execve if the command did not start
+ */
+ZygoteReply ZygoteClone(const ZygoteRequest* request, char* body, int* fds, int fdCount){
+    ZygoteReply reply = { -1, 0 };
+
+    FdAction* actions = (FdAction*)body;
+    char* text = body + request->actionCount * sizeof(FdAction);
+    char* path = text;
+    text += strlen(text) + 1;
+    char** vectors = (char**)malloc((request->argCount + request->envCount + 2) * sizeof(char*));
+    if(!vectors){
+        reply.error = ENOMEM;
+        return reply;
+    }
+    char** args = vectors;
+    char** envp = vectors + request->argCount + 1;
+    for(uint32_t i = 0; i < request->argCount; i++){
+        args[i] = text;
+        text += strlen(text) + 1;
+    }
+    args[request->argCount] = NULL;
+    for(uint32_t i = 0; i < request->envCount; i++){
+        envp[i] = text;
+        text += strlen(text) + 1;
+    }
+    envp[request->envCount] = NULL;
+
+    // Closed by a successful exec, so reading it tells whether exec worked
+    int errorPipe[2];
+    if(pipe2(errorPipe, O_CLOEXEC) == -1){
+        reply.error = errno;
+        free(vectors);
+        return reply;
+    }
+
+    pid_t pid = syscall(SYS_clone, CLONE_PARENT | SIGCHLD, NULL, NULL, NULL, NULL);
+    if(pid == 0){ // Child process
+        PrepareChild(request->pgid);
+        int errorFd = fcntl(errorPipe[1], F_DUPFD_CLOEXEC, REDIRECT_FD_LIMIT);
+
+        // The shell's working directory first, then its descriptors
+        if(fchdir(fds[0]) == 0){
+            // Received descriptors land anywhere, lift them clear of 0-9 first
+            for(int i = 0; i < fdCount; i++){
+                fds[i] = fcntl(fds[i], F_DUPFD_CLOEXEC, REDIRECT_FD_LIMIT);
+            }
+
+            // Start from the shell's descriptors, as a forked child would
+            int next = 1;
+            for(int fd = 0; fd < REDIRECT_FD_LIMIT; fd++){
+                if(request->inherited & (1u << fd)){
+                    dup2(fds[next++], fd);
+                }
+                else if(fd <= STDERR_FILENO){
+                    close(fd);
+                }
+            }
+            for(uint32_t i = 0; i < request->actionCount; i++){
+                if(actions[i].opened){
+                    actions[i].source = fds[actions[i].source];
+                }
+            }
+            FdPlan plan = { actions, (int)request->actionCount, NULL, 0, request->redirected };
+            ApplyFdPlan(&plan, 1);
+
+            execve(path, args, envp);
+        }
+        int error = errno;
+        if(write(errorFd, &error, sizeof(error)) == -1){
+            _exit(126);
+        }
+        _exit(127);
+    }
+    int cloneError = errno;
+    close(errorPipe[1]);
+
+    if(pid == -1){
+        reply.error = cloneError;
+    }
+    else{
+        reply.pid = pid;
+        int error;
+        ssize_t got;
+        while((got = read(errorPipe[0], &error, sizeof(error))) == -1 && errno == EINTR){
+        }
+        if(got == sizeof(error)){
+            reply.error = error;
+        }
+    }
+    close(errorPipe[0]);
+    free(vectors);
+    return reply;
+}
+
+
+/*
+ * Function: ZygoteLaunch
+ * ----------------------
+ * Has the zygote start a command. Sends the arguments, environment and
+ * descriptor plan in one request, passing the descriptors the plan uses
+ * with SCM_RIGHTS, and waits for the pid
+ *
+ * Parameters:
+ *   path  - Resolved path of the program
+ *   args  - NULL terminated argument vector
+ *   envp  - NULL terminated environment
+ *   plan  - Descriptor operations from BuildFdPlan, or NULL
+ *   pgid  - Process group to join, 0 for a new one, -1 to stay in ours
+ *   pid   - Receives the child's pid, or -1 with errno set
+ *
+ * Returns:
+ *   0 if the zygote handled the request, -1 if the caller has to start
+ *   the command some other way (the zygote is gone or the plan passes
+ *   too many descriptors)
+ */
+int ZygoteLaunch(const char* path, char** args, char** envp, const FdPlan* plan, pid_t pgid, pid_t* pid){
+    ZygoteRequest request;
+    memset(&request, 0, sizeof(request));
+    request.pgid = pgid;
+    request.actionCount = plan ? plan->count : 0;
+    request.redirected = plan ? plan->redirected : 0;
+
+    // Our stdio, plus any 3-9 the plan copies from, are the child's starting point
+    unsigned int wanted = (1u << STDIN_FILENO) | (1u << STDOUT_FILENO) | (1u << STDERR_FILENO);
+    for(uint32_t i = 0; i < request.actionCount; i++){
+        if(!plan->actions[i].opened && plan->actions[i].source != -1){
+            wanted |= 1u << plan->actions[i].source;
+        }
+    }
+    int fds[ZYGOTE_MAX_FDS];
+    int fdCount = 0;
+
+    // The zygote's own directory is still the one the shell started in
+    int cwdFd = open(".", O_PATH | O_DIRECTORY | O_CLOEXEC);
+    if(cwdFd == -1){
+        return -1;
+    }
+    fds[fdCount++] = cwdFd;
+    for(int fd = 0; fd < REDIRECT_FD_LIMIT; fd++){
+        if((wanted & (1u << fd)) && fcntl(fd, F_GETFD) != -1){
+            request.inherited |= 1u << fd;
+            fds[fdCount++] = fd;
+        }
+    }
+
+    size_t length = request.actionCount * sizeof(FdAction) + strlen(path) + 1;
+    for(int i = 0; args[i]; i++, request.argCount++){
+        length += strlen(args[i]) + 1;
+    }
+    for(int i = 0; envp[i]; i++, request.envCount++){
+        length += strlen(envp[i]) + 1;
+    }
+    if(length > zygoteBufferSize){
+        zygoteBuffer = (char*)realloc(zygoteBuffer, length);
+        if(!zygoteBuffer){
+            perror("Memory allocation failed");
+            exit(EXIT_FAILURE);
+        }
+        zygoteBufferSize = length;
+    }
+    request.bodyLength = length;
+
+    // Opened sources travel as descriptors and are named by their position
+    FdAction* actions = (FdAction*)zygoteBuffer;
+    for(uint32_t i = 0; i < request.actionCount; i++){
+        actions[i] = plan->actions[i];
+        if(actions[i].opened){
+            if(fdCount == ZYGOTE_MAX_FDS){
+                close(cwdFd);
+                return -1;
+            }
+            actions[i].source = fdCount;
+            fds[fdCount++] = plan->actions[i].source;
+        }
+    }
+    char* out = zygoteBuffer + request.actionCount * sizeof(FdAction);
+    out = stpcpy(out, path) + 1;
+    for(int i = 0; args[i]; i++){
+        out = stpcpy(out, args[i]) + 1;
+    }
+    for(int i = 0; envp[i]; i++){
+        out = stpcpy(out, envp[i]) + 1;
+    }
+
+    char control[CMSG_SPACE(sizeof(fds))];
+    struct iovec iov[2] = { { &request, sizeof(request) }, { zygoteBuffer, length } };
+    struct msghdr message;
+    memset(&message, 0, sizeof(message));
+    message.msg_iov = iov;
+    message.msg_iovlen = 2;
+    message.msg_control = control;
+    message.msg_controllen = CMSG_SPACE(fdCount * sizeof(int));
+    struct cmsghdr* header = CMSG_FIRSTHDR(&message);
+    header->cmsg_level = SOL_SOCKET;
+    header->cmsg_type = SCM_RIGHTS;
+    header->cmsg_len = CMSG_LEN(fdCount * sizeof(int));
+    memcpy(CMSG_DATA(header), fds, fdCount * sizeof(int));
+
+    ssize_t sent;
+    while((sent = sendmsg(zygoteFd, &message, MSG_NOSIGNAL)) == -1 && errno == EINTR){
+    }
+    close(cwdFd);  // The zygote has its own copy once the first byte is sent
+    int failed = sent == -1;
+    if(!failed && (size_t)sent < sizeof(request) + length){
+        // The rest goes without descriptors, they travelled with the first byte
+        size_t done = sent;
+        if(done < sizeof(request)){
+            failed = SendFully(zygoteFd, (char*)&request + done, sizeof(request) - done) != 0;
+            done = sizeof(request);
+        }
+        failed = failed || SendFully(zygoteFd, zygoteBuffer + (done - sizeof(request)), sizeof(request) + length - done) != 0;
+    }
+    ZygoteReply reply;
+    if(failed || ReceiveFully(zygoteFd, &reply, sizeof(reply)) != 0){
+        fprintf(stderr, "Error: Launch helper exited, using posix_spawn from now on\n");
+        close(zygoteFd);
+        zygoteFd = -1;
+        return -1;
+    }
+
+    if(reply.error != 0){
+        if(reply.pid > 0){
+            waitpid(reply.pid, NULL, 0);  // Reap the child that failed to exec, it is ours
+        }
+        if(reply.error != ENOENT){
+            fprintf(stderr, "Error: Cannot execute '%s': %s\n", args[0], strerror(reply.error));
+        }
+        errno = reply.error;
+        *pid = -1;
+        return 0;
+    }
+    if(pgid != -1){
+        setpgid(reply.pid, pgid == 0 ? reply.pid : pgid);  // Also done by the child, whoever runs first wins
+    }
+    *pid = reply.pid;
+    return 0;
+}
+
+
+/*
+ * Function: SendFully
+ * -------------------
+ * Writes all of a buffer to a socket, without raising SIGPIPE if the
+ * other end has gone
+ *
+ * Parameters:
+ *   fd     - The socket
+ *   data   - The bytes
+ *   length - How many
+ *
+ * Returns:
+ *   0 on success, -1 on error
+ */
+int SendFully(int fd, const void* data, size_t length){
+    const char* bytes = (const char*)data;
+    while(length > 0){
+        ssize_t sent = send(fd, bytes, length, MSG_NOSIGNAL);
+        if(sent == -1 && errno == EINTR){
+            continue;
+        }
+        if(sent <= 0){
+            return -1;
+        }
+        bytes += sent;
+        length -= sent;
+    }
+    return 0;
+}
+
+
+/*
+ * Function: ReceiveFully
+ * ----------------------
+ * Reads exactly length bytes from a socket
+ *
+ * Parameters:
+ *   fd     - The socket
+ *   data   - Receives the bytes
+ *   length - How many
+ *
+ * Returns:
+ *   0 on success, -1 on error or if the other end closed first
+ */
+int ReceiveFully(int fd, void* data, size_t length){
+    char* bytes = (char*)data;
+    while(length > 0){
+        ssize_t got = recv(fd, bytes, length, 0);
+        if(got == -1 && errno == EINTR){
+            continue;
+        }
+        if(got <= 0){
+            return -1;
+        }
+        bytes += got;
+        length -= got;
+    }
+    return 0;
+}
+
+
+/*
+ * Function: ServerMain
+ * --------------------
+ * Runs the shell as a command server on a Unix socket. Requests are read
+ * from any number of connections and run through ExecuteCommand as
+ * background jobs, at most limit at a time, with their stdout and stderr
+ * sent back as they are written, followed by the exit status. No socket
+ * is ever waited on, so a client that is slow to read only holds up its
+ * own commands, which block on their pipes once their queue is full
+ *
+ * Parameters:
+ *   path  - Where to create the socket
+ *   limit - Most requests running at once
+ *
+ * Returns:
+ *   Only on a setup error, with the exit status for the shell
+ */
+int ServerMain(const char* path, long limit){
+    int listener = ServerListen(path);
+    if(listener == -1){
+        return 1;
+    }
+
+    // Requests that ask for another directory are started from there, then we come back
+    int home = open(".", O_PATH | O_DIRECTORY | O_CLOEXEC);
+
+    ServerRequest* requests = NULL;
+    ServerClient* clients = NULL;
+    int clientCount = 0;
+    struct pollfd* polls = NULL;
+    ServerRequest** owners = NULL;  // Request whose pipe each poll entry watches
+    int pollCapacity = 0;
+    long running = 0;
+
+    for(;;){
+        ArenaReset(&lineArena);
+
+        // Queue the status of whatever has finished and drained, then let go
+        // of the requests whose last frame has been sent
+        for(ServerRequest** link = &requests; *link;){
+            ServerRequest* request = *link;
+            if(request->state == REQUEST_RUNNING && request->outFd == -1 && request->errFd == -1 &&
+               !(request->job && request->job->state != JOB_DONE)){
+                int32_t status = request->status;
+                if(request->job){
+                    status = JobStatus(request->job);
+                    RemoveJob(request->job);
+                    request->job = NULL;
+                }
+                ServerQueue(request, FRAME_EXIT, &status, sizeof(status));
+                ServerFlush(request);
+                request->state = REQUEST_FINISHED;
+                running--;
+            }
+            if(request->state == REQUEST_FINISHED && request->outputStart == request->outputEnd){
+                *link = request->next;
+                FreeServerRequest(request);
+                continue;
+            }
+            link = &request->next;
+        }
+        for(ServerRequest* request = requests; request && running < limit; request = request->next){
+            if(request->state == REQUEST_QUEUED){
+                ServerStart(request, home);
+                running++;
+            }
+        }
+
+        // Watch for connections, finished children, frames, room to send and output
+        for(ServerClient* client = clients; client; client = client->next){
+            client->waiting = 0;
+        }
+        int needed = 2 + clientCount;
+        for(ServerRequest* request = requests; request; request = request->next){
+            needed += 2;
+            if(request->client && request->outputStart < request->outputEnd){
+                request->client->waiting = 1;
+            }
+        }
+        if(needed > pollCapacity){
+            pollCapacity = needed * 2;
+            polls = (struct pollfd*)realloc(polls, pollCapacity * sizeof(struct pollfd));
+            owners = (ServerRequest**)realloc(owners, pollCapacity * sizeof(ServerRequest*));
+            if(!polls || !owners){
+                perror("Memory allocation failed");
+                exit(EXIT_FAILURE);
+            }
+        }
+        int count = 0;
+        polls[count++] = (struct pollfd){ listener, POLLIN, 0 };
+        polls[count++] = (struct pollfd){ childSignalFd, POLLIN, 0 };
+        for(ServerClient* client = clients; client; client = client->next){
+            polls[count++] = (struct pollfd){ client->fd, POLLIN | (client->waiting ? POLLOUT : 0), 0 };
+        }
+        int firstPipe = count;
+        for(ServerRequest* request = requests; request; request = request->next){
+            // A full queue leaves the command blocked on its pipe until the client catches up
+            if(request->outputEnd - request->outputStart >= SERVER_QUEUE_LIMIT){
+                continue;
+            }
+            if(request->outFd != -1){
+                owners[count] = request;
+                polls[count++] = (struct pollfd){ request->outFd, POLLIN, 0 };
+            }
+            if(request->errFd != -1){
+                owners[count] = request;
+                polls[count++] = (struct pollfd){ request->errFd, POLLIN, 0 };
+            }
+        }
+
+        if(poll(polls, count, -1) == -1){
+            if(errno != EINTR){
+                perror("poll failed");
+                return 1;
+            }
+            continue;
+        }
+
+        if(polls[1].revents){
+            ReapChildren();
+        }
+        int i = 2;
+        for(ServerClient* client = clients; client; client = client->next, i++){
+            if(polls[i].revents & POLLOUT){
+                ServerFlushClient(client, requests);
+            }
+            if(polls[i].revents & (POLLIN | POLLHUP | POLLERR)){
+                ServerReceive(client, &requests);
+            }
+        }
+        for(i = firstPipe; i < count; i++){
+            if(polls[i].revents){
+                ServerRequest* request = owners[i];
+                int isOut = polls[i].fd == request->outFd;
+                ServerForward(request, isOut ? &request->outFd : &request->errFd, isOut ? FRAME_STDOUT : FRAME_STDERR);
+            }
+        }
+
+        // Running requests of a dropped connection finish unheard, the rest are dropped with it
+        for(ServerClient** link = &clients; *link;){
+            ServerClient* client = *link;
+            if(!client->broken){
+                link = &client->next;
+                continue;
+            }
+            *link = client->next;
+            clientCount--;
+            ServerDropClient(client, &requests);
+        }
+        if(polls[0].revents){
+            int fd = accept4(listener, NULL, NULL, SOCK_CLOEXEC | SOCK_NONBLOCK);
+            if(fd != -1){
+                ServerClient* client = (ServerClient*)calloc(1, sizeof(ServerClient));
+                if(!client){
+                    perror("Memory allocation failed");
+                    exit(EXIT_FAILURE);
+                }
+                client->fd = fd;
+                client->next = clients;
+                clients = client;
+                clientCount++;
+            }
+        }
+    }
+}
+
+
+/*
+ * Function: ServerListen
+ * ----------------------
+ * Creates the server's listening socket. A socket file left behind by a
+ * server that is no longer running is replaced, a live one is not
+ *
+ * Parameters:
+ *   path - Where to create the socket
+ *
+ * Returns:
+ *   The listening descriptor, or -1 (an error is printed)
+ */
+int ServerListen(const char* path){
+    struct sockaddr_un address;
+    memset(&address, 0, sizeof(address));
+    address.sun_family = AF_UNIX;
+    if(strlen(path) >= sizeof(address.sun_path)){
+        fprintf(stderr, "Error: Socket path '%s' is too long\n", path);
+        return -1;
+    }
+    strcpy(address.sun_path, path);
+
+    int fd = socket(AF_UNIX, SOCK_STREAM | SOCK_CLOEXEC, 0);
+    if(fd == -1){
+        perror("socket failed");
+        return -1;
+    }
+    int bound = bind(fd, (struct sockaddr*)&address, sizeof(address));
+    if(bound == -1 && errno == EADDRINUSE){
+        int probe = socket(AF_UNIX, SOCK_STREAM | SOCK_CLOEXEC, 0);
+        if(probe != -1 && connect(probe, (struct sockaddr*)&address, sizeof(address)) == -1 && errno == ECONNREFUSED){
+            unlink(path);
+            bound = bind(fd, (struct sockaddr*)&address, sizeof(address));
+        }
+        else{
+            errno = EADDRINUSE;
+        }
+        if(probe != -1){
+            close(probe);
+        }
+    }
+    if(bound == -1 || listen(fd, SOMAXCONN) == -1){
+        fprintf(stderr, "Error: Cannot listen on '%s': %s\n", path, strerror(errno));
+        close(fd);
+        return -1;
+    }
+    return fd;
+}
+
+
+/*
+ * Function: ServerReceive
+ * -----------------------
+ * Takes whatever a client has sent so far without waiting for more, and
+ * adds every frame it completes to the request it belongs to. A frame
+ * may arrive over any number of reads
+ *
+ * Parameters:
+ *   client   - The connection, marked broken if it has closed or sent a bad frame
+ *   requests - The server's request list
+ *
+ * Returns:
+ *   None
+ */
+void ServerReceive(ServerClient* client, ServerRequest** requests){
+    char buffer[READ_BUFFER_SIZE];
+    ssize_t got = recv(client->fd, buffer, sizeof(buffer), 0);
+    if(got == -1 && (errno == EINTR || errno == EAGAIN || errno == EWOULDBLOCK)){
+        return;
+    }
+    if(got <= 0){
+        client->broken = 1;
+        return;
+    }
+
+    for(size_t used = 0; used < (size_t)got;){
+        if(client->headerBytes < sizeof(FrameHeader)){
+            size_t take = sizeof(FrameHeader) - client->headerBytes;
+            if(take > got - used){
+                take = got - used;
+            }
+            memcpy((char*)&client->header + client->headerBytes, buffer + used, take);
+            client->headerBytes += take;
+            used += take;
+            if(client->headerBytes < sizeof(FrameHeader)){
+                break;
+            }
+            if(client->header.length > SERVER_FRAME_LIMIT || client->header.type < FRAME_ARG || client->header.type > FRAME_RUN){
+                client->broken = 1;
+                return;
+            }
+            client->payload = (char*)malloc(client->header.length + 1);
+            if(!client->payload){
+                perror("Memory allocation failed");
+                exit(EXIT_FAILURE);
+            }
+            client->payloadBytes = 0;
+        }
+
+        size_t take = client->header.length - client->payloadBytes;
+        if(take > got - used){
+            take = got - used;
+        }
+        memcpy(client->payload + client->payloadBytes, buffer + used, take);
+        client->payloadBytes += take;
+        used += take;
+        if(client->payloadBytes == client->header.length){
+            client->payload[client->header.length] = '\0';
+            ServerAddFrame(requests, client, &client->header, client->payload);
+            client->payload = NULL;
+            client->headerBytes = 0;
+        }
+    }
+}
+
+
+/*
+ * Function: ServerAddFrame
+ * ------------------------
+ * Adds a complete frame to the request it belongs to, creating the
+ * request on its first frame
+ *
+ * Parameters:
+ *   requests - The server's request list
+ *   client   - The connection the frame came from
+ *   header   - The frame's header
+ *   payload  - Its NUL terminated payload, which the request takes over
+ *
+ * Returns:
+ *   None
+ */
+void ServerAddFrame(ServerRequest** requests, ServerClient* client, FrameHeader* header, char* payload){
+    // Frames of requests still being read, new ids go to the back of the queue
+    ServerRequest** link = requests;
+    while(*link && !((*link)->client == client && (*link)->id == header->id && (*link)->state == REQUEST_READING)){
+        link = &(*link)->next;
+    }
+    ServerRequest* request = *link;
+    if(request == NULL){
+        request = (ServerRequest*)calloc(1, sizeof(ServerRequest));
+        if(!request){
+            perror("Memory allocation failed");
+            exit(EXIT_FAILURE);
+        }
+        request->client = client;
+        request->id = header->id;
+        request->outFd = -1;
+        request->errFd = -1;
+        request->state = REQUEST_READING;
+        *link = request;
+    }
+
+    switch(header->type){
+        case FRAME_ARG:
+            request->args = AppendString(request->args, &request->argCount, payload);
+            return;
+        case FRAME_ENV:{
+            const char* equals = strchr(payload, '=');
+            if(equals == NULL || !IsVariableName(payload, equals - payload)){
+                free(request->error);
+                request->error = payload;  // Reported when the request runs
+                return;
+            }
+            request->env = AppendString(request->env, &request->envCount, payload);
+            return;
+        }
+        case FRAME_CWD:
+            free(request->cwd);
+            request->cwd = payload;
+            return;
+        case FRAME_STDIN:
+            // The line arena is reset between frames, so the payload lives on the heap
+            if(request->inputLength + header->length > request->inputCapacity){
+                request->inputCapacity = (request->inputLength + header->length) * 2;
+                request->input = (char*)realloc(request->input, request->inputCapacity);
+                if(!request->input){
+                    perror("Memory allocation failed");
+                    exit(EXIT_FAILURE);
+                }
+            }
+            memcpy(request->input + request->inputLength, payload, header->length);
+            request->inputLength += header->length;
+            free(payload);
+            return;
+        default:
+            request->state = REQUEST_QUEUED;
+            free(payload);
+            return;
+    }
+}
+
+
+/*
+ * Function: ServerStart
+ * ---------------------
+ * Starts a request through ExecuteCommand as a background job. The
+ * server's stdout and stderr point at the request's pipes while it is
+ * started, so the command and any error the shell reports about it
+ * write there, and its stdin is the payload as a here-document
+ *
+ * Parameters:
+ *   request - The request, it becomes REQUEST_RUNNING
+ *   home    - The server's own directory, to return to
+ *
+ * Returns:
+ *   None
+ */
+void ServerStart(ServerRequest* request, int home){
+    request->state = REQUEST_RUNNING;
+    request->status = 1;
+    int outPipe[2], errPipe[2];
+    if(pipe2(outPipe, O_CLOEXEC) == -1){
+        perror("pipe failed");
+        return;
+    }
+    if(pipe2(errPipe, O_CLOEXEC) == -1){
+        perror("pipe failed");
+        close(outPipe[0]);
+        close(outPipe[1]);
+        return;
+    }
+
+    fflush(stdout);
+    int savedOut = fcntl(STDOUT_FILENO, F_DUPFD_CLOEXEC, REDIRECT_FD_LIMIT);
+    int savedErr = fcntl(STDERR_FILENO, F_DUPFD_CLOEXEC, REDIRECT_FD_LIMIT);
+    dup2(outPipe[1], STDOUT_FILENO);
+    dup2(errPipe[1], STDERR_FILENO);
+    close(outPipe[1]);
+    close(errPipe[1]);
+
+    // The terminating NULLs are in place once anything was appended
+    ShellCommand command;
+    memset(&command, 0, sizeof(command));
+    char* noArgs[] = { NULL };
+    command.args = request->args ? request->args : noArgs;
+    command.assignments = request->env;
+    command.background = 1;
+    Redirect input = { REDIRECT_HERE, STDIN_FILENO, -1, request->input ? request->input : "", request->inputLength, "STDIN", 0, NULL };
+    command.redirects = &input;
+
+    int moved = request->cwd && *request->cwd;
+    if(request->error){
+        fprintf(stderr, "Error: Invalid environment entry '%s'\n", request->error);
+        request->status = 2;
+    }
+    else if(request->args == NULL){
+        fprintf(stderr, "Error: No command entered\n");
+    }
+    else if(moved && chdir(request->cwd) != 0){
+        fprintf(stderr, "Error: Cannot change to directory '%s': %s\n", request->cwd, strerror(errno));
+    }
+    else{
+        // A background job is added to the table, a refused or finished command is not
+        int before = jobCount;
+        request->status = ExecuteCommand(command);
+        request->job = jobCount > before ? jobs[jobCount - 1] : NULL;
+    }
+    fflush(stdout);
+    if(moved && fchdir(home) != 0){
+        perror("Cannot return to the server's directory");
+    }
+
+    int targets[] = { STDOUT_FILENO, STDERR_FILENO };
+    int saved[] = { savedOut, savedErr };
+    for(int i = 0; i < 2; i++){
+        if(saved[i] != -1){
+            dup2(saved[i], targets[i]);
+            close(saved[i]);
+        }
+        else{
+            close(targets[i]);
+        }
+    }
+    request->outFd = outPipe[0];
+    request->errFd = errPipe[0];
+
+    // The here-document holds its own copy of the input now
+    free(request->input);
+    request->input = NULL;
+}
+
+
+/*
+ * Function: ServerForward
+ * -----------------------
+ * Queues whatever a request's command has written to one of its pipes
+ * as a frame for the client, closing the pipe at end of file
+ *
+ * Parameters:
+ *   request - The request
+ *   fd      - Its outFd or errFd, set to -1 at end of file
+ *   type    - FRAME_STDOUT or FRAME_STDERR
+ *
+ * Returns:
+ *   None
+ */
+void ServerForward(ServerRequest* request, int* fd, FrameType type){
+    // Read straight into the queue, behind room for the header
+    char* frame = ServerReserve(request, sizeof(FrameHeader) + READ_BUFFER_SIZE);
+    ssize_t got = read(*fd, frame + sizeof(FrameHeader), READ_BUFFER_SIZE);
+    if(got == -1 && errno == EINTR){
+        return;
+    }
+    if(got <= 0){
+        close(*fd);
+        *fd = -1;
+        return;
+    }
+    if(request->client == NULL){
+        return;  // Nobody is listening, the output is dropped
+    }
+    FrameHeader header = { type, request->id, (uint32_t)got };
+    memcpy(frame, &header, sizeof(header));
+    request->outputEnd += sizeof(header) + got;
+    ServerFlush(request);
+}
+
+
+/*
+ * Function: ServerReserve
+ * -----------------------
+ * Makes room at the end of a request's output queue, moving what is
+ * still queued to the front before growing it
+ *
+ * Parameters:
+ *   request - The request
+ *   length  - Bytes needed
+ *
+ * Returns:
+ *   Where the bytes go, outputEnd is left for the caller to advance
+ */
+char* ServerReserve(ServerRequest* request, size_t length){
+    if(request->outputEnd + length > request->outputCapacity){
+        size_t queued = request->outputEnd - request->outputStart;
+        memmove(request->output, request->output + request->outputStart, queued);
+        request->outputStart = 0;
+        request->outputEnd = queued;
+        if(queued + length > request->outputCapacity){
+            request->outputCapacity = (queued + length) * 2;
+            request->output = (char*)realloc(request->output, request->outputCapacity);
+            if(!request->output){
+                perror("Memory allocation failed");
+                exit(EXIT_FAILURE);
+            }
+        }
+    }
+    return request->output + request->outputEnd;
+}
+
+
+/*
+ * Function: ServerQueue
+ * ---------------------
+ * Adds one frame to a request's output queue, or drops it if nobody is
+ * listening any more
+ *
+ * Parameters:
+ *   request - The request
+ *   type    - A FrameType
+ *   data    - The payload
+ *   length  - Its size
+ *
+ * Returns:
+ *   None
+ */
+void ServerQueue(ServerRequest* request, FrameType type, const void* data, uint32_t length){
+    if(request->client == NULL){
+        return;
+    }
+    char* frame = ServerReserve(request, sizeof(FrameHeader) + length);
+    FrameHeader header = { type, request->id, length };
+    memcpy(frame, &header, sizeof(header));
+    memcpy(frame + sizeof(header), data, length);
+    request->outputEnd += sizeof(header) + length;
+}
+
+
+/*
+ * Function: ServerFlush
+ * ---------------------
+ * Sends as much of a request's output queue as its client's socket takes
+ * without blocking. Frames of one connection's requests must not mix, so
+ * while another request is partway through a frame nothing is sent
+ *
+ * Parameters:
+ *   request - The request
+ *
+ * Returns:
+ *   None, the client is marked broken if the connection has failed
+ */
+void ServerFlush(ServerRequest* request){
+    ServerClient* client = request->client;
+    if(client == NULL || client->broken || (client->writer && client->writer != request)){
+        return;
+    }
+    while(request->outputStart < request->outputEnd){
+        ssize_t sent = send(client->fd, request->output + request->outputStart, request->outputEnd - request->outputStart, MSG_NOSIGNAL);
+        if(sent == -1){
+            if(errno == EINTR){
+                continue;
+            }
+            if(errno != EAGAIN && errno != EWOULDBLOCK){
+                client->broken = 1;
+            }
+            break;
+        }
+
+        // Step over the frames that went out, noting how much of a cut one is still owed
+        while(sent > 0){
+            if(request->frameLeft == 0){
+                FrameHeader header;
+                memcpy(&header, request->output + request->outputStart, sizeof(header));
+                request->frameLeft = sizeof(header) + header.length;
+            }
+            size_t take = (size_t)sent < request->frameLeft ? (size_t)sent : request->frameLeft;
+            request->frameLeft -= take;
+            request->outputStart += take;
+            sent -= take;
+        }
+    }
+    client->writer = request->frameLeft ? request : NULL;
+}
+
+
+/*
+ * Function: ServerFlushClient
+ * ---------------------------
+ * Sends queued output to a client whose socket has room again, starting
+ * with the request whose frame was cut short
+ *
+ * Parameters:
+ *   client   - The connection
+ *   requests - The server's request list
+ *
+ * Returns:
+ *   None
+ */
+void ServerFlushClient(ServerClient* client, ServerRequest* requests){
+    if(client->writer){
+        ServerFlush(client->writer);
+    }
+    for(ServerRequest* request = requests; request && client->writer == NULL && !client->broken; request = request->next){
+        if(request->client == client && request->outputStart < request->outputEnd){
+            ServerFlush(request);
+        }
+    }
+}
+
+
+/*
+ * Function: ServerDropClient
+ * --------------------------
+ * Closes a connection and frees it. Its running requests finish unheard,
+ * the ones still being read or queued are dropped
+ *
+ * Parameters:
+ *   client   - The connection, already unlinked from the server's list
+ *   requests - The server's request list
+ *
+ * Returns:
+ *   None
+ */
+void ServerDropClient(ServerClient* client, ServerRequest** requests){
+    close(client->fd);
+    for(ServerRequest** link = requests; *link;){
+        ServerRequest* request = *link;
+        if(request->client != client){
+            link = &request->next;
+        }
+        else if(request->state == REQUEST_RUNNING || request->state == REQUEST_FINISHED){
+            request->client = NULL;
+            request->outputStart = request->outputEnd = 0;
+            request->frameLeft = 0;
+            link = &request->next;
+        }
+        else{
+            *link = request->next;
+            FreeServerRequest(request);
+        }
+    }
+    free(client->payload);
+    free(client);
+}
+
+
+/*
+ * Function: FreeServerRequest
+ * ---------------------------
+ * Releases a request and everything it holds
+ *
+ * Parameters:
+ *   request - The request
+ *
+ * Returns:
+ *   None
+ */
+void FreeServerRequest(ServerRequest* request){
+    for(int i = 0; i < request->argCount; i++){
+        free(request->args[i]);
+    }
+    for(int i = 0; i < request->envCount; i++){
+        free(request->env[i]);
+    }
+    free(request->args);
+    free(request->env);
+    free(request->cwd);
+    free(request->input);
+    free(request->error);
+    free(request->output);
+    if(request->outFd != -1){
+        close(request->outFd);
+    }
+    if(request->errFd != -1){
+        close(request->errFd);
+    }
+    free(request);
+}
+
+
+/*
+ * Function: AppendString
+ * ----------------------
+ * Adds a string to a malloc'd NULL terminated list
+ *
+ * Parameters:
+ *   list  - The list, NULL for an empty one
+ *   count - Strings in it, incremented
+ *   text  - The string, the list takes ownership of it
+ *
+ * Returns:
+ *   The list, which may have moved
+ */
+char** AppendString(char** list, int* count, char* text){
+    list = (char**)realloc(list, (*count + 2) * sizeof(char*));
+    if(!list){
+        perror("Memory allocation failed");
+        exit(EXIT_FAILURE);
+    }
+    list[(*count)++] = text;
+    list[*count] = NULL;
+    return list;
+}
+
+
+/*
+ * Function: SendFrame
+ * -------------------
+ * Sends one frame of the command-server protocol
+ *
+ * Parameters:
+ *   fd     - The connection
+ *   type   - A FrameType
+ *   id     - The request it belongs to
+ *   data   - The payload
+ *   length - Its size
+ *
+ * Returns:
+ *   0 on success, -1 if the connection is gone
+ */
+int SendFrame(int fd, FrameType type, uint32_t id, const void* data, uint32_t length){
+    FrameHeader header = { type, id, length };
+    if(SendFully(fd, &header, sizeof(header)) != 0){
+        return -1;
+    }
+    return SendFully(fd, data, length);
+}
+
+
+/*
+ * Function: ClientMain
+ * --------------------
+ * Implements 'techshell --client', which sends one command to a server,
+ * copies its output to our stdout and stderr as it arrives and exits
+ * with its status:
+ *   techshell --client SOCKET [-n] [-C dir] [-e NAME=value]... [--] cmd args...
+ * The command runs in our directory unless -C names another, and gets
+ * all of our stdin as its input unless that is a terminal or -n is given
+ *
+ * Parameters:
+ *   argc - Arguments after --client
+ *   argv - The arguments
+ *
+ * Returns:
+ *   The command's exit status, or 1 if the server could not be reached
+ */
+int ClientMain(int argc, char* argv[]){
+    const char* usage = "Usage: techshell --client SOCKET [-n] [-C dir] [-e NAME=value]... [--] cmd args...\n";
+    if(argc < 2){
+        fprintf(stderr, "%s", usage);
+        return 2;
+    }
+    const char* cwd = NULL;
+    int sendInput = !isatty(STDIN_FILENO);
+    int i = 1;
+    for(; i < argc && argv[i][0] == '-'; i++){
+        if(strcmp(argv[i], "--") == 0){
+            i++;
+            break;
+        }
+        if(strcmp(argv[i], "-n") == 0){
+            sendInput = 0;
+            continue;
+        }
+        if((strcmp(argv[i], "-C") != 0 && strcmp(argv[i], "-e") != 0) || i + 1 == argc){
+            fprintf(stderr, "%s", usage);
+            return 2;
+        }
+        if(argv[i][1] == 'C'){
+            cwd = argv[i + 1];
+        }
+        i++;
+    }
+    if(i == argc){
+        fprintf(stderr, "%s", usage);
+        return 2;
+    }
+
+    struct sockaddr_un address;
+    memset(&address, 0, sizeof(address));
+    address.sun_family = AF_UNIX;
+    strncpy(address.sun_path, argv[0], sizeof(address.sun_path) - 1);
+    int fd = socket(AF_UNIX, SOCK_STREAM | SOCK_CLOEXEC, 0);
+    if(fd == -1 || connect(fd, (struct sockaddr*)&address, sizeof(address)) == -1){
+        fprintf(stderr, "Error: Cannot connect to '%s': %s\n", argv[0], strerror(errno));
+        return 1;
+    }
+
+    // One request, always id 1, built from our arguments
+    char here[PATH_MAX];
+    if(cwd == NULL){
+        cwd = getcwd(here, sizeof(here));
+    }
+    int failed = cwd && SendFrame(fd, FRAME_CWD, 1, cwd, strlen(cwd)) != 0;
+    for(int j = 1; j < i && !failed; j++){
+        if(strcmp(argv[j], "-e") == 0){
+            failed = SendFrame(fd, FRAME_ENV, 1, argv[j + 1], strlen(argv[j + 1])) != 0;
+        }
+        if(strcmp(argv[j], "-e") == 0 || strcmp(argv[j], "-C") == 0){
+            j++;
+        }
+    }
+    for(int j = i; j < argc && !failed; j++){
+        failed = SendFrame(fd, FRAME_ARG, 1, argv[j], strlen(argv[j])) != 0;
+    }
+    char* buffer = (char*)malloc(READ_BUFFER_SIZE);
+    if(!buffer){
+        perror("Memory allocation failed");
+        exit(EXIT_FAILURE);
+    }
+    if(sendInput){
+        ssize_t got;
+        while(!failed && ((got = read(STDIN_FILENO, buffer, READ_BUFFER_SIZE)) > 0 || (got == -1 && errno == EINTR))){
+            if(got > 0){
+                failed = SendFrame(fd, FRAME_STDIN, 1, buffer, got) != 0;
+            }
+        }
+    }
+    if(failed || SendFrame(fd, FRAME_RUN, 1, NULL, 0) != 0){
+        fprintf(stderr, "Error: Lost the connection to '%s'\n", argv[0]);
+        return 1;
+    }
+
+    // Output frames until the exit status
+    size_t capacity = READ_BUFFER_SIZE;
+    for(;;){
+        FrameHeader header;
+        if(ReceiveFully(fd, &header, sizeof(header)) != 0 || header.length > SERVER_FRAME_LIMIT){
+            fprintf(stderr, "Error: Lost the connection to '%s'\n", argv[0]);
+            return 1;
+        }
+        if(header.length > capacity){
+            capacity = header.length;
+            buffer = (char*)realloc(buffer, capacity);
+            if(!buffer){
+                perror("Memory allocation failed");
+                exit(EXIT_FAILURE);
+            }
+        }
+        if(ReceiveFully(fd, buffer, header.length) != 0){
+            fprintf(stderr, "Error: Lost the connection to '%s'\n", argv[0]);
+            return 1;
+        }
+        if(header.type == FRAME_EXIT && header.length == sizeof(int32_t)){
+            int32_t status;
+            memcpy(&status, buffer, sizeof(status));
+            return status;
+        }
+        int out = header.type == FRAME_STDERR ? STDERR_FILENO : STDOUT_FILENO;
+        for(size_t done = 0; done < header.length;){
+            ssize_t wrote = write(out, buffer + done, header.length - done);
+            if(wrote == -1 && errno == EINTR){
+                continue;
+            }
+            if(wrote <= 0){
+                break;
+            }
+            done += wrote;
+        }
+    }
+}
+
+
+/*
+ * Function: HashPathName
+ * ----------------------
+ * Hashes a command name into a bucket of the command lookup table (FNV-1a)
+ *
+ * Parameters:
+ *   name - The command name
+ *
+ * Returns:
+ *   A bucket index below PATH_HASH_SIZE
+ */
+unsigned int HashPathName(const char* name){
+    unsigned int hash = 2166136261u;
+    for(; *name; name++){
+        hash ^= (unsigned char)*name;
+        hash *= 16777619u;
+    }
+    return hash % PATH_HASH_SIZE;
+}
+
+
+/*
+ * Function: SearchPath
+ * --------------------
+ * Walks every $PATH directory looking for an executable regular file,
+ * the same order execvp() would try them in
+ *
+ * Parameters:
+ *   name - The command name, without any '/'
+ *   path - The $PATH value to search
+ *
+ * Returns:
+ *   A newly allocated absolute path, or NULL if nothing matched
+ */
+char* SearchPath(const char* name, const char* path){
+    size_t nameLen = strlen(name);
+    const char* dir = path;
+
+    for(;;){
+        const char* end = strchr(dir, ':');
+        size_t dirLen = end ? (size_t)(end - dir) : strlen(dir);
+
+        // An empty entry means the current directory
+        char* candidate = (char*)malloc(dirLen + nameLen + 3);
+        if(!candidate){
+            perror("Memory allocation failed");
+            exit(EXIT_FAILURE);
+        }
+        if(dirLen == 0){
+            candidate[0] = '.';
+            dirLen = 1;
+        }
+        else{
+            memcpy(candidate, dir, dirLen);
+        }
+        candidate[dirLen] = '/';
+        memcpy(candidate + dirLen + 1, name, nameLen + 1);
+
+        struct stat st;
+        if(stat(candidate, &st) == 0 && S_ISREG(st.st_mode) && access(candidate, X_OK) == 0){
+            return candidate;
+        }
+        free(candidate);
+
+        if(end == NULL){
+            return NULL;
+        }
+        dir = end + 1;
+    }
+}
+
+
+/*
+ * Function: ResolveCommand
+ * ------------------------
+ * Finds the program to run for a command name. Both hits and misses are
+ * remembered, and the whole table is dropped whenever $PATH changes. A
+ * $PATH with a relative entry is searched every time instead, since a cd
+ * would make its answers stale
+ *
+ * Parameters:
+ *   name - The command name (args[0])
+ *
+ * Returns:
+ *   The path to execute (owned by the table or the line arena, or name
+ *   itself when it contains a '/'), or NULL if the command does not exist
+ */
+const char* ResolveCommand(const char* name){
+    // Explicit paths are not searched or cached
+    if(strchr(name, '/')){
+        return name;
+    }
+
+    const char* path = GetVariable("PATH");
+    if(path == NULL){
+        path = "/usr/local/bin:/bin:/usr/bin";  // Same default as execvp()
+    }
+    if(pathHashPath == NULL || strcmp(pathHashPath, path) != 0){
+        ClearPathHash();
+        pathHashPath = strdup(path);
+        if(!pathHashPath){
+            perror("Memory allocation failed");
+            exit(EXIT_FAILURE);
+        }
+        pathHashRelative = 0;
+        for(const char* dir = path; dir; dir = strchr(dir, ':')){
+            if(*dir == ':'){
+                dir++;
+            }
+            if(*dir != '/'){
+                pathHashRelative = 1;
+                break;
+            }
+        }
+    }
+
+    // What an entry such as '' or '.' finds changes with the working directory
+    if(pathHashRelative){
+        char* found = SearchPath(name, path);
+        const char* result = found ? ArenaStrdup(&lineArena, found) : NULL;
+        free(found);
+        return result;
+    }
+
+    unsigned int bucket = HashPathName(name);
+    for(PathHashEntry* entry = pathHash[bucket]; entry; entry = entry->next){
+        if(strcmp(entry->name, name) == 0){
+            entry->hits++;
+            return entry->path;
+        }
+    }
+
+    PathHashEntry* entry = (PathHashEntry*)malloc(sizeof(PathHashEntry));
+    if(!entry){
+        perror("Memory allocation failed");
+        exit(EXIT_FAILURE);
+    }
+    entry->name = strdup(name);
+    if(!entry->name){
+        perror("Memory allocation failed");
+        exit(EXIT_FAILURE);
+    }
+    entry->path = SearchPath(name, path);
+    entry->hits = 1;
+    entry->next = pathHash[bucket];
+    pathHash[bucket] = entry;
+    return entry->path;
+}
+
+
+/*
+ * Function: ForgetCommand
+ * -----------------------
+ * Removes one command from the lookup table
+ *
+ * Parameters:
+ *   name - The command name
+ *
+ * Returns:
+ *   None
+ */
+void ForgetCommand(const char* name){
+    PathHashEntry** link = &pathHash[HashPathName(name)];
+    while(*link){
+        PathHashEntry* entry = *link;
+        if(strcmp(entry->name, name) == 0){
+            *link = entry->next;
+            free(entry->name);
+            free(entry->path);
+            free(entry);
+            return;
+        }
+        link = &entry->next;
+    }
+}
+
+
+/*
+ * Function: ClearPathHash
+ * -----------------------
+ * Empties the command lookup table
+ *
+ * Parameters:
+ *   None
+ *
+ * Returns:
+ *   None
+ */
+void ClearPathHash(){
+    for(int i = 0; i < PATH_HASH_SIZE; i++){
+        PathHashEntry* entry = pathHash[i];
+        while(entry){
+            PathHashEntry* next = entry->next;
+            free(entry->name);
+            free(entry->path);
+            free(entry);
+            entry = next;
+        }
+        pathHash[i] = NULL;
+    }
+    free(pathHashPath);
+    pathHashPath = NULL;
+}
+
+
+/*
+ * Function: HashBuiltin
+ * ---------------------
+ * Implements the 'hash' builtin:
+ *   hash            - list the remembered commands
+ *   hash -r         - forget everything
+ *   hash name...    - look the names up now and remember the result
+ *
+ * Parameters:
+ *   command - The parsed command, args[0] is the builtin's name
+ *
+ * Returns:
+ *   0 on success, 1 if a name was not found
+ */
+int HashBuiltin(ShellCommand* command){
+    char** args = command->args;
+    if(args[1] == NULL){
+        printf("hits\tcommand\n");
+        for(int i = 0; i < PATH_HASH_SIZE; i++){
+            for(PathHashEntry* entry = pathHash[i]; entry; entry = entry->next){
+                if(entry->path){
+                    printf("%4u\t%s\n", entry->hits, entry->path);
+                }
+                else{
+                    printf("%4u\t%s (not found)\n", entry->hits, entry->name);
+                }
+            }
+        }
+        return 0;
+    }
+
+    if(strcmp(args[1], "-r") == 0){
+        ClearPathHash();
+        return 0;
+    }
+
+    int status = 0;
+    for(int i = 1; args[i] != NULL; i++){
+        ForgetCommand(args[i]);
+        if(ResolveCommand(args[i]) == NULL){
+            fprintf(stderr, "hash: %s: not found\n", args[i]);
+            status = 1;
+        }
+    }
+    return status;
+}
+
+
+/*
+ * Function: ArenaAlloc
+ * --------------------
+ * Hands out memory from the arena by bumping a pointer. A new block is
+ * only requested from malloc when every block in the chain is full, so
+ * once the chain has grown to fit a typical line no more mallocs happen
+ *
+ * Parameters:
+ *   arena - The arena to allocate from
+ *   size  - Number of bytes needed
+ *
+ * Returns:
+ *   Pointer to the memory, aligned for any type. Never NULL
+ */
+void* ArenaAlloc(Arena* arena, size_t size){
+    size = (size + 15) & ~(size_t)15;  // Keep every allocation 16 byte aligned
+    arena->lineBytes += size;
+
+    // Move along the chain left over from earlier lines before growing it
+    while(arena->current && arena->current->used + size > arena->current->size){
+        if(arena->current->next == NULL){
+            break;
+        }
+        arena->current = arena->current->next;
+        arena->current->used = 0;
+    }
+
+    ArenaBlock* block = arena->current;
+    if(block == NULL || block->used + size > block->size){
+        size_t blockSize = size > ARENA_BLOCK_SIZE ? size : ARENA_BLOCK_SIZE;
+        block = (ArenaBlock*)malloc(sizeof(ArenaBlock) + blockSize);
+        if(!block){
+            perror("Memory allocation failed");
+            exit(EXIT_FAILURE);
+        }
+        block->next = NULL;
+        block->size = blockSize;
+        block->used = 0;
+        arena->mallocCalls++;
+        arena->lineMallocCalls++;
+
+        if(arena->current){
+            arena->current->next = block;
+        }
+        else{
+            arena->head = block;
+        }
+        arena->current = block;
+    }
+
+    void* ptr = block->data + block->used;
+    block->used += size;
+    return ptr;
+}
+
+
+/*
+ * Function: ArenaStrdup
+ * ---------------------
+ * Copies a string into the arena
+ *
+ * Parameters:
+ *   arena - The arena to allocate from
+ *   str   - The string to copy
+ *
+ * Returns:
+ *   The arena owned copy
+ */
+char* ArenaStrdup(Arena* arena, const char* str){
+    size_t len = strlen(str) + 1;
+    char* copy = (char*)ArenaAlloc(arena, len);
+    memcpy(copy, str, len);
+    return copy;
+}
+
+
+/*
+ * Function: ArenaReset
+ * --------------------
+ * Releases everything allocated from the arena at once. The blocks stay
+ * allocated so the next line reuses them
+ *
+ * Parameters:
+ *   arena - The arena to reset
+ *
+ * Returns:
+ *   None
+ */
+void ArenaReset(Arena* arena){
+    arena->current = arena->head;
+    if(arena->head){
+        arena->head->used = 0;
+    }
+    arena->lineMallocCalls = 0;
+    arena->lineBytes = 0;
+}
+
+
+/*
+ * Function: AllocStatBuiltin
+ * --------------------------
+ * Implements the 'allocstat' builtin, which reports how much the line
+ * arena has grown and how many mallocs the current line needed, plus
+ * the size of the variable table and how often the environment for
+ * new processes had to be rebuilt
+ *
+ * Parameters:
+ *   command - The parsed command, arguments are ignored
+ *
+ * Returns:
+ *   0
+ */
+int AllocStatBuiltin(ShellCommand* command){
+    (void)command;
+    unsigned long blocks = 0;
+    size_t reserved = 0;
+    for(ArenaBlock* block = lineArena.head; block; block = block->next){
+        blocks++;
+        reserved += block->size;
+    }
+
+    printf("arena blocks:       %lu (%zu bytes)\n", blocks, reserved);
+    printf("bytes this line:    %zu\n", lineArena.lineBytes);
+    printf("mallocs this line:  %lu\n", lineArena.lineMallocCalls);
+    printf("mallocs total:      %lu\n", lineArena.mallocCalls);
+    printf("variables:          %zu (%zu slots)\n", variables.count, variables.capacity);
+    printf("environ rebuilds:   %lu\n", environmentRebuilds);
+    return 0;
+}
+
+
+/*
+ * Function: InitJobControl
+ * ------------------------
+ * Blocks SIGCHLD and opens a signalfd for it, so finished children are
+ * noticed from the input loop instead of a signal handler. An
+ * interactive shell also takes its own process group and the terminal,
+ * and ignores the keyboard signals meant for foreground jobs
+ *
+ * Parameters:
+ *   None
+ *
+ * Returns:
+ *   None
+ */
+void InitJobControl(){
+    sigset_t mask;
+    sigemptyset(&mask);
+    sigaddset(&mask, SIGCHLD);
+    sigprocmask(SIG_BLOCK, &mask, NULL);
+    childSignalFd = signalfd(-1, &mask, SFD_NONBLOCK | SFD_CLOEXEC);
+    if(childSignalFd == -1){
+        perror("signalfd failed");
+    }
+
+    if(!interactive){
+        return;
+    }
+
+    // Wait until we are in the foreground before touching the terminal
+    while(tcgetpgrp(STDIN_FILENO) != getpgrp()){
+        kill(-getpgrp(), SIGTTIN);
+    }
+
+    signal(SIGINT, SIG_IGN);
+    signal(SIGQUIT, SIG_IGN);
+    signal(SIGTSTP, SIG_IGN);
+    signal(SIGTTIN, SIG_IGN);
+    signal(SIGTTOU, SIG_IGN);
+
+    shellPgid = getpid();
+    if(getpgrp() != shellPgid && setpgid(0, shellPgid) == -1){
+        perror("setpgid failed");
+        return;
+    }
+    tcsetpgrp(STDIN_FILENO, shellPgid);
+    tcgetattr(STDIN_FILENO, &shellTermios);
+    jobControl = 1;
+}
+
+
+/*
+ * Function: CreateJob
+ * -------------------
+ * Adds a job for a pipeline to the job table. A foreground job usually
+ * finishes before the line does, so it is carved out of lineArena and
+ * only copied to the heap by KeepJob if it stops. Background jobs
+ * outlive the line and get one malloc
+ *
+ * Parameters:
+ *   first - The first stage of the pipeline
+ *   count - Number of stages
+ *
+ * Returns:
+ *   The new job, its pids all -1 until the stages are started
+ */
+Job* CreateJob(ShellCommand* first, int count){
+    // Size the command text rebuilt from the parsed stages
+    size_t length = 1;
+    for(ShellCommand* stage = first; stage; stage = stage->next){
+        for(int i = 0; stage->args[i]; i++){
+            length += strlen(stage->args[i]) + 1;
+        }
+        for(Redirect* redirect = stage->redirects; redirect; redirect = redirect->next){
+            length += FormatRedirect(NULL, 0, redirect);
+        }
+        length += 2;
+    }
+
+    size_t size = sizeof(Job) + count * (sizeof(pid_t) + sizeof(int)) + length;
+    Job* job;
+    if(first->background){
+        job = (Job*)malloc(size);
+        if(!job){
+            perror("Memory allocation failed");
+            exit(EXIT_FAILURE);
+        }
+    }
+    else{
+        job = (Job*)ArenaAlloc(&lineArena, size);
+    }
+    job->heap = first->background;
+    job->pids = (pid_t*)(job + 1);
+    job->statuses = (int*)(job->pids + count);
+    job->text = (char*)(job->statuses + count);
+
+    for(int i = 0; i < count; i++){
+        job->pids[i] = -1;
+        job->statuses[i] = 1;
+    }
+    job->count = count;
+    job->remaining = 0;
+    job->pgid = -1;
+    job->state = JOB_RUNNING;
+    clock_gettime(CLOCK_MONOTONIC, &job->started);
+    memset(&job->usage, 0, sizeof(job->usage));
+
+    char* out = job->text;
+    for(ShellCommand* stage = first; stage; stage = stage->next){
+        for(int i = 0; stage->args[i]; i++){
+            out += sprintf(out, i ? " %s" : "%s", stage->args[i]);
+        }
+        for(Redirect* redirect = stage->redirects; redirect; redirect = redirect->next){
+            out += FormatRedirect(out, job->text + length - out, redirect);
+        }
+        if(stage->next){
+            out += sprintf(out, " |");
+        }
+        *out++ = ' ';
+    }
+    out[-1] = '\0';
+
+    // New jobs are numbered one past the highest number in use
+    job->id = jobCount > 0 ? jobs[jobCount - 1]->id + 1 : 1;
+
+    if(jobCount == jobCapacity){
+        jobCapacity = jobCapacity ? jobCapacity * 2 : 16;
+        jobs = (Job**)realloc(jobs, jobCapacity * sizeof(Job*));
+        if(!jobs){
+            perror("Memory reallocation failed");
+            exit(EXIT_FAILURE);
+        }
+    }
+    jobs[jobCount++] = job;
+    return job;
+}
+
+
+/*
+ * Function: KeepJob
+ * -----------------
+ * Moves a job out of lineArena onto the heap, for a foreground job that
+ * has to outlive its line because it stopped
+ *
+ * Parameters:
+ *   job - The job, which must not be used afterwards
+ *
+ * Returns:
+ *   The job's heap copy, already in its place in the job table
+ */
+Job* KeepJob(Job* job){
+    if(job->heap){
+        return job;
+    }
+
+    size_t length = strlen(job->text) + 1;
+    size_t size = sizeof(Job) + job->count * (sizeof(pid_t) + sizeof(int)) + length;
+    Job* kept = (Job*)malloc(size);
+    if(!kept){
+        perror("Memory allocation failed");
+        exit(EXIT_FAILURE);
+    }
+    *kept = *job;
+    kept->heap = 1;
+    kept->pids = (pid_t*)(kept + 1);
+    kept->statuses = (int*)(kept->pids + kept->count);
+    kept->text = (char*)(kept->statuses + kept->count);
+    memcpy(kept->pids, job->pids, job->count * sizeof(pid_t));
+    memcpy(kept->statuses, job->statuses, job->count * sizeof(int));
+    memcpy(kept->text, job->text, length);
+
+    for(int i = 0; i < jobCount; i++){
+        if(jobs[i] == job){
+            jobs[i] = kept;
+            break;
+        }
+    }
+    return kept;
+}
+
+
+/*
+ * Function: RemoveJob
+ * -------------------
+ * Drops a job from the job table, freeing it unless it lives in lineArena
+ *
+ * Parameters:
+ *   job - The job to remove
+ *
+ * Returns:
+ *   None
+ */
+void RemoveJob(Job* job){
+    for(int i = 0; i < jobCount; i++){
+        if(jobs[i] == job){
+            memmove(&jobs[i], &jobs[i + 1], (jobCount - i - 1) * sizeof(Job*));
+            jobCount--;
+            break;
+        }
+    }
+    if(job->heap){
+        free(job);
+    }
+}
+
+
+/*
+ * Function: JobStatus
+ * -------------------
+ * Works out a finished job's exit status
+ *
+ * Parameters:
+ *   job - The job
+ *
+ * Returns:
+ *   The last stage's status, or with pipefail the last failing stage's
+ */
+int JobStatus(Job* job){
+    if(pipefail){
+        for(int i = job->count - 1; i >= 0; i--){
+            if(job->statuses[i] != 0){
+                return job->statuses[i];
+            }
+        }
+    }
+    return job->statuses[job->count - 1];
+}
+
+
+/*
+ * Function: MarkChild
+ * -------------------
+ * Records a wait4() result against the job that owns the pid, adding
+ * the child's resource usage to the job's once it has exited
+ *
+ * Parameters:
+ *   pid    - The child that changed state
+ *   status - The raw status from wait4()
+ *   usage  - The child's resource usage from wait4()
+ *
+ * Returns:
+ *   None
+ */
+void MarkChild(pid_t pid, int status, struct rusage* usage){
+    for(int j = jobCount - 1; j >= 0; j--){
+        Job* job = jobs[j];
+        for(int i = 0; i < job->count; i++){
+            if(job->pids[i] != pid){
+                continue;
+            }
+            if(WIFSTOPPED(status)){
+                job->state = JOB_STOPPED;
+            }
+            else if(WIFCONTINUED(status)){
+                job->state = JOB_RUNNING;
+            }
+            else{
+                job->statuses[i] = StatusFromWait(status);
+                job->pids[i] = -1;
+
+                job->usage.user += usage->ru_utime.tv_sec + usage->ru_utime.tv_usec / 1e6;
+                job->usage.sys += usage->ru_stime.tv_sec + usage->ru_stime.tv_usec / 1e6;
+                if(usage->ru_maxrss > job->usage.maxRss){
+                    job->usage.maxRss = usage->ru_maxrss;
+                }
+                job->usage.voluntarySwitches += usage->ru_nvcsw;
+                job->usage.involuntarySwitches += usage->ru_nivcsw;
+
+                if(--job->remaining == 0){
+                    job->state = JOB_DONE;
+                    job->usage.wall = ElapsedSince(&job->started);
+                }
+            }
+            return;
+        }
+    }
+}
+
+
+/*
+ * Function: WaitForJob
+ * --------------------
+ * Waits until a job finishes, or stops if it has the terminal. A
+ * foreground job is given the terminal for as long as it runs
+ *
+ * Parameters:
+ *   job        - The job to wait for
+ *   foreground - Hand the terminal to the job while waiting
+ *
+ * Returns:
+ *   The job's exit status, or 128 + SIGTSTP if it was stopped. A
+ *   finished job is removed from the table
+ */
+int WaitForJob(Job* job, int foreground){
+    uint64_t traceStart = TraceBegin();
+    foreground = foreground && jobControl && job->pgid != -1;
+    if(foreground){
+        tcsetpgrp(STDIN_FILENO, job->pgid);
+    }
+
+    while(job->state == JOB_RUNNING && job->remaining > 0){
+        int status;
+        struct rusage usage;
+        pid_t pid;
+        if(job->pgid != -1){
+            pid = wait4(-job->pgid, &status, WUNTRACED, &usage);
+        }
+        else{
+            // Without process groups wait for the stages one by one
+            int i = 0;
+            while(job->pids[i] == -1){
+                i++;
+            }
+            pid = wait4(job->pids[i], &status, 0, &usage);
+        }
+        if(pid == -1){
+            if(errno == EINTR){
+                continue;
+            }
+            if(errno != ECHILD){
+                perror("wait4 failed");
+            }
+            break;  // Somebody else reaped them, nothing left to wait for
+        }
+        MarkChild(pid, status, &usage);
+    }
+
+    if(foreground){
+        tcsetpgrp(STDIN_FILENO, shellPgid);
+        tcsetattr(STDIN_FILENO, TCSADRAIN, &shellTermios);
+    }
+
+    if(job->state == JOB_STOPPED){
+        job = KeepJob(job);  // It stays in the table after the line is gone
+        printf("\n[%d]+  Stopped                 %s\n", job->id, job->text);
+        return 128 + SIGTSTP;
+    }
+
+    TraceEnd("wait", traceStart, job->text);
+    lastUsage = job->usage;
+    int status = JobStatus(job);
+    if(foreground && status == 128 + SIGINT){
+        printf("\n");  // Ctrl+C left the cursor after ^C
+    }
+    RemoveJob(job);
+    return status;
+}
+
+
+/*
+ * Function: ReapChildren
+ * ----------------------
+ * Collects every child that has changed state without blocking, so
+ * background jobs never linger as zombies
+ *
+ * Parameters:
+ *   None
+ *
+ * Returns:
+ *   None
+ */
+void ReapChildren(){
+    // Drain the signalfd, the waitpid loop below does the real work
+    if(childSignalFd != -1){
+        struct signalfd_siginfo info[16];
+        while(read(childSignalFd, info, sizeof(info)) > 0){
+        }
+    }
+
+    int status;
+    struct rusage usage;
+    pid_t pid;
+    while((pid = wait4(-1, &status, WNOHANG | WUNTRACED | WCONTINUED, &usage)) > 0){
+        MarkChild(pid, status, &usage);
+    }
+}
+
+
+/*
+ * Function: NotifyJobs
+ * --------------------
+ * Reports background jobs that have finished since the last prompt and
+ * removes them from the job table. Scripts drop them silently
+ *
+ * Parameters:
+ *   None
+ *
+ * Returns:
+ *   None
+ */
+void NotifyJobs(){
+    for(int i = 0; i < jobCount; i++){
+        Job* job = jobs[i];
+        if(job->state != JOB_DONE){
+            continue;
+        }
+        if(interactive){
+            int status = JobStatus(job);
+            if(status == 0){
+                printf("[%d]+  Done                    %s\n", job->id, job->text);
+            }
+            else{
+                printf("[%d]+  Exit %-3d                %s\n", job->id, status, job->text);
+            }
+        }
+        RemoveJob(job);
+        i--;
+    }
+    fflush(stdout);
+}
+
+
+/*
+ * Function: WaitForInput
+ * ----------------------
+ * The shell's event loop while it is idle: waits for input on fd, reaps
+ * children whenever the signalfd reports SIGCHLD and applies changes to
+ * the $PATH directories reported by inotify in the meantime
+ *
+ * Parameters:
+ *   fd - The descriptor input is expected on
+ *
+ * Returns:
+ *   None, once fd is readable (or has hit end of file or an error)
+ */
+void WaitForInput(int fd){
+    if(childSignalFd == -1 && commandTrie.watchFd == -1){
+        return;
+    }
+
+    struct pollfd fds[3];
+    fds[0].fd = fd;
+    fds[0].events = POLLIN;
+    fds[1].fd = childSignalFd;
+    fds[1].events = POLLIN;
+    fds[2].fd = commandTrie.watchFd;  // poll() skips negative descriptors
+    fds[2].events = POLLIN;
+
+    for(;;){
+        if(poll(fds, 3, -1) == -1){
+            if(errno == EINTR){
+                continue;
+            }
+            return;  // Let read() report whatever is wrong
+        }
+        if(fds[1].revents){
+            ReapChildren();
+        }
+        if(fds[2].revents){
+            ApplyPathChanges();
+        }
+        if(fds[0].revents){
+            return;
+        }
+    }
+}
+
+
+/*
+ * Function: FindJob
+ * -----------------
+ * Looks up a job from a %n (or plain n) spec, or the most recent job
+ *
+ * Parameters:
+ *   spec    - The job spec, or NULL for the most recent job
+ *   builtin - Name of the builtin, used in error messages
+ *
+ * Returns:
+ *   The job, or NULL if there is none (an error is printed)
+ */
+Job* FindJob(const char* spec, const char* builtin){
+    if(spec == NULL){
+        for(int i = jobCount - 1; i >= 0; i--){
+            if(jobs[i]->state != JOB_DONE){
+                return jobs[i];
+            }
+        }
+        fprintf(stderr, "%s: no current job\n", builtin);
+        return NULL;
+    }
+
+    int id = atoi(spec[0] == '%' ? spec + 1 : spec);
+    for(int i = 0; i < jobCount; i++){
+        if(jobs[i]->id == id){
+            return jobs[i];
+        }
+    }
+    fprintf(stderr, "%s: %s: no such job\n", builtin, spec);
+    return NULL;
+}
+
+
+/*
+ * Function: JobsBuiltin
+ * ---------------------
+ * Implements the 'jobs' builtin, listing the job table
+ *
+ * Parameters:
+ *   command - The parsed command, arguments are ignored
+ *
+ * Returns:
+ *   0
+ */
+int JobsBuiltin(ShellCommand* command){
+    (void)command;
+    ReapChildren();
+    for(int i = 0; i < jobCount; i++){
+        Job* job = jobs[i];
+        const char* state = job->state == JOB_RUNNING ? "Running" : job->state == JOB_STOPPED ? "Stopped" : "Done";
+        printf("[%d]%c  %-24s%s\n", job->id, i == jobCount - 1 ? '+' : ' ', state, job->text);
+    }
+    NotifyJobs();  // Done jobs have now been reported
+    return 0;
+}
+
+
+/*
+ * Function: FgBuiltin
+ * -------------------
+ * Implements 'fg [%n]': continues a job in the foreground and waits for it
+ *
+ * Parameters:
+ *   command - The parsed command, args[0] is the builtin's name
+ *
+ * Returns:
+ *   The job's exit status, 1 if there is no such job
+ */
+int FgBuiltin(ShellCommand* command){
+    char** args = command->args;
+    Job* job = FindJob(args[1], "fg");
+    if(job == NULL){
+        return 1;
+    }
+
+    printf("%s\n", job->text);
+    fflush(stdout);
+    if(job->state == JOB_STOPPED){
+        job->state = JOB_RUNNING;
+        if(job->pgid != -1){
+            kill(-job->pgid, SIGCONT);
+        }
+    }
+    return WaitForJob(job, 1);
+}
+
+
+/*
+ * Function: BgBuiltin
+ * -------------------
+ * Implements 'bg [%n]': lets a stopped job carry on in the background
+ *
+ * Parameters:
+ *   command - The parsed command, args[0] is the builtin's name
+ *
+ * Returns:
+ *   0 on success, 1 if there is no such job
+ */
+int BgBuiltin(ShellCommand* command){
+    char** args = command->args;
+    Job* job = FindJob(args[1], "bg");
+    if(job == NULL){
+        return 1;
+    }
+
+    if(job->state == JOB_STOPPED){
+        job->state = JOB_RUNNING;
+        if(job->pgid != -1){
+            kill(-job->pgid, SIGCONT);
+        }
+        else{
+            for(int i = 0; i < job->count; i++){
+                if(job->pids[i] != -1){
+                    kill(job->pids[i], SIGCONT);
+                }
+            }
+        }
+    }
+    printf("[%d]+ %s &\n", job->id, job->text);
+    return 0;
+}
+
+
+/*
+ * Function: WaitBuiltin
+ * ---------------------
+ * Implements 'wait [%n...]': waits for the given jobs, or all of them
+ *
+ * Parameters:
+ *   command - The parsed command, args[0] is the builtin's name
+ *
+ * Returns:
+ *   The status of the last job waited for, 127 if a job does not exist
+ */
+int WaitBuiltin(ShellCommand* command){
+    char** args = command->args;
+    int status = 0;
+
+    if(args[1] == NULL){
+        // Stopped jobs would never finish, so only running ones are waited for
+        for(int i = 0; i < jobCount; i++){
+            if(jobs[i]->state == JOB_STOPPED){
+                continue;
+            }
+            status = WaitForJob(jobs[i], 0);
+            i = -1;  // The table changed, start over
+        }
+        return status;
+    }
+
+    for(int i = 1; args[i] != NULL; i++){
+        Job* job = FindJob(args[i], "wait");
+        if(job == NULL){
+            status = 127;
+            continue;
+        }
+        status = WaitForJob(job, 0);
+    }
+    return status;
+}
+
+
+/*
+ * Function: ParallelTask
+ * ----------------------
+ * Builds the command 'parallel' runs for one input: every "{}" in the
+ * template is replaced by the input, or the input is appended as the
+ * last argument when the template has no "{}"
+ *
+ * Parameters:
+ *   template - The command and arguments given before ':::'
+ *   input    - The input for this task
+ *   arena    - Arena the command is built in
+ *
+ * Returns:
+ *   The task's command
+ */
+ShellCommand* ParallelTask(char** template, const char* input, Arena* arena){
+    int count = 0;
+    int placeholders = 0;
+    for(; template[count]; count++){
+        if(strstr(template[count], "{}")){
+            placeholders = 1;
+        }
+    }
+
+    ShellCommand* task = (ShellCommand*)ArenaAlloc(arena, sizeof(ShellCommand));
+    memset(task, 0, sizeof(ShellCommand));
+    task->args = (char**)ArenaAlloc(arena, (count + 2) * sizeof(char*));
+
+    size_t inputLength = strlen(input);
+    for(int i = 0; i < count; i++){
+        const char* arg = template[i];
+        if(strstr(arg, "{}") == NULL){
+            task->args[i] = template[i];
+            continue;
+        }
+
+        // Make room for every placeholder being replaced
+        size_t length = strlen(arg) + 1;
+        for(const char* p = strstr(arg, "{}"); p; p = strstr(p + 2, "{}")){
+            length += inputLength;
+        }
+        char* out = (char*)ArenaAlloc(arena, length);
+        task->args[i] = out;
+        for(const char* p; (p = strstr(arg, "{}")); arg = p + 2){
+            memcpy(out, arg, p - arg);
+            out += p - arg;
+            memcpy(out, input, inputLength);
+            out += inputLength;
+        }
+        strcpy(out, arg);
+    }
+
+    if(!placeholders){
+        task->args[count++] = ArenaStrdup(arena, input);
+    }
+    task->args[count] = NULL;
+    return task;
+}
+
+
+/*
+ * Function: ParallelBuiltin
+ * -------------------------
+ * Implements 'parallel', which runs many commands with a bounded number
+ * in flight at once and reports each one as it finishes:
+ *   parallel [-j N] [-q] cmd args... ::: input...   - cmd once per input
+ *   parallel [-j N] [-q] < commands                 - one command line per line
+ * The default limit is the number of online CPUs. Tasks read /dev/null
+ * unless they redirect their input, and they stay in the shell's process
+ * group so Ctrl+C reaches all of them
+ *
+ * Parameters:
+ *   command - The parsed command, args[0] is the builtin's name
+ *
+ * Returns:
+ *   0 if every task succeeded, otherwise the number of failed tasks (at
+ *   most 101), or 130 if interrupted
+ */
+int ParallelBuiltin(ShellCommand* command){
+    char** args = command->args;
+    Arena* arena = &lineArena;  // Task commands only need to live as long as the line
+    long limit = sysconf(_SC_NPROCESSORS_ONLN);
+    int quiet = 0;
+    int i = 1;
+
+    for(; args[i] && args[i][0] == '-'; i++){
+        if(strcmp(args[i], "-j") == 0 && args[i + 1]){
+            limit = atol(args[++i]);
+        }
+        else if(strncmp(args[i], "-j", 2) == 0 && args[i][2] != '\0'){
+            limit = atol(args[i] + 2);
+        }
+        else if(strcmp(args[i], "-q") == 0){
+            quiet = 1;
+        }
+        else if(strcmp(args[i], "--") == 0){
+            i++;
+            break;
+        }
+        else{
+            fprintf(stderr, "parallel: usage: parallel [-j N] [-q] [cmd args... ::: input...]\n");
+            return 2;
+        }
+    }
+    if(limit < 1){
+        limit = 1;
+    }
+
+    // Collect the tasks up front so progress can be shown as done/total
+    char** template = &args[i];
+    int separator = -1;
+    for(int j = i; args[j]; j++){
+        if(strcmp(args[j], ":::") == 0){
+            separator = j;
+            break;
+        }
+    }
+
+    int total = 0;
+    int capacity = INITIAL_ARG_SIZE;
+    ShellCommand** tasks = (ShellCommand**)ArenaAlloc(arena, capacity * sizeof(ShellCommand*));
+
+    if(separator != -1){
+        if(separator == i){
+            fprintf(stderr, "parallel: missing command before ':::'\n");
+            return 2;
+        }
+        args[separator] = NULL;  // Ends the template
+        for(int j = separator + 1; args[j]; j++){
+            if(total == capacity){
+                capacity *= 2;
+                ShellCommand** grown = (ShellCommand**)ArenaAlloc(arena, capacity * sizeof(ShellCommand*));
+                memcpy(grown, tasks, total * sizeof(ShellCommand*));
+                tasks = grown;
+            }
+            tasks[total++] = ParallelTask(template, args[j], arena);
+        }
+    }
+    else if(args[i] == NULL){
+        // One full command line per line of stdin. A redirection has already
+        // been put on fd 0, otherwise the shell's own input may hold lines
+        // that were read ahead of this one, and those come first
+        LineReader reader = { STDIN_FILENO, NULL, 0, 0, NULL, 0, 0 };
+        if(!RedirectsFd(command, STDIN_FILENO) && !pipedStdin && inputReader.fd == STDIN_FILENO && inputReader.buffer){
+            reader.buffer = (char*)malloc(READ_BUFFER_SIZE);
+            if(!reader.buffer){
+                perror("Memory allocation failed");
+                exit(EXIT_FAILURE);
+            }
+            reader.end = inputReader.end - inputReader.start;
+            memcpy(reader.buffer, inputReader.buffer + inputReader.start, reader.end);
+            reader.eof = inputReader.eof;
+            inputReader.start = inputReader.end;
+        }
+        char* line;
+        while((line = ReadLine(&reader, NULL)) != NULL){
+            ShellCommand* task = (ShellCommand*)ArenaAlloc(arena, sizeof(ShellCommand));
+            *task = ParseCommandLine(ArenaStrdup(arena, line), arena);
+            if(task->args[0] == NULL && !task->syntaxError){
+                continue;  // Blank line or comment
+            }
+            if(total == capacity){
+                capacity *= 2;
+                ShellCommand** grown = (ShellCommand**)ArenaAlloc(arena, capacity * sizeof(ShellCommand*));
+                memcpy(grown, tasks, total * sizeof(ShellCommand*));
+                tasks = grown;
+            }
+            tasks[total++] = task;
+        }
+        free(reader.buffer);
+        free(reader.line);
+    }
+    else{
+        fprintf(stderr, "parallel: expected ':::' followed by inputs\n");
+        return 2;
+    }
+
+    Job** running = (Job**)ArenaAlloc(arena, limit * sizeof(Job*));
+    int runningCount = 0;
+    int next = 0;
+    int finished = 0;
+    int failed = 0;
+    int interrupted = 0;
+
+    while(finished < total){
+        // Keep every slot busy
+        while(runningCount < limit && next < total && !interrupted){
+            ShellCommand* task = tasks[next++];
+            if(task->syntaxError){
+                finished++;
+                failed++;
+                if(!quiet){
+                    fprintf(stderr, "parallel: [%d/%d] exit 2: syntax error\n", finished, total);
+                }
+                continue;
+            }
+            running[runningCount++] = StartPipeline(task, -1, 1);
+        }
+        if(runningCount == 0){
+            if(next >= total || interrupted){
+                break;
+            }
+            continue;
+        }
+
+        // Report whatever has finished, then wait for the next child
+        int reported = 0;
+        for(int j = 0; j < runningCount; j++){
+            Job* job = running[j];
+            if(job->state != JOB_DONE){
+                continue;
+            }
+            int status = JobStatus(job);
+            finished++;
+            if(status != 0){
+                failed++;
+            }
+            if(status == 128 + SIGINT){
+                interrupted = 1;
+            }
+            if(!quiet){
+                fprintf(stderr, "parallel: [%d/%d] exit %d in %.3fs: %s\n", finished, total, status, job->usage.wall, job->text);
+            }
+            RemoveJob(job);
+            running[j--] = running[--runningCount];
+            reported = 1;
+        }
+        if(reported){
+            continue;
+        }
+
+        int status;
+        struct rusage usage;
+        pid_t pid = wait4(-1, &status, 0, &usage);
+        if(pid == -1){
+            if(errno == EINTR){
+                continue;
+            }
+            perror("wait4 failed");
+            break;
+        }
+        MarkChild(pid, status, &usage);  // Also keeps background jobs up to date
+    }
+
+    // Tasks still running after wait4() failed stay in the job table
+    for(int j = 0; j < runningCount; j++){
+        KeepJob(running[j]);
+    }
+
+    if(interrupted){
+        return 128 + SIGINT;
+    }
+    return failed > 101 ? 101 : failed;
+}
+
+
+/*
+ * Function: CompareDoubles
+ * ------------------------
+ * qsort() comparison for ascending doubles
+ *
+ * Parameters:
+ *   a, b - Pointers to the two doubles
+ *
+ * Returns:
+ *   Negative, zero or positive like strcmp()
+ */
+int CompareDoubles(const void* a, const void* b){
+    double x = *(const double*)a;
+    double y = *(const double*)b;
+    return (x > y) - (x < y);
+}
+
+
+/*
+ * Function: Percentile
+ * --------------------
+ * Reads a percentile from sorted samples, interpolating between the two
+ * nearest ranks
+ *
+ * Parameters:
+ *   sorted  - Samples in ascending order
+ *   count   - Number of samples, at least 1
+ *   percent - The percentile wanted, 0 to 100
+ *
+ * Returns:
+ *   The percentile value
+ */
+double Percentile(double* sorted, int count, double percent){
+    double rank = percent / 100.0 * (count - 1);
+    int lower = (int)rank;
+    if(lower >= count - 1){
+        return sorted[count - 1];
+    }
+    return sorted[lower] + (rank - lower) * (sorted[lower + 1] - sorted[lower]);
+}
+
+
+/*
+ * Function: PrintBenchRow
+ * -----------------------
+ * Prints one row of 'bench' statistics. Sorts the samples in place
+ *
+ * Parameters:
+ *   name    - Row label
+ *   samples - Seconds per run
+ *   count   - Number of runs, at least 1
+ *
+ * Returns:
+ *   The mean
+ */
+double PrintBenchRow(const char* name, double* samples, int count){
+    double sum = 0;
+    for(int i = 0; i < count; i++){
+        sum += samples[i];
+    }
+    double mean = sum / count;
+
+    double squares = 0;
+    for(int i = 0; i < count; i++){
+        squares += (samples[i] - mean) * (samples[i] - mean);
+    }
+    double stddev = count > 1 ? sqrt(squares / (count - 1)) : 0;
+
+    qsort(samples, count, sizeof(double), CompareDoubles);
+    printf("  %-5s %10.6f %10.6f %10.6f %10.6f %10.6f %10.6f %10.6f\n", name, mean, stddev,
+           samples[0], samples[count - 1], Percentile(samples, count, 50),
+           Percentile(samples, count, 95), Percentile(samples, count, 99));
+    return mean;
+}
+
+
+/*
+ * Function: BenchOne
+ * ------------------
+ * Times one command for 'bench': warmup runs first, then measured runs
+ * through the normal pipeline launch path, then the statistics
+ *
+ * Parameters:
+ *   command - The command to run, with bench's redirections
+ *   index   - Benchmark number shown in the header
+ *   runs    - Measured runs
+ *   warmup  - Unmeasured runs before them
+ *   arena   - Arena for the samples
+ *   mean    - Receives the mean wall time
+ *
+ * Returns:
+ *   Number of failed runs, or -1 if interrupted
+ */
+int BenchOne(ShellCommand* command, int index, int runs, int warmup, Arena* arena, double* mean){
+    double* wall = (double*)ArenaAlloc(arena, runs * sizeof(double));
+    double* cpu = (double*)ArenaAlloc(arena, runs * sizeof(double));
+    int failures = 0;
+
+    printf("Benchmark %d: ", index);
+    for(int i = 0; command->args[i]; i++){
+        printf(i ? " %s" : "%s", command->args[i]);
+    }
+    printf("\n");
+
+    for(int i = 0; i < warmup + runs; i++){
+        Job* job = StartPipeline(command, jobControl ? 0 : -1, 0);
+        int status = WaitForJob(job, 1);
+        if(status == 128 + SIGINT || status == 128 + SIGTSTP){
+            return -1;
+        }
+        if(i < warmup){
+            continue;
+        }
+        if(status != 0){
+            failures++;
+        }
+        wall[i - warmup] = lastUsage.wall;
+        cpu[i - warmup] = lastUsage.user + lastUsage.sys;
+    }
+
+    printf("  runs: %d (+%d warmup), failures: %d\n", runs, warmup, failures);
+    printf("  %-5s %10s %10s %10s %10s %10s %10s %10s\n", "sec", "mean", "stddev", "min", "max", "p50", "p95", "p99");
+    *mean = PrintBenchRow("wall", wall, runs);
+    PrintBenchRow("cpu", cpu, runs);
+    return failures;
+}
+
+
+/*
+ * Function: BenchBuiltin
+ * ----------------------
+ * Implements 'bench [-n N] [-w W] cmd args... [--vs cmd2 args...]',
+ * which runs a command N times (default 10) after W warmup runs (default
+ * 1) and reports mean, stddev, min, max and p50/p95/p99 of wall and CPU
+ * time. With --vs a second command is measured the same way and the two
+ * are compared. Redirections on the bench line apply to every run, and
+ * stdout goes to /dev/null unless it is redirected
+ *
+ * Parameters:
+ *   command - The parsed bench command
+ *
+ * Returns:
+ *   0 if every run succeeded, 1 otherwise, 130 if interrupted
+ */
+int BenchBuiltin(ShellCommand* command){
+    char** args = command->args;
+    Arena* arena = &lineArena;  // The samples only need to live as long as the line
+    int runs = 10;
+    int warmup = 1;
+    int i = 1;
+
+    for(; args[i] && args[i][0] == '-'; i++){
+        if(strcmp(args[i], "-n") == 0 && args[i + 1]){
+            runs = atoi(args[++i]);
+        }
+        else if(strcmp(args[i], "-w") == 0 && args[i + 1]){
+            warmup = atoi(args[++i]);
+        }
+        else{
+            break;
+        }
+    }
+    if(args[i] == NULL || runs < 1 || warmup < 0 || strcmp(args[i], "--vs") == 0){
+        fprintf(stderr, "bench: usage: bench [-n N] [-w W] cmd args... [--vs cmd args...]\n");
+        return 2;
+    }
+
+    // Split off the command to compare against
+    ShellCommand benched[2];
+    int count = 1;
+    benched[0] = *command;
+    benched[0].args = &args[i];
+    benched[0].next = NULL;
+    benched[0].background = 0;
+    Redirect discard = { REDIRECT_WRITE, STDOUT_FILENO, -1, "/dev/null", 0, NULL, 0, command->redirects };
+    if(!RedirectsFd(command, STDOUT_FILENO)){
+        benched[0].redirects = &discard;
+    }
+    for(int j = i; args[j]; j++){
+        if(strcmp(args[j], "--vs") == 0){
+            args[j] = NULL;
+            if(args[j + 1] == NULL){
+                fprintf(stderr, "bench: missing command after --vs\n");
+                return 2;
+            }
+            benched[1] = benched[0];
+            benched[1].args = &args[j + 1];
+            count = 2;
+            break;
+        }
+    }
+
+    double means[2];
+    int failed = 0;
+    for(int j = 0; j < count; j++){
+        int failures = BenchOne(&benched[j], j + 1, runs, warmup, arena, &means[j]);
+        if(failures < 0){
+            return 128 + SIGINT;
+        }
+        failed += failures;
+    }
+
+    if(count == 2){
+        int faster = means[0] <= means[1] ? 0 : 1;
+        double ratio = means[faster] > 0 ? means[1 - faster] / means[faster] : 0;
+        printf("Summary: benchmark %d (%s) ran %.2fx faster than benchmark %d (%s), by mean wall time\n",
+               faster + 1, benched[faster].args[0], ratio, 2 - faster, benched[1 - faster].args[0]);
+    }
+    return failed > 0;
+}
+
+
+/*
+ * Function: Sha256Block
+ * ---------------------
+ * Runs the SHA-256 compression function over one 64 byte block
+ *
+ * Parameters:
+ *   sha   - The hash state
+ *   block - 64 bytes of input
+ *
+ * Returns:
+ *   None
+ */
+void Sha256Block(Sha256* sha, const unsigned char* block){
+    static const uint32_t k[64] = {
+        0x428a2f98, 0x71374491, 0xb5c0fbcf, 0xe9b5dba5, 0x3956c25b, 0x59f111f1, 0x923f82a4, 0xab1c5ed5,
+        0xd807aa98, 0x12835b01, 0x243185be, 0x550c7dc3, 0x72be5d74, 0x80deb1fe, 0x9bdc06a7, 0xc19bf174,
+        0xe49b69c1, 0xefbe4786, 0x0fc19dc6, 0x240ca1cc, 0x2de92c6f, 0x4a7484aa, 0x5cb0a9dc, 0x76f988da,
+        0x983e5152, 0xa831c66d, 0xb00327c8, 0xbf597fc7, 0xc6e00bf3, 0xd5a79147, 0x06ca6351, 0x14292967,
+        0x27b70a85, 0x2e1b2138, 0x4d2c6dfc, 0x53380d13, 0x650a7354, 0x766a0abb, 0x81c2c92e, 0x92722c85,
+        0xa2bfe8a1, 0xa81a664b, 0xc24b8b70, 0xc76c51a3, 0xd192e819, 0xd6990624, 0xf40e3585, 0x106aa070,
+        0x19a4c116, 0x1e376c08, 0x2748774c, 0x34b0bcb5, 0x391c0cb3, 0x4ed8aa4a, 0x5b9cca4f, 0x682e6ff3,
+        0x748f82ee, 0x78a5636f, 0x84c87814, 0x8cc70208, 0x90befffa, 0xa4506ceb, 0xbef9a3f7, 0xc67178f2
+    };
+    uint32_t w[64];
+    for(int i = 0; i < 16; i++){
+        w[i] = (uint32_t)block[i * 4] << 24 | (uint32_t)block[i * 4 + 1] << 16 | (uint32_t)block[i * 4 + 2] << 8 | block[i * 4 + 3];
+    }
+    for(int i = 16; i < 64; i++){
+        uint32_t s0 = ROTR32(w[i - 15], 7) ^ ROTR32(w[i - 15], 18) ^ (w[i - 15] >> 3);
+        uint32_t s1 = ROTR32(w[i - 2], 17) ^ ROTR32(w[i - 2], 19) ^ (w[i - 2] >> 10);
+        w[i] = w[i - 16] + s0 + w[i - 7] + s1;
+    }
+
+    uint32_t a = sha->state[0], b = sha->state[1], c = sha->state[2], d = sha->state[3];
+    uint32_t e = sha->state[4], f = sha->state[5], g = sha->state[6], h = sha->state[7];
+    for(int i = 0; i < 64; i++){
+        uint32_t t1 = h + (ROTR32(e, 6) ^ ROTR32(e, 11) ^ ROTR32(e, 25)) + ((e & f) ^ (~e & g)) + k[i] + w[i];
+        uint32_t t2 = (ROTR32(a, 2) ^ ROTR32(a, 13) ^ ROTR32(a, 22)) + ((a & b) ^ (a & c) ^ (b & c));
+        h = g;
+        g = f;
+        f = e;
+        e = d + t1;
+        d = c;
+        c = b;
+        b = a;
+        a = t1 + t2;
+    }
+    sha->state[0] += a;
+    sha->state[1] += b;
+    sha->state[2] += c;
+    sha->state[3] += d;
+    sha->state[4] += e;
+    sha->state[5] += f;
+    sha->state[6] += g;
+    sha->state[7] += h;
+}
+
+
+/*
+ * Function: Sha256Init
+ * --------------------
+ * Starts a SHA-256 hash
+ *
+ * Parameters:
+ *   sha - The hash state to initialise
+ *
+ * Returns:
+ *   None
+ */
+void Sha256Init(Sha256* sha){
+    static const uint32_t initial[8] = {
+        0x6a09e667, 0xbb67ae85, 0x3c6ef372, 0xa54ff53a, 0x510e527f, 0x9b05688c, 0x1f83d9ab, 0x5be0cd19
+    };
+    memcpy(sha->state, initial, sizeof(initial));
+    sha->length = 0;
+    sha->used = 0;
+}
+
+
+/*
+ * Function: Sha256Update
+ * ----------------------
+ * Feeds bytes into a SHA-256 hash
+ *
+ * Parameters:
+ *   sha    - The hash state
+ *   data   - The bytes
+ *   length - Number of bytes
+ *
+ * Returns:
+ *   None
+ */
+void Sha256Update(Sha256* sha, const void* data, size_t length){
+    const unsigned char* bytes = (const unsigned char*)data;
+    sha->length += length;
+
+    // Top up a partial block first, then hash whole blocks straight from the input
+    if(sha->used > 0){
+        size_t take = 64 - sha->used < length ? 64 - sha->used : length;
+        memcpy(sha->buffer + sha->used, bytes, take);
+        sha->used += take;
+        bytes += take;
+        length -= take;
+        if(sha->used < 64){
+            return;
+        }
+        Sha256Block(sha, sha->buffer);
+        sha->used = 0;
+    }
+    for(; length >= 64; bytes += 64, length -= 64){
+        Sha256Block(sha, bytes);
+    }
+    memcpy(sha->buffer, bytes, length);
+    sha->used = length;
+}
+
+
+/*
+ * Function: Sha256Final
+ * ---------------------
+ * Pads the message and produces the digest
+ *
+ * Parameters:
+ *   sha    - The hash state, unusable afterwards
+ *   digest - Receives the 32 byte digest
+ *
+ * Returns:
+ *   None
+ */
+void Sha256Final(Sha256* sha, unsigned char digest[32]){
+    uint64_t bits = sha->length * 8;
+    unsigned char padding[72] = { 0x80 };
+    size_t padLength = (sha->used < 56 ? 56 : 120) - sha->used;
+    for(int i = 0; i < 8; i++){
+        padding[padLength + i] = (unsigned char)(bits >> (56 - 8 * i));
+    }
+    Sha256Update(sha, padding, padLength + 8);
+
+    for(int i = 0; i < 8; i++){
+        digest[i * 4] = (unsigned char)(sha->state[i] >> 24);
+        digest[i * 4 + 1] = (unsigned char)(sha->state[i] >> 16);
+        digest[i * 4 + 2] = (unsigned char)(sha->state[i] >> 8);
+        digest[i * 4 + 3] = (unsigned char)sha->state[i];
+    }
+}
+
+
+/*
+ * Function: MemoBuiltin
+ * ---------------------
+ * Implements 'memo cmd args... [< in] [> out]', which treats a command
+ * as a pure function of its inputs. The key is a SHA-256 over the
+ * arguments, the resolved program (path, device, inode, size and
+ * mtime), the working directory, LANG/LC_ALL/LC_COLLATE/LC_CTYPE/TZ plus
+ * any variables named in TECHSHELL_MEMO_ENV, and the bytes the command
+ * would read on stdin.
+ * On a hit the cached stdout and exit status are replayed without
+ * starting anything. On a miss the command runs with its stdout captured,
+ * the result is stored unless the command was killed by a signal, and the
+ * cache is trimmed to TECHSHELL_MEMO_LIMIT (default 256M), least recently
+ * used first. stderr is not cached, and stdin is /dev/null unless it
+ * comes from '<' or a pipe
+ *   memo --stats   - hits, misses and evictions of this shell, cache size
+ *   memo --clear   - empty the cache
+ *
+ * Parameters:
+ *   command - The parsed command, args[0] is the builtin's name
+ *
+ * Returns:
+ *   The command's exit status, replayed or real, 2 for a usage error,
+ *   1 if the cache cannot be used
+ */
+int MemoBuiltin(ShellCommand* command){
+    char** args = command->args;
+    if(args[1] == NULL){
+        fprintf(stderr, "memo: usage: memo cmd args... | memo --stats | memo --clear\n");
+        return 2;
+    }
+
+    const char* dir = MemoDirectory();
+    if(dir == NULL){
+        return 1;
+    }
+    if(strcmp(args[1], "--stats") == 0){
+        unsigned long entries;
+        unsigned long long bytes;
+        MemoTrim(dir, ULLONG_MAX, &entries, &bytes);
+        printf("hits:       %lu\n", memoHits);
+        printf("misses:     %lu\n", memoMisses);
+        printf("evictions:  %lu\n", memoEvictions);
+        printf("entries:    %lu (%llu bytes, limit %llu)\n", entries, bytes, MemoLimit());
+        printf("directory:  %s\n", dir);
+        return 0;
+    }
+    if(strcmp(args[1], "--clear") == 0){
+        MemoTrim(dir, 0, NULL, NULL);
+        return 0;
+    }
+
+    // The program itself is part of the key, so rebuilding it invalidates its entries
+    struct stat program = { 0 };
+    const char* path = "";  // Builtins are keyed by name alone
+    if(FindBuiltin(args[1]) == NULL){
+        path = ResolveCommand(args[1]);
+        if(path == NULL || stat(path, &program) != 0){
+            fprintf(stderr, "Error: Command '%s' not found\n", args[1]);
+            return 127;
+        }
+    }
+
+    int inFd = MemoInput(RedirectsFd(command, STDIN_FILENO) || pipedStdin);
+    if(inFd == -1){
+        return 1;
+    }
+
+    Sha256 sha;
+    Sha256Init(&sha);
+    Sha256Update(&sha, "techshell-memo-1", 17);
+    for(int i = 1; args[i]; i++){
+        Sha256Update(&sha, args[i], strlen(args[i]) + 1);
+    }
+    Sha256Update(&sha, "\001", 1);
+    Sha256Update(&sha, path, strlen(path) + 1);
+    Sha256Update(&sha, &program.st_dev, sizeof(program.st_dev));
+    Sha256Update(&sha, &program.st_ino, sizeof(program.st_ino));
+    Sha256Update(&sha, &program.st_size, sizeof(program.st_size));
+    Sha256Update(&sha, &program.st_mtim, sizeof(program.st_mtim));
+    char cwd[PATH_MAX];
+    if(getcwd(cwd, sizeof(cwd)) != NULL){
+        Sha256Update(&sha, cwd, strlen(cwd) + 1);
+    }
+    MemoHashEnvironment(&sha);
+    if(MemoHashInput(&sha, inFd) != 0){
+        perror("memo: cannot read input");
+        close(inFd);
+        return 1;
+    }
+
+    unsigned char digest[32];
+    Sha256Final(&sha, digest);
+    char entryPath[PATH_MAX];
+    int length = snprintf(entryPath, sizeof(entryPath), "%s/", dir);
+    for(int i = 0; i < 32 && length < (int)sizeof(entryPath) - 3; i++){
+        length += sprintf(entryPath + length, "%02x", digest[i]);
+    }
+
+    // A hit is replayed and becomes the most recently used entry
+    int entry = open(entryPath, O_RDONLY | O_CLOEXEC);
+    if(entry != -1){
+        int status = MemoReplay(entry);
+        if(status >= 0){
+            futimens(entry, NULL);
+            close(entry);
+            close(inFd);
+            memoHits++;
+            return status;
+        }
+        close(entry);
+        unlink(entryPath);  // Truncated or foreign, run the command instead
+    }
+    memoMisses++;
+
+    // Capture the output next to the entries so the rename stays on one filesystem
+    char tempPath[PATH_MAX];
+    snprintf(tempPath, sizeof(tempPath), "%s/tmp.XXXXXX", dir);
+    int out = mkostemp(tempPath, O_CLOEXEC);
+    if(out == -1){
+        perror("memo: cannot create cache file");
+        close(inFd);
+        return 1;
+    }
+
+    // Run the command with the input we hashed on stdin
+    ShellCommand run = { 0 };
+    run.args = args + 1;
+    Redirect capture = { REDIRECT_WRITE, STDOUT_FILENO, -1, tempPath, 0, NULL, 0, NULL };
+    run.redirects = &capture;
+    fflush(stdout);
+    int savedIn = fcntl(STDIN_FILENO, F_DUPFD_CLOEXEC, 3);
+    dup2(inFd, STDIN_FILENO);
+    close(inFd);
+    int status = RunPipeline(&run);
+    if(savedIn != -1){
+        dup2(savedIn, STDIN_FILENO);
+        close(savedIn);
+    }
+
+    // The trailer records the status, entries without it are never replayed
+    off_t outputSize = lseek(out, 0, SEEK_END);
+    unsigned char trailer[MEMO_TRAILER_SIZE] = { 'T', 'S', 'M', 'E', 'M', 'O', (unsigned char)status, '\n' };
+    int stored = status < 128 && outputSize != -1 && write(out, trailer, sizeof(trailer)) == sizeof(trailer) &&
+                 rename(tempPath, entryPath) == 0;
+    if(!stored){
+        unlink(tempPath);
+    }
+    if(outputSize > 0){
+        CopyToStdout(out, outputSize);
+    }
+    close(out);
+
+    if(stored){
+        MemoTrim(dir, MemoLimit(), NULL, NULL);
+    }
+    return status;
+}
+
+
+/*
+ * Function: MemoDirectory
+ * -----------------------
+ * Finds the memo cache directory and creates it the first time:
+ * $TECHSHELL_MEMO_DIR, else $XDG_CACHE_HOME/techshell/memo, else
+ * ~/.cache/techshell/memo
+ *
+ * Parameters:
+ *   None
+ *
+ * Returns:
+ *   The directory, or NULL if it cannot be created (an error is printed)
+ */
+const char* MemoDirectory(){
+    static char dir[PATH_MAX];
+    if(dir[0] != '\0'){
+        return dir;
+    }
+
+    const char* configured = GetVariable("TECHSHELL_MEMO_DIR");
+    const char* cache = GetVariable("XDG_CACHE_HOME");
+    const char* home = GetVariable("HOME");
+    if(configured && *configured){
+        snprintf(dir, sizeof(dir), "%s", configured);
+    }
+    else if(cache && *cache){
+        snprintf(dir, sizeof(dir), "%s/techshell/memo", cache);
+    }
+    else{
+        snprintf(dir, sizeof(dir), "%s/.cache/techshell/memo", home ? home : "/tmp");
+    }
+
+    if(MakeDirectories(dir) != 0){
+        fprintf(stderr, "memo: cannot create %s: %s\n", dir, strerror(errno));
+        dir[0] = '\0';
+        return NULL;
+    }
+    return dir;
+}
+
+
+/*
+ * Function: MemoLimit
+ * -------------------
+ * Reads the cache size limit from TECHSHELL_MEMO_LIMIT, in bytes with an
+ * optional K, M or G suffix
+ *
+ * Parameters:
+ *   None
+ *
+ * Returns:
+ *   The limit in bytes, MEMO_DEFAULT_LIMIT if unset or invalid
+ */
+unsigned long long MemoLimit(){
+    const char* text = GetVariable("TECHSHELL_MEMO_LIMIT");
+    if(text == NULL || !isdigit((unsigned char)*text)){
+        return MEMO_DEFAULT_LIMIT;
+    }
+
+    char* end;
+    unsigned long long limit = strtoull(text, &end, 10);
+    switch(toupper((unsigned char)*end)){
+        case 'G': limit <<= 10; // Fall through
+        case 'M': limit <<= 10; // Fall through
+        case 'K': limit <<= 10; break;
+    }
+    return limit;
+}
+
+
+/*
+ * Function: MemoInput
+ * -------------------
+ * Decides what a memoized command reads. A regular file on stdin is
+ * used as it is and a pipe is drained into a memfd so it can be hashed
+ * and still be read. The shell's own stdin, which may be a terminal or
+ * the script being run, and devices are replaced by /dev/null since they
+ * cannot be part of the key
+ *
+ * Parameters:
+ *   useStdin - stdin was given to the command with '<' or a pipe
+ *
+ * Returns:
+ *   A close-on-exec descriptor positioned where reading should start,
+ *   or -1 on error (an error is printed)
+ */
+int MemoInput(int useStdin){
+    struct stat info;
+    if(useStdin && fstat(STDIN_FILENO, &info) == 0 && S_ISREG(info.st_mode)){
+        return fcntl(STDIN_FILENO, F_DUPFD_CLOEXEC, 3);
+    }
+    if(!useStdin || fstat(STDIN_FILENO, &info) != 0 || !(S_ISFIFO(info.st_mode) || S_ISSOCK(info.st_mode))){
+        return open("/dev/null", O_RDONLY | O_CLOEXEC);
+    }
+
+    int copy = memfd_create("memo-input", MFD_CLOEXEC);
+    if(copy == -1){
+        perror("memo: memfd_create failed");
+        return -1;
+    }
+    char buffer[READ_BUFFER_SIZE];
+    ssize_t got;
+    while((got = read(STDIN_FILENO, buffer, sizeof(buffer))) > 0 || (got == -1 && errno == EINTR)){
+        if(got > 0 && write(copy, buffer, got) != got){
+            perror("memo: cannot buffer input");
+            close(copy);
+            return -1;
+        }
+    }
+    lseek(copy, 0, SEEK_SET);
+    return copy;
+}
+
+
+/*
+ * Function: MemoHashEnvironment
+ * -----------------------------
+ * Adds the environment variables a command's output may depend on to
+ * the key: the locale and time zone, and any names listed (separated by
+ * spaces, commas or colons) in TECHSHELL_MEMO_ENV
+ *
+ * Parameters:
+ *   sha - The key being built
+ *
+ * Returns:
+ *   None
+ */
+void MemoHashEnvironment(Sha256* sha){
+    static const char* const defaults[] = { "LANG", "LC_ALL", "LC_COLLATE", "LC_CTYPE", "TZ", NULL };
+    for(int i = 0; defaults[i]; i++){
+        MemoHashVariable(sha, defaults[i], strlen(defaults[i]));
+    }
+
+    const char* extra = GetVariable("TECHSHELL_MEMO_ENV");
+    while(extra && *extra){
+        size_t length = strcspn(extra, " ,:");
+        if(length > 0){
+            MemoHashVariable(sha, extra, length);
+        }
+        extra += length;
+        extra += strspn(extra, " ,:");
+    }
+}
+
+
+/*
+ * Function: MemoHashVariable
+ * --------------------------
+ * Adds one variable to the key as NAME=value, or NAME alone when unset
+ * so that unset and empty hash differently
+ *
+ * Parameters:
+ *   sha    - The key being built
+ *   name   - The variable's name, not necessarily NUL terminated
+ *   length - Length of the name
+ *
+ * Returns:
+ *   None
+ */
+void MemoHashVariable(Sha256* sha, const char* name, size_t length){
+    // Only what the command would see counts, so unexported variables do not
+    Variable* variable = FindVariable(name, length);
+    Sha256Update(sha, "\002", 1);
+    Sha256Update(sha, name, length);
+    if(variable && variable->exported && variable->isSet){
+        Sha256Update(sha, "=", 1);
+        Sha256Update(sha, variable->entry + length + 1, strlen(variable->entry + length + 1) + 1);
+    }
+}
+
+
+/*
+ * Function: MemoHashInput
+ * -----------------------
+ * Adds everything a descriptor would yield from its current offset to
+ * the key, without moving the offset
+ *
+ * Parameters:
+ *   sha - The key being built
+ *   fd  - A regular file, memfd or /dev/null
+ *
+ * Returns:
+ *   0 on success, -1 on a read error
+ */
+int MemoHashInput(Sha256* sha, int fd){
+    off_t offset = lseek(fd, 0, SEEK_CUR);
+    if(offset == -1){
+        offset = 0;
+    }
+
+    char buffer[READ_BUFFER_SIZE];
+    ssize_t got;
+    Sha256Update(sha, "\003", 1);
+    while((got = pread(fd, buffer, sizeof(buffer), offset)) != 0){
+        if(got == -1){
+            if(errno == EINTR){
+                continue;
+            }
+            return -1;
+        }
+        Sha256Update(sha, buffer, got);
+        offset += got;
+    }
+    return 0;
+}
+
+
+/*
+ * Function: MemoReplay
+ * --------------------
+ * Writes a cache entry's output to stdout
+ *
+ * Parameters:
+ *   fd - The open entry
+ *
+ * Returns:
+ *   The recorded exit status, or -1 if the entry is not valid
+ */
+int MemoReplay(int fd){
+    struct stat info;
+    unsigned char trailer[MEMO_TRAILER_SIZE];
+    if(fstat(fd, &info) != 0 || info.st_size < MEMO_TRAILER_SIZE ||
+       pread(fd, trailer, sizeof(trailer), info.st_size - MEMO_TRAILER_SIZE) != MEMO_TRAILER_SIZE ||
+       memcmp(trailer, "TSMEMO", 6) != 0 || trailer[7] != '\n'){
+        return -1;
+    }
+
+    CopyToStdout(fd, info.st_size - MEMO_TRAILER_SIZE);
+    return trailer[6];
+}
+
+
+/*
+ * Function: CopyToStdout
+ * ----------------------
+ * Copies the start of a file to stdout, in the kernel with sendfile()
+ * when stdout allows it
+ *
+ * Parameters:
+ *   fd     - The file
+ *   length - Bytes to copy from offset 0
+ *
+ * Returns:
+ *   0 on success, -1 if stdout could not be written
+ */
+int CopyToStdout(int fd, off_t length){
+    fflush(stdout);
+
+    off_t offset = 0;
+    while(offset < length){
+        ssize_t sent = sendfile(STDOUT_FILENO, fd, &offset, length - offset);
+        if(sent > 0){
+            continue;
+        }
+        if(sent == -1 && errno == EINTR){
+            continue;
+        }
+        if(sent == 0 || (errno != EINVAL && errno != ENOSYS)){
+            return -1;
+        }
+
+        // sendfile() refuses some outputs, such as files opened for append
+        char buffer[READ_BUFFER_SIZE];
+        while(offset < length){
+            ssize_t got = pread(fd, buffer, length - offset < (off_t)sizeof(buffer) ? (size_t)(length - offset) : sizeof(buffer), offset);
+            if(got <= 0){
+                return -1;
+            }
+            for(ssize_t written = 0; written < got; ){
+                ssize_t put = write(STDOUT_FILENO, buffer + written, got - written);
+                if(put == -1 && errno != EINTR){
+                    return -1;
+                }
+                written += put > 0 ? put : 0;
+            }
+            offset += got;
+        }
+    }
+    return 0;
+}
+
+
+/*
+ * Function: MemoTrim
+ * ------------------
+ * Measures the cache and removes the least recently used entries (the
+ * oldest mtime, which a hit refreshes) until it fits in the limit.
+ * Temporary files left behind by a crashed shell are removed after a day
+ *
+ * Parameters:
+ *   dir     - The cache directory
+ *   limit   - Bytes the cache may hold, 0 to empty it, ULLONG_MAX to only measure
+ *   entries - Receives the number of entries kept, may be NULL
+ *   bytes   - Receives the bytes they use, may be NULL
+ *
+ * Returns:
+ *   None
+ */
+void MemoTrim(const char* dir, unsigned long long limit, unsigned long* entries, unsigned long long* bytes){
+    DIR* stream = opendir(dir);
+    if(stream == NULL){
+        return;
+    }
+
+    MemoEntry* list = NULL;
+    size_t count = 0;
+    size_t capacity = 0;
+    unsigned long long total = 0;
+    time_t now = time(NULL);
+
+    struct dirent* item;
+    while((item = readdir(stream)) != NULL){
+        struct stat info;
+        if(fstatat(dirfd(stream), item->d_name, &info, AT_SYMLINK_NOFOLLOW) != 0 || !S_ISREG(info.st_mode)){
+            continue;
+        }
+        if(strncmp(item->d_name, "tmp.", 4) == 0){
+            if(now - info.st_mtime > 86400){
+                unlinkat(dirfd(stream), item->d_name, 0);
+            }
+            continue;
+        }
+        if(strlen(item->d_name) != 64 || item->d_name[strspn(item->d_name, "0123456789abcdef")] != '\0'){
+            continue;
+        }
+
+        if(count == capacity){
+            capacity = capacity ? capacity * 2 : 64;
+            list = (MemoEntry*)realloc(list, capacity * sizeof(MemoEntry));
+            if(list == NULL){
+                perror("Memory allocation failed");
+                exit(EXIT_FAILURE);
+            }
+        }
+        memcpy(list[count].name, item->d_name, 65);
+        list[count].used = info.st_mtim;
+        list[count].size = info.st_size;
+        total += info.st_size;
+        count++;
+    }
+
+    // Oldest first, dropping entries until the rest fit
+    size_t kept = count;
+    if(total > limit){
+        qsort(list, count, sizeof(MemoEntry), CompareMemoEntries);
+        for(size_t i = 0; i < count && total > limit; i++){
+            if(unlinkat(dirfd(stream), list[i].name, 0) == 0){
+                total -= list[i].size;
+                kept--;
+                memoEvictions++;
+            }
+        }
+    }
+    closedir(stream);
+    free(list);
+
+    if(entries){
+        *entries = kept;
+    }
+    if(bytes){
+        *bytes = total;
+    }
+}
+
+
+/*
+ * Function: CompareMemoEntries
+ * ----------------------------
+ * qsort() comparison ordering cache entries from least to most recently used
+ *
+ * Parameters:
+ *   a - First MemoEntry
+ *   b - Second MemoEntry
+ *
+ * Returns:
+ *   Negative, zero or positive like strcmp
+ */
+int CompareMemoEntries(const void* a, const void* b){
+    const struct timespec* x = &((const MemoEntry*)a)->used;
+    const struct timespec* y = &((const MemoEntry*)b)->used;
+    if(x->tv_sec != y->tv_sec){
+        return x->tv_sec < y->tv_sec ? -1 : 1;
+    }
+    return (x->tv_nsec > y->tv_nsec) - (x->tv_nsec < y->tv_nsec);
+}
+
+
+/*
+ * Function: MakeDirectories
+ * -------------------------
+ * Creates a directory and any missing parents, like mkdir -p
+ *
+ * Parameters:
+ *   path - The directory, modified while working but restored afterwards
+ *
+ * Returns:
+ *   0 on success, -1 with errno set otherwise
+ */
+int MakeDirectories(char* path){
+    for(char* slash = strchr(path + 1, '/'); ; slash = strchr(slash + 1, '/')){
+        if(slash){
+            *slash = '\0';
+        }
+        int made = mkdir(path, 0700) == 0 || errno == EEXIST;
+        if(slash){
+            *slash = '/';
+        }
+        if(!made){
+            return -1;
+        }
+        if(slash == NULL){
+            return 0;
+        }
+    }
+}
+
+
+/*
+ * Function: HistoryOpen
+ * ---------------------
+ * Opens the history log and its index, $TECHSHELL_HISTFILE or else
+ * $XDG_DATA_HOME/techshell/history (~/.local/share/techshell/history),
+ * plus the same name with .idx. The log is never parsed here: the index
+ * already holds every record's offset, and only records appended after
+ * the last indexed one (a shell died between its two writes) are
+ * scanned. An index that does not match the log is rebuilt
+ *
+ * Parameters:
+ *   None
+ *
+ * Returns:
+ *   None, history stays off if the files cannot be opened
+ */
+void HistoryOpen(){
+    char path[PATH_MAX];
+    const char* configured = GetVariable("TECHSHELL_HISTFILE");
+    const char* data = GetVariable("XDG_DATA_HOME");
+    const char* home = GetVariable("HOME");
+    if(configured && *configured){
+        snprintf(path, sizeof(path), "%s", configured);
+    }
+    else{
+        if(data && *data){
+            snprintf(path, sizeof(path), "%s/techshell", data);
+        }
+        else{
+            snprintf(path, sizeof(path), "%s/.local/share/techshell", home ? home : "/tmp");
+        }
+        if(MakeDirectories(path) != 0){
+            fprintf(stderr, "Error: Cannot create %s: %s\n", path, strerror(errno));
+            return;
+        }
+        strncat(path, "/history", sizeof(path) - strlen(path) - 1);
+    }
+
+    char indexPath[PATH_MAX + 4];
+    snprintf(indexPath, sizeof(indexPath), "%s.idx", path);
+    history.logFd = open(path, O_RDWR | O_CREAT | O_APPEND | O_CLOEXEC, 0600);
+    history.indexFd = open(indexPath, O_RDWR | O_CREAT | O_APPEND | O_CLOEXEC, 0600);
+    if(history.logFd == -1 || history.indexFd == -1){
+        fprintf(stderr, "Error: Cannot open history '%s': %s\n", path, strerror(errno));
+        if(history.logFd != -1){
+            close(history.logFd);
+        }
+        if(history.indexFd != -1){
+            close(history.indexFd);
+        }
+        history.logFd = -1;
+        history.indexFd = -1;
+        return;
+    }
+
+    // Check that the last indexed record is where the index says and ends the log
+    flock(history.logFd, LOCK_EX);
+    HistoryRefresh();
+    uint64_t end = 0;
+    if(history.count > 0){
+        const HistoryRecord* last = HistoryGet(history.count - 1);
+        if(last == NULL){
+            if(ftruncate(history.indexFd, 0) != 0){
+                perror("Error: Cannot reset history index");
+            }
+            HistoryRefresh();
+        }
+        else{
+            end = history.index[history.count - 1] + last->size;
+        }
+    }
+    if(end < history.logMapped){
+        HistoryIndexFrom(end);
+    }
+    flock(history.logFd, LOCK_UN);
+}
+
+
+/*
+ * Function: HistoryRefresh
+ * ------------------------
+ * Maps whatever other shells have appended since the last look. Only
+ * the index's size decides how many entries exist, since it is written
+ * after the record it points to
+ *
+ * Parameters:
+ *   None
+ *
+ * Returns:
+ *   None
+ */
+void HistoryRefresh(){
+    struct stat logInfo, indexInfo;
+    if(history.logFd == -1 || fstat(history.logFd, &logInfo) != 0 || fstat(history.indexFd, &indexInfo) != 0){
+        return;
+    }
+
+    if((size_t)logInfo.st_size != history.logMapped){
+        if(history.log){
+            munmap(history.log, history.logMapped);
+        }
+        history.log = NULL;
+        history.logMapped = 0;
+        if(logInfo.st_size > 0){
+            history.log = (char*)mmap(NULL, logInfo.st_size, PROT_READ, MAP_SHARED, history.logFd, 0);
+            if(history.log == MAP_FAILED){
+                history.log = NULL;
+            }
+            else{
+                history.logMapped = logInfo.st_size;
+            }
+        }
+    }
+
+    size_t indexSize = indexInfo.st_size - indexInfo.st_size % sizeof(uint64_t);
+    if(indexSize != history.count * sizeof(uint64_t)){
+        if(history.index){
+            munmap(history.index, history.count * sizeof(uint64_t));
+        }
+        history.index = NULL;
+        history.count = 0;
+        if(indexSize > 0){
+            history.index = (uint64_t*)mmap(NULL, indexSize, PROT_READ, MAP_SHARED, history.indexFd, 0);
+            if(history.index == MAP_FAILED){
+                history.index = NULL;
+            }
+            else{
+                history.count = indexSize / sizeof(uint64_t);
+            }
+        }
+    }
+}
+
+
+/*
+ * Function: HistoryIndexFrom
+ * --------------------------
+ * Appends index entries for the records found from an offset to the end
+ * of the log, skipping over torn writes. Called with the log locked
+ *
+ * Parameters:
+ *   offset - Where the first unindexed record should start
+ *
+ * Returns:
+ *   None
+ */
+void HistoryIndexFrom(uint64_t offset){
+    while(offset + sizeof(HistoryRecord) <= history.logMapped){
+        const HistoryRecord* record = (const HistoryRecord*)(history.log + offset);
+        if(record->magic != HISTORY_MAGIC || record->size < sizeof(HistoryRecord) ||
+           record->size % 8 != 0 || offset + record->size > history.logMapped){
+            offset += 8;  // Records are 8 byte aligned, look for the next one
+            continue;
+        }
+        if(write(history.indexFd, &offset, sizeof(offset)) != sizeof(offset)){
+            perror("Error: Cannot write history index");
+            break;
+        }
+        offset += record->size;
+    }
+    HistoryRefresh();
+}
+
+
+/*
+ * Function: HistoryGet
+ * --------------------
+ * Finds an entry's record in the mapped log
+ *
+ * Parameters:
+ *   entry - Entry number, 0 is the oldest
+ *
+ * Returns:
+ *   The record, or NULL if the index points at something that is not one
+ */
+const HistoryRecord* HistoryGet(size_t entry){
+    if(entry >= history.count){
+        return NULL;
+    }
+    uint64_t offset = history.index[entry];
+    if(offset % 8 != 0 || offset + sizeof(HistoryRecord) > history.logMapped){
+        return NULL;
+    }
+    const HistoryRecord* record = (const HistoryRecord*)(history.log + offset);
+    if(record->magic != HISTORY_MAGIC || offset + record->size > history.logMapped ||
+       sizeof(HistoryRecord) + record->cwdLength + record->commandLength > record->size){
+        return NULL;
+    }
+    return record;
+}
+
+
+/*
+ * Function: HistoryAppend
+ * -----------------------
+ * Appends one entry. The record and then its index entry are written
+ * with O_APPEND under an exclusive flock() on the log, so shells sharing
+ * the files never interleave and nothing already written is touched
+ *
+ * Parameters:
+ *   line     - The command line as typed
+ *   started  - When it started, Unix time in milliseconds
+ *   duration - How long it ran, in milliseconds
+ *   status   - Its exit status
+ *   cwd      - Directory it ran in
+ *
+ * Returns:
+ *   None
+ */
+void HistoryAppend(const char* line, int64_t started, uint32_t duration, int status, const char* cwd){
+    if(history.logFd == -1){
+        return;
+    }
+
+    size_t lineLength = strlen(line);
+    size_t cwdLength = cwd ? strlen(cwd) : 0;
+    size_t size = (sizeof(HistoryRecord) + cwdLength + lineLength + 7) & ~(size_t)7;
+    HistoryRecord* record = (HistoryRecord*)ArenaAlloc(&lineArena, size);
+    memset(record, 0, size);
+    record->magic = HISTORY_MAGIC;
+    record->size = size;
+    record->started = started;
+    record->duration = duration;
+    record->status = status;
+    record->cwdLength = cwdLength;
+    record->commandLength = lineLength;
+    memcpy((char*)(record + 1), cwd, cwdLength);
+    memcpy((char*)(record + 1) + cwdLength, line, lineLength);
+
+    flock(history.logFd, LOCK_EX);
+    uint64_t offset = lseek(history.logFd, 0, SEEK_END);
+    if(offset % 8 != 0){
+        // A torn write was left behind, keep our record aligned after it
+        static const char padding[8];
+        if(write(history.logFd, padding, 8 - offset % 8) > 0){
+            offset += 8 - offset % 8;
+        }
+    }
+    if(write(history.logFd, record, size) == (ssize_t)size){
+        if(write(history.indexFd, &offset, sizeof(offset)) != sizeof(offset)){
+            perror("Error: Cannot write history index");
+        }
+    }
+    else{
+        perror("Error: Cannot write history");
+    }
+    flock(history.logFd, LOCK_UN);
+}
+
+
+/*
+ * Function: HistorySearch
+ * -----------------------
+ * Finds the most recent entry before a given one whose command contains
+ * some text, walking the index backwards over the mapped log so nothing
+ * is copied or parsed
+ *
+ * Parameters:
+ *   text   - Text to look for, "" matches every entry
+ *   before - Search entries older than this one, history.count for all
+ *
+ * Returns:
+ *   The matching entry number, or -1 if there is none
+ */
+long HistorySearch(const char* text, size_t before){
+    size_t length = strlen(text);
+    if(before > history.count){
+        before = history.count;
+    }
+    while(before-- > 0){
+        const HistoryRecord* record = HistoryGet(before);
+        if(record && (length == 0 || memmem(HistoryCommand(record), record->commandLength, text, length))){
+            return (long)before;
+        }
+    }
+    return -1;
+}
+
+
+/*
+ * Function: HistoryCommand
+ * ------------------------
+ * Locates the command text of a record, which is not NUL terminated
+ *
+ * Parameters:
+ *   record - The record
+ *
+ * Returns:
+ *   The first byte of the command, record->commandLength bytes long
+ */
+const char* HistoryCommand(const HistoryRecord* record){
+    return (const char*)(record + 1) + record->cwdLength;
+}
+
+
+/*
+ * Function: HistoryBuiltin
+ * ------------------------
+ * Implements 'history [-l] [-s text] [N]', listing the last N entries
+ * (all of them without N), oldest first. -s keeps only commands
+ * containing text, and -l adds when each one started, how long it
+ * took, its exit status and the directory it ran in
+ *
+ * Parameters:
+ *   command - The parsed command, args[0] is the builtin's name
+ *
+ * Returns:
+ *   0 on success, 1 if history is off, 2 for a usage error
+ */
+int HistoryBuiltin(ShellCommand* command){
+    char** args = command->args;
+    int details = 0;
+    const char* text = "";
+    size_t limit = (size_t)-1;
+
+    for(int i = 1; args[i]; i++){
+        if(strcmp(args[i], "-l") == 0){
+            details = 1;
+        }
+        else if(strcmp(args[i], "-s") == 0 && args[i + 1]){
+            text = args[++i];
+        }
+        else if(isdigit((unsigned char)args[i][0])){
+            limit = strtoul(args[i], NULL, 10);
+        }
+        else{
+            fprintf(stderr, "history: usage: history [-l] [-s text] [N]\n");
+            return 2;
+        }
+    }
+    if(history.logFd == -1){
+        fprintf(stderr, "history: history is not available\n");
+        return 1;
+    }
+    HistoryRefresh();
+
+    // Collect the newest matches first, then print them oldest first
+    size_t found = 0;
+    size_t* entries = NULL;
+    size_t capacity = 0;
+    for(long entry = HistorySearch(text, history.count); entry >= 0 && found < limit; entry = HistorySearch(text, entry)){
+        if(found == capacity){
+            capacity = capacity ? capacity * 2 : 64;
+            entries = (size_t*)realloc(entries, capacity * sizeof(size_t));
+            if(entries == NULL){
+                perror("Memory allocation failed");
+                exit(EXIT_FAILURE);
+            }
+        }
+        entries[found++] = entry;
+    }
+
+    while(found-- > 0){
+        const HistoryRecord* record = HistoryGet(entries[found]);
+        if(details){
+            char when[32];
+            time_t seconds = record->started / 1000;
+            strftime(when, sizeof(when), "%Y-%m-%d %H:%M:%S", localtime(&seconds));
+            printf("%6zu  %s  %8.3fs  %3d  %.*s  %.*s\n", entries[found] + 1, when, record->duration / 1000.0, record->status,
+                   (int)record->cwdLength, (const char*)(record + 1), (int)record->commandLength, HistoryCommand(record));
+        }
+        else{
+            printf("%6zu  %.*s\n", entries[found] + 1, (int)record->commandLength, HistoryCommand(record));
+        }
+    }
+    free(entries);
+    return 0;
+}
+
+
+/*
+ * Function: EditLine
+ * ------------------
+ * Reads one line from the terminal with a raw-mode line editor. The
+ * screen is updated by diffing what is shown against what should be
+ * shown, so typing at the end of a line sends one byte and nothing is
+ * ever repainted that did not change. Keys:
+ *   Left/Right, Ctrl+B/F, Alt+B/F   move by character or word
+ *   Home/End, Ctrl+A/E              start and end of line
+ *   Backspace, Delete, Ctrl+D       delete (Ctrl+D on an empty line is end of input)
+ *   Ctrl+K, Ctrl+U, Ctrl+W          delete to end, to start, the word before
+ *   Up/Down, Ctrl+P/N               walk the history
+ *   Ctrl+R                          search the history
+ *   Tab                             complete a command or file name
+ *   Ctrl+L                          clear the screen
+ *   Ctrl+C                          abandon the line
+ *
+ * Parameters:
+ *   prompt       - The rendered prompt, written first
+ *   promptLength - Its length in bytes
+ *
+ * Returns:
+ *   The line, valid until the next call, or NULL at end of input
+ */
+char* EditLine(const char* prompt, size_t promptLength){
+    struct termios cooked, raw;
+    if(tcgetattr(STDIN_FILENO, &cooked) != 0){
+        return NULL;
+    }
+    raw = cooked;
+    raw.c_iflag &= ~(BRKINT | ICRNL | INPCK | ISTRIP | IXON);
+    raw.c_lflag &= ~(ECHO | ICANON | IEXTEN | ISIG);
+    raw.c_cc[VMIN] = 1;
+    raw.c_cc[VTIME] = 0;
+    tcsetattr(STDIN_FILENO, TCSADRAIN, &raw);
+
+    EditorSetText("", 0);
+    editor.prompt = prompt;
+    editor.promptLength = promptLength;
+    editor.historyEntry = -1;
+    editor.lastKey = 0;
+    HistoryRefresh();
+    EditorRepaint();
+
+    char* result = editor.text;
+    for(;;){
+        int key = EditorReadKey();
+        int lastKey = editor.lastKey;
+        editor.lastKey = key;
+
+        if(key == KEY_NONE){
+            result = NULL;  // End of input or a read error
+            break;
+        }
+        if(key == '\r' || key == '\n'){
+            EditorLeaveLine("");
+            break;
+        }
+        if(key == CTRL_KEY('d') && editor.length == 0){
+            result = NULL;
+            break;
+        }
+
+        switch(key){
+            case CTRL_KEY('c'):
+                // Leave what was typed on screen and start over below it
+                EditorLeaveLine("^C");
+                EditorSetText("", 0);
+                editor.historyEntry = -1;
+                EditorRepaint();
+                continue;
+            case CTRL_KEY('l'):
+                EditorFlush("\x1b[H\x1b[2J", 7);
+                EditorRepaint();
+                continue;
+            case '\t':
+                EditorComplete(lastKey == '\t');
+                continue;
+            case CTRL_KEY('r'):
+                if(EditorReverseSearch()){
+                    EditorLeaveLine("");
+                    tcsetattr(STDIN_FILENO, TCSADRAIN, &cooked);
+                    return editor.text;
+                }
+                continue;
+            case KEY_UP:
+            case CTRL_KEY('p'):
+                EditorHistory(-1);
+                continue;
+            case KEY_DOWN:
+            case CTRL_KEY('n'):
+                EditorHistory(1);
+                continue;
+        }
+
+        // Everything else only changes the text or the cursor
+        size_t cursor = editor.cursor;
+        switch(key){
+            case KEY_LEFT:
+            case CTRL_KEY('b'):
+                cursor = EditorPreviousChar(cursor);
+                break;
+            case KEY_RIGHT:
+            case CTRL_KEY('f'):
+                cursor = EditorNextChar(cursor);
+                break;
+            case KEY_WORD_LEFT:
+                cursor = EditorWordStart(cursor);
+                break;
+            case KEY_WORD_RIGHT:
+                while(cursor < editor.length && editor.text[cursor] == ' '){
+                    cursor++;
+                }
+                while(cursor < editor.length && editor.text[cursor] != ' '){
+                    cursor++;
+                }
+                break;
+            case KEY_HOME:
+            case CTRL_KEY('a'):
+                cursor = 0;
+                break;
+            case KEY_END:
+            case CTRL_KEY('e'):
+                cursor = editor.length;
+                break;
+            case 127:
+            case CTRL_KEY('h'):
+                cursor = EditorPreviousChar(cursor);
+                EditorDelete(cursor, editor.cursor);
+                break;
+            case KEY_DELETE:
+            case CTRL_KEY('d'):
+                EditorDelete(cursor, EditorNextChar(cursor));
+                break;
+            case CTRL_KEY('k'):
+                EditorDelete(cursor, editor.length);
+                break;
+            case CTRL_KEY('u'):
+                EditorDelete(0, cursor);
+                cursor = 0;
+                break;
+            case CTRL_KEY('w'):
+                cursor = EditorWordStart(cursor);
+                EditorDelete(cursor, editor.cursor);
+                break;
+            default:
+                if(key >= ' ' && key < 256){
+                    char byte = (char)key;
+                    EditorInsert(cursor, &byte, 1);
+                    cursor++;
+                }
+                break;
+        }
+        editor.cursor = cursor;
+        EditorRefresh();
+    }
+
+    tcsetattr(STDIN_FILENO, TCSADRAIN, &cooked);
+    return result;
+}
+
+
+/*
+ * Function: EditorReadKey
+ * -----------------------
+ * Reads one key press, decoding the escape sequences terminals send for
+ * arrows and editing keys. Background jobs are reaped and PATH changes
+ * picked up while waiting
+ *
+ * Parameters:
+ *   None
+ *
+ * Returns:
+ *   A byte, one of the KEY_* codes, or KEY_NONE at end of input
+ */
+int EditorReadKey(){
+    if(editor.pendingKey){
+        int key = editor.pendingKey;
+        editor.pendingKey = 0;
+        return key;
+    }
+
+    int c = EditorReadByte(-1);
+    if(c != 27){
+        return c < 0 ? KEY_NONE : c;
+    }
+
+    // A lone ESC has nothing following it within a moment
+    int next = EditorReadByte(50);
+    if(next == 'b' || next == 'f'){
+        return next == 'b' ? KEY_WORD_LEFT : KEY_WORD_RIGHT;
+    }
+    if(next != '[' && next != 'O'){
+        return 27;
+    }
+
+    int final = EditorReadByte(50);
+    int number = 0;
+    while(final >= '0' && final <= '9'){
+        number = number * 10 + final - '0';
+        final = EditorReadByte(50);
+    }
+    while(final == ';' || (final >= '0' && final <= '9')){
+        final = EditorReadByte(50);  // Modifiers such as 1;5C are ignored
+    }
+
+    switch(final){
+        case 'A': return KEY_UP;
+        case 'B': return KEY_DOWN;
+        case 'C': return KEY_RIGHT;
+        case 'D': return KEY_LEFT;
+        case 'H': return KEY_HOME;
+        case 'F': return KEY_END;
+        case '~':
+            switch(number){
+                case 1: case 7: return KEY_HOME;
+                case 4: case 8: return KEY_END;
+                case 3: return KEY_DELETE;
+            }
+    }
+    return 0;  // Unknown sequence, ignored
+}
+
+
+/*
+ * Function: EditorReadByte
+ * ------------------------
+ * Reads one byte from the terminal
+ *
+ * Parameters:
+ *   timeout - Milliseconds to wait, -1 to wait for as long as it takes
+ *
+ * Returns:
+ *   The byte, or -1 at end of input, on error or on timeout
+ */
+int EditorReadByte(int timeout){
+    if(editor.inputStart < editor.inputEnd){
+        return (unsigned char)editor.input[editor.inputStart++];
+    }
+
+    if(timeout >= 0){
+        struct pollfd pfd = { STDIN_FILENO, POLLIN, 0 };
+        if(poll(&pfd, 1, timeout) <= 0){
+            return -1;
+        }
+    }
+    else{
+        WaitForInput(STDIN_FILENO);
+    }
+
+    ssize_t n;
+    do{
+        n = read(STDIN_FILENO, editor.input, sizeof(editor.input));
+    } while(n == -1 && errno == EINTR);
+    if(n <= 0){
+        return -1;
+    }
+    editor.inputStart = 1;
+    editor.inputEnd = n;
+    return (unsigned char)editor.input[0];
+}
+
+
+/*
+ * Function: EditorSetText
+ * -----------------------
+ * Replaces the whole line, leaving the cursor at its end
+ *
+ * Parameters:
+ *   text   - The new contents, not necessarily NUL terminated
+ *   length - Their length
+ *
+ * Returns:
+ *   None
+ */
+void EditorSetText(const char* text, size_t length){
+    editor.length = 0;
+    editor.cursor = 0;
+    EditorInsert(0, text, length);
+    editor.cursor = length;
+}
+
+
+/*
+ * Function: EditorInsert
+ * ----------------------
+ * Inserts bytes into the line without moving the cursor
+ *
+ * Parameters:
+ *   at     - Byte offset to insert at
+ *   bytes  - What to insert
+ *   length - How many bytes
+ *
+ * Returns:
+ *   None
+ */
+void EditorInsert(size_t at, const char* bytes, size_t length){
+    if(editor.length + length + 1 > editor.capacity){
+        size_t capacity = editor.capacity ? editor.capacity : INITIAL_LINE_SIZE;
+        while(editor.length + length + 1 > capacity){
+            capacity *= 2;
+        }
+        editor.text = (char*)realloc(editor.text, capacity);
+        if(editor.text == NULL){
+            perror("Memory allocation failed");
+            exit(EXIT_FAILURE);
+        }
+        editor.capacity = capacity;
+    }
+    memmove(editor.text + at + length, editor.text + at, editor.length - at);
+    memcpy(editor.text + at, bytes, length);
+    editor.length += length;
+    editor.text[editor.length] = '\0';
+}
+
+
+/*
+ * Function: EditorDelete
+ * ----------------------
+ * Removes a range of bytes from the line
+ *
+ * Parameters:
+ *   from - First byte to remove
+ *   to   - One past the last byte to remove
+ *
+ * Returns:
+ *   None
+ */
+void EditorDelete(size_t from, size_t to){
+    if(to <= from){
+        return;
+    }
+    memmove(editor.text + from, editor.text + to, editor.length - to);
+    editor.length -= to - from;
+    editor.text[editor.length] = '\0';
+}
+
+
+/*
+ * Function: EditorPreviousChar
+ * ----------------------------
+ * Steps back over one character, all of a UTF-8 sequence at once
+ *
+ * Parameters:
+ *   at - A byte offset into the line
+ *
+ * Returns:
+ *   Offset of the character before it
+ */
+size_t EditorPreviousChar(size_t at){
+    if(at > 0){
+        at--;
+    }
+    while(at > 0 && (editor.text[at] & 0xC0) == 0x80){
+        at--;
+    }
+    return at;
+}
+
+
+/*
+ * Function: EditorNextChar
+ * ------------------------
+ * Steps over one character, all of a UTF-8 sequence at once
+ *
+ * Parameters:
+ *   at - A byte offset into the line
+ *
+ * Returns:
+ *   Offset of the character after it
+ */
+size_t EditorNextChar(size_t at){
+    if(at < editor.length){
+        at++;
+    }
+    while(at < editor.length && (editor.text[at] & 0xC0) == 0x80){
+        at++;
+    }
+    return at;
+}
+
+
+/*
+ * Function: EditorWordStart
+ * -------------------------
+ * Finds the start of the word before an offset, skipping spaces first
+ *
+ * Parameters:
+ *   at - A byte offset into the line
+ *
+ * Returns:
+ *   Offset of the first byte of that word
+ */
+size_t EditorWordStart(size_t at){
+    while(at > 0 && editor.text[at - 1] == ' '){
+        at--;
+    }
+    while(at > 0 && editor.text[at - 1] != ' '){
+        at--;
+    }
+    return at;
+}
+
+
+/*
+ * Function: DisplayColumns
+ * ------------------------
+ * Counts the terminal columns some text takes: escape sequences take
+ * none, and a UTF-8 sequence takes one
+ *
+ * Parameters:
+ *   text   - The text
+ *   length - Its length in bytes
+ *
+ * Returns:
+ *   The number of columns
+ */
+size_t DisplayColumns(const char* text, size_t length){
+    size_t columns = 0;
+    for(size_t i = 0; i < length; i++){
+        unsigned char c = text[i];
+        if(c == 27 && i + 1 < length && text[i + 1] == '['){
+            // CSI sequences such as colours end with a byte in 0x40-0x7E
+            for(i += 2; i < length && !(text[i] >= 0x40 && text[i] <= 0x7E); i++){
+            }
+            continue;
+        }
+        if((c & 0xC0) != 0x80 && c >= ' '){
+            columns++;
+        }
+    }
+    return columns;
+}
+
+
+/*
+ * Function: EditorRepaint
+ * -----------------------
+ * Writes the whole prompt and line from the current cursor position,
+ * forgetting whatever was shown before. Used for the first paint and
+ * after output that is not the editor's own
+ *
+ * Parameters:
+ *   None
+ *
+ * Returns:
+ *   None
+ */
+void EditorRepaint(){
+    // Only the prompt's last line is redrawn later, the rest is written once
+    const char* tail = (const char*)memrchr(editor.prompt, '\n', editor.promptLength);
+    tail = tail ? tail + 1 : editor.prompt;
+    EditorOutput(editor.prompt, tail - editor.prompt);
+
+    editor.head = tail;
+    editor.headLength = editor.promptLength - (tail - editor.prompt);
+    editor.shownLength = 0;
+    editor.shownColumns = 0;
+    editor.screenCursor = 0;
+    EditorRefresh();
+}
+
+
+/*
+ * Function: EditorRefresh
+ * -----------------------
+ * Brings the screen in line with the prompt and text. Only the part
+ * after the longest common prefix with what is on screen is rewritten,
+ * and the cursor is moved with relative sequences, so an edit costs a
+ * few bytes on the wire however long the line is
+ *
+ * Parameters:
+ *   None
+ *
+ * Returns:
+ *   None
+ */
+void EditorRefresh(){
+    struct winsize size;
+    int columns = ioctl(STDOUT_FILENO, TIOCGWINSZ, &size) == 0 && size.ws_col > 0 ? size.ws_col : 80;
+    if(editor.columns == 0){
+        editor.columns = columns;
+    }
+    if(columns != editor.columns){
+        // The terminal has rewrapped the line, so redraw it from its first row
+        EditorMoveColumn(editor.screenCursor, 0);
+        editor.columns = columns;
+        editor.shownLength = 0;
+        editor.shownColumns = 0;
+        editor.screenCursor = 0;
+    }
+
+    // What should be on screen: the prompt's last line, then the text
+    size_t wantLength = editor.headLength + editor.length;
+    if(wantLength + 1 > editor.displayCapacity){
+        editor.displayCapacity = (wantLength + 1) * 2;
+        editor.shown = (char*)realloc(editor.shown, editor.displayCapacity);
+        editor.want = (char*)realloc(editor.want, editor.displayCapacity);
+        if(editor.shown == NULL || editor.want == NULL){
+            perror("Memory allocation failed");
+            exit(EXIT_FAILURE);
+        }
+    }
+    memcpy(editor.want, editor.head, editor.headLength);
+    memcpy(editor.want + editor.headLength, editor.text, editor.length);
+
+    size_t limit = editor.shownLength < wantLength ? editor.shownLength : wantLength;
+    size_t common = 0;
+    while(common < limit && editor.shown[common] == editor.want[common]){
+        common++;
+    }
+    while(common > 0 && common < wantLength && (editor.want[common] & 0xC0) == 0x80){
+        common--;  // Never split a UTF-8 sequence
+    }
+    if(common < editor.headLength && memchr(editor.head, 27, editor.headLength)){
+        common = 0;  // Nor an escape sequence in the prompt
+    }
+
+    size_t commonColumn = DisplayColumns(editor.want, common);
+    size_t endColumn = DisplayColumns(editor.want, wantLength);
+    EditorMoveColumn(editor.screenCursor, commonColumn);
+    EditorOutput(editor.want + common, wantLength - common);
+    if(endColumn < editor.shownColumns || editor.shownLength == 0){
+        EditorOutput("\x1b[J", 3);  // Clear what a longer line left behind
+    }
+    if(wantLength > common && endColumn % columns == 0 && endColumn > 0){
+        EditorOutput("\r\n", 2);  // Leave the cursor on the next row rather than past the margin
+    }
+
+    size_t cursorColumn = DisplayColumns(editor.want, editor.headLength + editor.cursor);
+    EditorMoveColumn(wantLength > common ? endColumn : commonColumn, cursorColumn);
+    editor.screenCursor = cursorColumn;
+    editor.shownLength = wantLength;
+    editor.shownColumns = endColumn;
+    char* swap = editor.shown;
+    editor.shown = editor.want;
+    editor.want = swap;
+
+    EditorFlush(NULL, 0);
+}
+
+
+/*
+ * Function: EditorMoveColumn
+ * --------------------------
+ * Moves the terminal cursor between two positions of the displayed line,
+ * counted in columns from the start of the prompt's last line, across
+ * wrapped rows if needed
+ *
+ * Parameters:
+ *   from - Where the cursor is
+ *   to   - Where it should go
+ *
+ * Returns:
+ *   None
+ */
+void EditorMoveColumn(size_t from, size_t to){
+    char sequence[32];
+    size_t columns = editor.columns;
+    size_t fromRow = from / columns, toRow = to / columns;
+    size_t fromColumn = from % columns, toColumn = to % columns;
+
+    if(toRow < fromRow){
+        EditorOutput(sequence, sprintf(sequence, "\x1b[%zuA", fromRow - toRow));
+    }
+    else if(toRow > fromRow){
+        EditorOutput(sequence, sprintf(sequence, "\x1b[%zuB", toRow - fromRow));
+    }
+    if(toColumn == 0 && fromColumn != 0){
+        EditorOutput("\r", 1);
+    }
+    else if(toColumn < fromColumn){
+        EditorOutput(sequence, sprintf(sequence, "\x1b[%zuD", fromColumn - toColumn));
+    }
+    else if(toColumn > fromColumn){
+        EditorOutput(sequence, sprintf(sequence, "\x1b[%zuC", toColumn - fromColumn));
+    }
+}
+
+
+/*
+ * Function: EditorLeaveLine
+ * -------------------------
+ * Moves the cursor below the line so output can follow it
+ *
+ * Parameters:
+ *   mark - Text to show at the end of the line first, such as "^C"
+ *
+ * Returns:
+ *   None
+ */
+void EditorLeaveLine(const char* mark){
+    editor.cursor = editor.length;
+    EditorRefresh();
+
+    // A line ending exactly at the margin already left the cursor on a fresh row
+    if(*mark || editor.screenCursor % editor.columns != 0 || editor.screenCursor == 0){
+        EditorOutput(mark, strlen(mark));
+        EditorOutput("\r\n", 2);
+    }
+    EditorFlush(NULL, 0);
+}
+
+
+/*
+ * Function: EditorOutput
+ * ----------------------
+ * Queues bytes for the terminal, EditorFlush sends them in one write()
+ *
+ * Parameters:
+ *   bytes  - What to send
+ *   length - How many bytes
+ *
+ * Returns:
+ *   None
+ */
+void EditorOutput(const char* bytes, size_t length){
+    if(editor.out.length + length > editor.out.capacity){
+        size_t capacity = editor.out.capacity ? editor.out.capacity : INITIAL_LINE_SIZE;
+        while(editor.out.length + length > capacity){
+            capacity *= 2;
+        }
+        editor.out.data = (char*)realloc(editor.out.data, capacity);
+        if(editor.out.data == NULL){
+            perror("Memory allocation failed");
+            exit(EXIT_FAILURE);
+        }
+        editor.out.capacity = capacity;
+    }
+    memcpy(editor.out.data + editor.out.length, bytes, length);
+    editor.out.length += length;
+}
+
+
+/*
+ * Function: EditorFlush
+ * ---------------------
+ * Sends the queued output and some final bytes to the terminal
+ *
+ * Parameters:
+ *   bytes  - Bytes to add after the queue, or NULL
+ *   length - How many
+ *
+ * Returns:
+ *   None
+ */
+void EditorFlush(const char* bytes, size_t length){
+    if(bytes){
+        EditorOutput(bytes, length);
+    }
+    size_t written = 0;
+    while(written < editor.out.length){
+        ssize_t n = write(STDOUT_FILENO, editor.out.data + written, editor.out.length - written);
+        if(n == -1 && errno != EINTR){
+            break;
+        }
+        written += n > 0 ? n : 0;
+    }
+    editor.out.length = 0;
+}
+
+
+/*
+ * Function: EditorHistory
+ * -----------------------
+ * Replaces the line with an older or newer history entry. The line being
+ * typed is kept and comes back after the newest entry
+ *
+ * Parameters:
+ *   direction - -1 for older, 1 for newer
+ *
+ * Returns:
+ *   None
+ */
+void EditorHistory(int direction){
+    if(history.count == 0){
+        return;
+    }
+    if(editor.historyEntry == -1){
+        if(direction > 0){
+            return;
+        }
+        free(editor.saved);
+        editor.saved = strdup(editor.text);
+        editor.historyEntry = history.count;
+    }
+
+    long entry = editor.historyEntry + direction;
+    if(entry < 0){
+        return;
+    }
+    if((size_t)entry >= history.count){
+        editor.historyEntry = -1;
+        EditorSetText(editor.saved ? editor.saved : "", editor.saved ? strlen(editor.saved) : 0);
+    }
+    else{
+        const HistoryRecord* record = HistoryGet(entry);
+        if(record == NULL){
+            return;
+        }
+        editor.historyEntry = entry;
+        EditorSetText(HistoryCommand(record), record->commandLength);
+    }
+    EditorRefresh();
+}
+
+
+/*
+ * Function: EditorReverseSearch
+ * -----------------------------
+ * Runs Ctrl+R incremental search. Typing narrows the search, Ctrl+R
+ * again finds an older match, Enter runs the match, Ctrl+G or Ctrl+C
+ * gives up and any other key keeps the match and is then handled as
+ * usual
+ *
+ * Parameters:
+ *   None
+ *
+ * Returns:
+ *   1 if the match should run now, 0 to keep editing
+ */
+int EditorReverseSearch(){
+    char* original = strdup(editor.text);
+    char query[256] = "";
+    size_t queryLength = 0;
+    long match = -1;
+    int failed = 0;
+    char head[300];
+
+    for(;;){
+        snprintf(head, sizeof(head), "(%sreverse-i-search)`%s': ", failed ? "failed " : "", query);
+        editor.head = head;
+        editor.headLength = strlen(head);
+        EditorRefresh();
+
+        int key = EditorReadKey();
+        long from = match == -1 ? (long)history.count : match + 1;
+        if(key == CTRL_KEY('r')){
+            from = match == -1 ? (long)history.count : match;
+        }
+        else if(key == 127 || key == CTRL_KEY('h')){
+            if(queryLength > 0){
+                query[--queryLength] = '\0';
+            }
+            from = history.count;
+        }
+        else if(key >= ' ' && key < 256 && queryLength < sizeof(query) - 1){
+            query[queryLength++] = (char)key;
+            query[queryLength] = '\0';
+        }
+        else{
+            // Leave search mode, restoring the prompt
+            const char* tail = (const char*)memrchr(editor.prompt, '\n', editor.promptLength);
+            tail = tail ? tail + 1 : editor.prompt;
+            editor.head = tail;
+            editor.headLength = editor.promptLength - (tail - editor.prompt);
+            if(key == CTRL_KEY('g') || key == CTRL_KEY('c')){
+                EditorSetText(original, strlen(original));
+            }
+            else if(key != '\r' && key != '\n'){
+                editor.pendingKey = key;  // The key that ended the search still does its job
+            }
+            free(original);
+            EditorRefresh();
+            return key == '\r' || key == '\n';
+        }
+
+        long found = queryLength ? HistorySearch(query, from) : -1;
+        failed = queryLength > 0 && found == -1;
+        if(found != -1){
+            match = found;
+            const HistoryRecord* record = HistoryGet(match);
+            EditorSetText(HistoryCommand(record), record->commandLength);
+            const char* at = (const char*)memmem(editor.text, editor.length, query, queryLength);
+            editor.cursor = at ? (size_t)(at - editor.text) : editor.length;
+        }
+    }
+}
+
+
+/*
+ * Function: EditorComplete
+ * ------------------------
+ * Completes the word before the cursor. The first word of a command is
+ * completed from builtins and $PATH executables, anything else as a file
+ * name. The word is extended as far as all candidates agree, and a
+ * second Tab lists them
+ *
+ * Parameters:
+ *   list - Show every candidate instead of completing
+ *
+ * Returns:
+ *   None
+ */
+void EditorComplete(int list){
+    // Find the word, where a backslash-escaped space does not end it
+    size_t start = editor.cursor;
+    while(start > 0){
+        char c = editor.text[start - 1];
+        int escaped = start > 1 && editor.text[start - 2] == '\\';
+        if((c == ' ' || c == '\t' || c == '|' || c == '&' || c == '<' || c == '>') && !escaped){
+            break;
+        }
+        start--;
+    }
+    size_t before = start;
+    while(before > 0 && editor.text[before - 1] == ' '){
+        before--;
+    }
+    int commandWord = before == 0 || strchr("|&", editor.text[before - 1]) != NULL;
+
+    // The word as the shell will see it, without its backslashes
+    char word[PATH_MAX];
+    size_t wordLength = 0;
+    for(size_t i = start; i < editor.cursor && wordLength < sizeof(word) - 1; i++){
+        if(editor.text[i] == '\\' && i + 1 < editor.cursor){
+            i++;
+        }
+        word[wordLength++] = editor.text[i];
+    }
+    word[wordLength] = '\0';
+
+    CompletionList candidates = { 0 };
+    const char* prefix = word;
+    if(commandWord && strchr(word, '/') == NULL){
+        CompleteCommand(word, &candidates);
+    }
+    else{
+        const char* slash = strrchr(word, '/');
+        prefix = slash ? slash + 1 : word;
+        CompleteFile(word, slash ? (size_t)(slash - word + 1) : 0, &candidates);
+    }
+    if(candidates.count == 0){
+        EditorFlush("\a", 1);
+        return;
+    }
+
+    if(list && candidates.count > 1){
+        EditorListCandidates(&candidates);
+        return;
+    }
+
+    // Extend the word by what every candidate shares
+    size_t shared = strlen(candidates.items[0].name);
+    for(size_t i = 1; i < candidates.count; i++){
+        size_t j = 0;
+        while(j < shared && candidates.items[i].name[j] == candidates.items[0].name[j]){
+            j++;
+        }
+        shared = j;
+    }
+    size_t typed = strlen(prefix);
+    char addition[PATH_MAX * 2];
+    size_t additionLength = 0;
+    for(size_t i = typed; i < shared && additionLength < sizeof(addition) - 3; i++){
+        char c = candidates.items[0].name[i];
+        if(strchr(" \t\\'\"|&<>#", c)){
+            addition[additionLength++] = '\\';
+        }
+        addition[additionLength++] = c;
+    }
+    if(candidates.count == 1){
+        addition[additionLength++] = candidates.items[0].directory ? '/' : ' ';
+    }
+    if(additionLength == 0){
+        EditorFlush("\a", 1);
+    }
+    else{
+        EditorInsert(editor.cursor, addition, additionLength);
+        editor.cursor += additionLength;
+        EditorRefresh();
+    }
+    free(candidates.items);
+}
+
+
+/*
+ * Function: EditorListCandidates
+ * ------------------------------
+ * Prints completion candidates in columns below the line, then repaints
+ * the prompt and line under them
+ *
+ * Parameters:
+ *   candidates - The candidates, sorted
+ *
+ * Returns:
+ *   None
+ */
+void EditorListCandidates(CompletionList* candidates){
+    EditorLeaveLine("");
+
+    if(candidates->count > COMPLETION_ASK_LIMIT){
+        char question[64];
+        EditorFlush(question, sprintf(question, "Display all %zu possibilities? (y or n)", candidates->count));
+        int answer = EditorReadKey();
+        EditorOutput("\r\n", 2);
+        if(answer != 'y' && answer != 'Y'){
+            free(candidates->items);
+            EditorRepaint();
+            return;
+        }
+    }
+
+    size_t widest = 0;
+    for(size_t i = 0; i < candidates->count; i++){
+        size_t width = DisplayColumns(candidates->items[i].name, strlen(candidates->items[i].name)) + candidates->items[i].directory;
+        if(width > widest){
+            widest = width;
+        }
+    }
+    size_t perRow = editor.columns / (widest + 2);
+    if(perRow == 0){
+        perRow = 1;
+    }
+    size_t rows = (candidates->count + perRow - 1) / perRow;
+
+    // Fill down the columns, like ls
+    for(size_t row = 0; row < rows; row++){
+        for(size_t column = 0; column < perRow; column++){
+            size_t i = column * rows + row;
+            if(i >= candidates->count){
+                break;
+            }
+            const char* name = candidates->items[i].name;
+            size_t width = DisplayColumns(name, strlen(name)) + candidates->items[i].directory;
+            EditorOutput(name, strlen(name));
+            if(candidates->items[i].directory){
+                EditorOutput("/", 1);
+            }
+            if(column + 1 < perRow && i + rows < candidates->count){
+                for(; width < widest + 2; width++){
+                    EditorOutput(" ", 1);
+                }
+            }
+        }
+        EditorOutput("\r\n", 2);
+    }
+    free(candidates->items);
+    EditorRepaint();
+}
+
+
+/*
+ * Function: AddCandidate
+ * ----------------------
+ * Appends a completion candidate
+ *
+ * Parameters:
+ *   list      - The list to grow
+ *   name      - The candidate, which must outlive the list
+ *   directory - 1 if it names a directory
+ *
+ * Returns:
+ *   None
+ */
+void AddCandidate(CompletionList* list, const char* name, int directory){
+    if(list->count == list->capacity){
+        list->capacity = list->capacity ? list->capacity * 2 : 32;
+        list->items = (Completion*)realloc(list->items, list->capacity * sizeof(Completion));
+        if(list->items == NULL){
+            perror("Memory allocation failed");
+            exit(EXIT_FAILURE);
+        }
+    }
+    list->items[list->count].name = name;
+    list->items[list->count].directory = directory;
+    list->count++;
+}
+
+
+/*
+ * Function: CompleteCommand
+ * -------------------------
+ * Collects the builtins and $PATH executables starting with a prefix
+ * from the command trie, building the trie on first use
+ *
+ * Parameters:
+ *   prefix     - What has been typed
+ *   candidates - Receives the names, in sorted order
+ *
+ * Returns:
+ *   None
+ */
+void CompleteCommand(const char* prefix, CompletionList* candidates){
+    const char* path = GetVariable("PATH");
+    if(commandTrie.root == NULL || strcmp(path ? path : "", commandTrie.path ? commandTrie.path : "") != 0){
+        BuildCommandTrie();
+    }
+
+    TrieNode* node = commandTrie.root;
+    for(const char* c = prefix; *c && node; c++){
+        node = node->child;
+        while(node && node->byte != (unsigned char)*c){
+            node = node->sibling;
+        }
+    }
+    if(node == NULL){
+        return;
+    }
+
+    // Names are rebuilt in the arena, which lives until the line is done
+    char name[NAME_MAX + 1];
+    size_t length = strlen(prefix);
+    if(length > NAME_MAX){
+        return;
+    }
+    memcpy(name, prefix, length);
+    CollectTrie(node, name, length, candidates);
+}
+
+
+/*
+ * Function: CollectTrie
+ * ---------------------
+ * Adds every name at or below a trie node to a candidate list
+ *
+ * Parameters:
+ *   node       - The node reached by the first length bytes of name
+ *   name       - Buffer holding the name so far, NAME_MAX + 1 bytes
+ *   length     - Bytes of name filled in
+ *   candidates - The list to add to
+ *
+ * Returns:
+ *   None
+ */
+void CollectTrie(TrieNode* node, char* name, size_t length, CompletionList* candidates){
+    if(node->dirs != 0){
+        name[length] = '\0';
+        AddCandidate(candidates, ArenaStrdup(&lineArena, name), 0);
+    }
+    if(length >= NAME_MAX){
+        return;
+    }
+    for(TrieNode* child = node->child; child; child = child->sibling){
+        name[length] = (char)child->byte;
+        CollectTrie(child, name, length + 1, candidates);
+    }
+}
+
+
+/*
+ * Function: BuildCommandTrie
+ * --------------------------
+ * Fills the command trie from the builtins and every executable in the
+ * $PATH directories, and watches those directories with inotify so
+ * later changes are applied one name at a time instead of rescanning
+ *
+ * Parameters:
+ *   None
+ *
+ * Returns:
+ *   None
+ */
+void BuildCommandTrie(){
+    if(commandTrie.watchFd != -1){
+        close(commandTrie.watchFd);  // Drops every watch at once
+    }
+    ArenaReset(&commandTrie.arena);
+    for(int i = 0; i < commandTrie.dirCount; i++){
+        free(commandTrie.dirs[i]);
+    }
+    free(commandTrie.path);
+    commandTrie.dirCount = 0;
+    commandTrie.root = TrieNewNode(0);
+
+    const char* path = GetVariable("PATH");
+    commandTrie.path = strdup(path ? path : "");
+    commandTrie.watchFd = inotify_init1(IN_NONBLOCK | IN_CLOEXEC);
+
+    for(size_t i = 0; i < sizeof(builtins) / sizeof(builtins[0]); i++){
+        TrieSetBit(builtins[i].name, TRIE_BUILTIN_BIT, 1);
+    }
+
+    char* copy = strdup(commandTrie.path);
+    char* rest = copy;
+    char* dir;
+    while((dir = strsep(&rest, ":")) != NULL && commandTrie.dirCount < TRIE_MAX_DIRS){
+        if(*dir == '\0'){
+            dir = ".";  // An empty entry means the current directory
+        }
+        int bit = commandTrie.dirCount;
+        commandTrie.dirs[bit] = strdup(dir);
+        commandTrie.watches[bit] = commandTrie.watchFd == -1 ? -1 :
+            inotify_add_watch(commandTrie.watchFd, dir, IN_CREATE | IN_DELETE | IN_MOVED_FROM | IN_MOVED_TO |
+                              IN_ATTRIB | IN_DELETE_SELF | IN_MOVE_SELF | IN_ONLYDIR);
+        commandTrie.dirCount++;
+
+        DIR* stream = opendir(dir);
+        if(stream == NULL){
+            continue;
+        }
+        struct dirent* entry;
+        while((entry = readdir(stream)) != NULL){
+            if(entry->d_name[0] != '.' && IsExecutableIn(dirfd(stream), entry->d_name)){
+                TrieSetBit(entry->d_name, bit, 1);
+            }
+        }
+        closedir(stream);
+    }
+    free(copy);
+}
+
+
+/*
+ * Function: IsExecutableIn
+ * ------------------------
+ * Checks whether a directory entry is a file we may execute
+ *
+ * Parameters:
+ *   dir  - Descriptor of the directory
+ *   name - The entry
+ *
+ * Returns:
+ *   1 if it is, 0 otherwise
+ */
+int IsExecutableIn(int dir, const char* name){
+    struct stat info;
+    return fstatat(dir, name, &info, 0) == 0 && S_ISREG(info.st_mode) && faccessat(dir, name, X_OK, AT_EACCESS) == 0;
+}
+
+
+/*
+ * Function: TrieNewNode
+ * ---------------------
+ * Allocates a trie node from the trie's arena
+ *
+ * Parameters:
+ *   byte - The byte leading to the node
+ *
+ * Returns:
+ *   The zeroed node
+ */
+TrieNode* TrieNewNode(unsigned char byte){
+    TrieNode* node = (TrieNode*)ArenaAlloc(&commandTrie.arena, sizeof(TrieNode));
+    memset(node, 0, sizeof(TrieNode));
+    node->byte = byte;
+    return node;
+}
+
+
+/*
+ * Function: TrieSetBit
+ * --------------------
+ * Records that a name is, or is no longer, found in one $PATH directory.
+ * Nodes are never freed: a name gone from every directory simply has no
+ * bits left and is skipped when collecting
+ *
+ * Parameters:
+ *   name - The command name
+ *   bit  - The directory's index, or TRIE_BUILTIN_BIT
+ *   set  - 1 to add the name, 0 to remove it
+ *
+ * Returns:
+ *   None
+ */
+void TrieSetBit(const char* name, int bit, int set){
+    TrieNode* node = commandTrie.root;
+    for(const unsigned char* c = (const unsigned char*)name; *c; c++){
+        // Children are kept sorted so collecting yields sorted names
+        TrieNode** link = &node->child;
+        while(*link && (*link)->byte < *c){
+            link = &(*link)->sibling;
+        }
+        if(*link == NULL || (*link)->byte != *c){
+            if(!set){
+                return;
+            }
+            TrieNode* child = TrieNewNode(*c);
+            child->sibling = *link;
+            *link = child;
+        }
+        node = *link;
+    }
+    if(set){
+        node->dirs |= 1ULL << bit;
+    }
+    else{
+        node->dirs &= ~(1ULL << bit);
+    }
+}
+
+
+/*
+ * Function: TrieClearDirectory
+ * ----------------------------
+ * Removes one directory's bit from every name, for a $PATH directory
+ * that was deleted or moved away
+ *
+ * Parameters:
+ *   node - Subtree to clear
+ *   bit  - The directory's index
+ *
+ * Returns:
+ *   None
+ */
+void TrieClearDirectory(TrieNode* node, int bit){
+    for(; node; node = node->sibling){
+        node->dirs &= ~(1ULL << bit);
+        TrieClearDirectory(node->child, bit);
+    }
+}
+
+
+/*
+ * Function: ApplyPathChanges
+ * --------------------------
+ * Applies queued inotify events for the $PATH directories to the command
+ * trie, and drops changed names from the lookup cache so a new or
+ * removed program is noticed at once
+ *
+ * Parameters:
+ *   None
+ *
+ * Returns:
+ *   None
+ */
+void ApplyPathChanges(){
+    char buffer[READ_BUFFER_SIZE] __attribute__((aligned(__alignof__(struct inotify_event))));
+    ssize_t n;
+    while((n = read(commandTrie.watchFd, buffer, sizeof(buffer))) > 0){
+        for(char* p = buffer; p < buffer + n; p += sizeof(struct inotify_event) + ((struct inotify_event*)p)->len){
+            struct inotify_event* event = (struct inotify_event*)p;
+            int bit = 0;
+            while(bit < commandTrie.dirCount && commandTrie.watches[bit] != event->wd){
+                bit++;
+            }
+            if(bit == commandTrie.dirCount){
+                continue;
+            }
+            if(event->mask & (IN_DELETE_SELF | IN_MOVE_SELF)){
+                TrieClearDirectory(commandTrie.root, bit);
+                ClearPathHash();
+                continue;
+            }
+            if(event->len == 0 || event->name[0] == '.'){
+                continue;
+            }
+
+            int present = 0;
+            if(event->mask & (IN_CREATE | IN_MOVED_TO | IN_ATTRIB)){
+                int dir = open(commandTrie.dirs[bit], O_RDONLY | O_DIRECTORY | O_CLOEXEC);
+                if(dir != -1){
+                    present = IsExecutableIn(dir, event->name);
+                    close(dir);
+                }
+            }
+            TrieSetBit(event->name, bit, present);
+            ForgetCommand(event->name);
+        }
+    }
+}
+
+
+/*
+ * Function: CompleteFile
+ * ----------------------
+ * Collects the entries of a directory starting with a prefix, from the
+ * directory listing cache. Hidden entries are only offered when the
+ * prefix starts with '.'
+ *
+ * Parameters:
+ *   word       - The word being completed, a leading ~/ means $HOME
+ *   dirLength  - Length of the directory part of word, up to its last '/'
+ *   candidates - Receives the names, in sorted order
+ *
+ * Returns:
+ *   None
+ */
+void CompleteFile(const char* word, size_t dirLength, CompletionList* candidates){
+    char dir[PATH_MAX];
+    const char* home = GetVariable("HOME");
+    if(dirLength == 0){
+        strcpy(dir, ".");
+    }
+    else if(word[0] == '~' && word[1] == '/' && home){
+        snprintf(dir, sizeof(dir), "%s%.*s", home, (int)dirLength - 1, word + 1);
+    }
+    else{
+        snprintf(dir, sizeof(dir), "%.*s", (int)dirLength, word);
+    }
+
+    const DirListing* listing = ListDirectory(dir);
+    if(listing == NULL){
+        return;
+    }
+    const char* prefix = word + dirLength;
+    size_t prefixLength = strlen(prefix);
+    int dirFd = -1;
+    for(size_t i = 0; i < listing->count; i++){
+        const DirEntry* entry = &listing->entries[i];
+        if(strncmp(entry->name, prefix, prefixLength) != 0 || (entry->name[0] == '.' && prefix[0] != '.') ||
+           strcmp(entry->name, ".") == 0 || strcmp(entry->name, "..") == 0){
+            continue;
+        }
+
+        // Only matches pay for resolving links and unknown types
+        int directory = entry->type == DT_DIR;
+        if(entry->type == DT_LNK || entry->type == DT_UNKNOWN){
+            struct stat info;
+            if(dirFd == -1){
+                dirFd = open(dir, O_RDONLY | O_DIRECTORY | O_CLOEXEC);
+            }
+            directory = fstatat(dirFd, entry->name, &info, 0) == 0 && S_ISDIR(info.st_mode);
+        }
+        AddCandidate(candidates, entry->name, directory);
+    }
+    if(dirFd != -1){
+        close(dirFd);
+    }
+    qsort(candidates->items, candidates->count, sizeof(Completion), CompareStrings);  // Completion starts with its name
+}
+
+
+/*
+ * Function: InitVariables
+ * -----------------------
+ * Fills the variable table from the environment the shell was started
+ * with, every entry exported
+ *
+ * Parameters:
+ *   None
+ *
+ * Returns:
+ *   None
+ */
+void InitVariables(){
+    shellPid = getpid();
+    for(char** entry = environ; *entry; entry++){
+        const char* equals = strchr(*entry, '=');
+        if(equals && equals > *entry){
+            SetVariable(*entry, equals - *entry, equals + 1, 1);
+        }
+    }
+}
+
+
+/*
+ * Function: HashVariableName
+ * --------------------------
+ * FNV-1a hash of a variable name
+ *
+ * Parameters:
+ *   name   - The name, not necessarily NUL terminated
+ *   length - Its length
+ *
+ * Returns:
+ *   The 32-bit hash
+ */
+uint32_t HashVariableName(const char* name, size_t length){
+    uint32_t hash = 2166136261u;
+    for(size_t i = 0; i < length; i++){
+        hash = (hash ^ (unsigned char)name[i]) * 16777619u;
+    }
+    return hash;
+}
+
+
+/*
+ * Function: FindVariable
+ * ----------------------
+ * Looks a variable up by probing the open-addressing table from its
+ * hash's slot until the name or an empty slot turns up
+ *
+ * Parameters:
+ *   name   - The name, not necessarily NUL terminated
+ *   length - Its length
+ *
+ * Returns:
+ *   The variable, or NULL if there is none by that name
+ */
+Variable* FindVariable(const char* name, size_t length){
+    if(variables.capacity == 0){
+        return NULL;
+    }
+    uint32_t hash = HashVariableName(name, length);
+    size_t mask = variables.capacity - 1;
+    for(size_t i = hash & mask; variables.slots[i].state != VARIABLE_EMPTY; i = (i + 1) & mask){
+        Variable* slot = &variables.slots[i];
+        if(slot->state == VARIABLE_USED && slot->hash == hash && slot->nameLength == length &&
+           memcmp(slot->entry, name, length) == 0){
+            return slot;
+        }
+    }
+    return NULL;
+}
+
+
+/*
+ * Function: GetVariable
+ * ---------------------
+ * Reads a variable, the shell's replacement for getenv()
+ *
+ * Parameters:
+ *   name - The name
+ *
+ * Returns:
+ *   The value, valid until the variable next changes, or NULL if unset
+ */
+const char* GetVariable(const char* name){
+    Variable* variable = FindVariable(name, strlen(name));
+    return variable && variable->isSet ? variable->entry + variable->nameLength + 1 : NULL;
+}
+
+
+/*
+ * Function: SetVariable
+ * ---------------------
+ * Creates or changes a variable. The environment for new processes is
+ * only marked stale when an exported value actually changes
+ *
+ * Parameters:
+ *   name       - The name, not necessarily NUL terminated
+ *   nameLength - Its length
+ *   value      - The value, or NULL to only change the export flag
+ *   exported   - 1 to export, 0 to stop exporting, -1 to leave as is
+ *
+ * Returns:
+ *   None
+ */
+void SetVariable(const char* name, size_t nameLength, const char* value, int exported){
+    Variable* variable = FindVariable(name, nameLength);
+    if(variable == NULL){
+        // Grow at 3/4 full, counting deleted slots, so probes stay short
+        if((variables.used + 1) * 4 > variables.capacity * 3){
+            ResizeVariables((variables.count + 1) * 4);
+        }
+        uint32_t hash = HashVariableName(name, nameLength);
+        size_t mask = variables.capacity - 1;
+        size_t i = hash & mask;
+        while(variables.slots[i].state == VARIABLE_USED){
+            i = (i + 1) & mask;
+        }
+        variable = &variables.slots[i];
+        if(variable->state == VARIABLE_EMPTY){
+            variables.used++;
+        }
+        variables.count++;
+        variable->state = VARIABLE_USED;
+        variable->hash = hash;
+        variable->nameLength = nameLength;
+        variable->entry = NULL;
+        variable->exported = 0;
+        variable->isSet = 0;
+    }
+    else if(value && variable->isSet && strcmp(variable->entry + nameLength + 1, value) == 0){
+        value = NULL;  // Same value, nothing to rebuild
+    }
+
+    if(value || variable->entry == NULL){
+        // The entry is "NAME=value", ready to go into an environment as is
+        size_t valueLength = value ? strlen(value) : 0;
+        char* entry = (char*)malloc(nameLength + valueLength + 2);
+        if(entry == NULL){
+            perror("Memory allocation failed");
+            exit(EXIT_FAILURE);
+        }
+        memcpy(entry, name, nameLength);
+        entry[nameLength] = '=';
+        memcpy(entry + nameLength + 1, value ? value : "", valueLength + 1);
+        free(variable->entry);
+        variable->entry = entry;
+        if(value){
+            variable->isSet = 1;
+            variables.dirty |= variable->exported;
+        }
+    }
+    if(exported != -1 && exported != variable->exported){
+        variable->exported = exported;
+        variables.dirty |= variable->isSet;
+    }
+}
+
+
+/*
+ * Function: UnsetVariable
+ * -----------------------
+ * Removes a variable, leaving a deleted marker so later probes go on
+ *
+ * Parameters:
+ *   name   - The name, not necessarily NUL terminated
+ *   length - Its length
+ *
+ * Returns:
+ *   None
+ */
+void UnsetVariable(const char* name, size_t length){
+    Variable* variable = FindVariable(name, length);
+    if(variable == NULL){
+        return;
+    }
+    variables.dirty |= variable->exported && variable->isSet;
+    free(variable->entry);
+    variable->entry = NULL;
+    variable->state = VARIABLE_DELETED;
+    variables.count--;
+}
+
+
+/*
+ * Function: ResizeVariables
+ * -------------------------
+ * Rehashes the table into a new slot array, dropping deleted markers
+ *
+ * Parameters:
+ *   capacity - Slots wanted, rounded up to a power of two
+ *
+ * Returns:
+ *   None
+ */
+void ResizeVariables(size_t capacity){
+    size_t size = VARIABLE_TABLE_MIN;
+    while(size < capacity){
+        size *= 2;
+    }
+
+    Variable* old = variables.slots;
+    size_t oldCapacity = variables.capacity;
+    variables.slots = (Variable*)calloc(size, sizeof(Variable));
+    if(variables.slots == NULL){
+        perror("Memory allocation failed");
+        exit(EXIT_FAILURE);
+    }
+    variables.capacity = size;
+    variables.used = variables.count;
+
+    for(size_t i = 0; i < oldCapacity; i++){
+        if(old[i].state == VARIABLE_USED){
+            size_t j = old[i].hash & (size - 1);
+            while(variables.slots[j].state != VARIABLE_EMPTY){
+                j = (j + 1) & (size - 1);
+            }
+            variables.slots[j] = old[i];
+        }
+    }
+    free(old);
+}
+
+
+/*
+ * Function: VariableEnvironment
+ * -----------------------------
+ * Returns the environment for new processes: the exported variables'
+ * entries. The array is only rebuilt after an exported variable changed,
+ * so launching a command normally costs nothing here
+ *
+ * Parameters:
+ *   None
+ *
+ * Returns:
+ *   A NULL terminated array, valid until a variable next changes
+ */
+char** VariableEnvironment(){
+    if(!variables.dirty && variables.environment){
+        return variables.environment;
+    }
+
+    size_t count = 0;
+    for(size_t i = 0; i < variables.capacity; i++){
+        Variable* variable = &variables.slots[i];
+        if(variable->state == VARIABLE_USED && variable->exported && variable->isSet){
+            count++;
+        }
+    }
+    free(variables.environment);
+    variables.environment = (char**)malloc((count + 1) * sizeof(char*));
+    if(variables.environment == NULL){
+        perror("Memory allocation failed");
+        exit(EXIT_FAILURE);
+    }
+
+    count = 0;
+    for(size_t i = 0; i < variables.capacity; i++){
+        Variable* variable = &variables.slots[i];
+        if(variable->state == VARIABLE_USED && variable->exported && variable->isSet){
+            variables.environment[count++] = variable->entry;
+        }
+    }
+    variables.environment[count] = NULL;
+    variables.dirty = 0;
+    environmentRebuilds++;
+    return variables.environment;
+}
+
+
+/*
+ * Function: StageEnvironment
+ * --------------------------
+ * Returns the environment for one pipeline stage. Assignments in front
+ * of the command override or add to the exported variables for that
+ * command only, in an array built in the line arena
+ *
+ * Parameters:
+ *   stage - The stage to launch
+ *
+ * Returns:
+ *   A NULL terminated array
+ */
+char** StageEnvironment(ShellCommand* stage){
+    char** base = VariableEnvironment();
+    if(stage->assignments == NULL){
+        return base;
+    }
+
+    size_t baseCount = 0, added = 0;
+    while(base[baseCount]){
+        baseCount++;
+    }
+    while(stage->assignments[added]){
+        added++;
+    }
+    char** environment = (char**)ArenaAlloc(&lineArena, (baseCount + added + 1) * sizeof(char*));
+
+    size_t count = 0;
+    for(size_t i = 0; i < baseCount; i++){
+        size_t nameLength = strchr(base[i], '=') - base[i];
+        int overridden = 0;
+        for(size_t j = 0; j < added && !overridden; j++){
+            overridden = strncmp(stage->assignments[j], base[i], nameLength + 1) == 0;
+        }
+        if(!overridden){
+            environment[count++] = base[i];
+        }
+    }
+    memcpy(environment + count, stage->assignments, added * sizeof(char*));
+    environment[count + added] = NULL;
+    return environment;
+}
+
+
+/*
+ * Function: ApplyAssignments
+ * --------------------------
+ * Sets variables from NAME=value words
+ *
+ * Parameters:
+ *   assignments - NULL terminated list of NAME=value strings
+ *   exported    - Passed on to SetVariable
+ *
+ * Returns:
+ *   None
+ */
+void ApplyAssignments(char** assignments, int exported){
+    for(int i = 0; assignments[i]; i++){
+        const char* equals = strchr(assignments[i], '=');
+        SetVariable(assignments[i], equals - assignments[i], equals + 1, exported);
+    }
+}
+
+
+/*
+ * Function: SaveAssignments
+ * -------------------------
+ * Takes a copy of the variables a builtin's NAME=value prefixes are about
+ * to change, so they can be put back once it has run
+ *
+ * Parameters:
+ *   assignments - NULL terminated list of NAME=value strings
+ *
+ * Returns:
+ *   One copy per assignment in the line arena, state VARIABLE_EMPTY for
+ *   a variable that did not exist
+ */
+Variable* SaveAssignments(char** assignments){
+    size_t count = 0;
+    while(assignments[count]){
+        count++;
+    }
+    Variable* saved = (Variable*)ArenaAlloc(&lineArena, count * sizeof(Variable));
+    for(size_t i = 0; i < count; i++){
+        Variable* variable = FindVariable(assignments[i], strchr(assignments[i], '=') - assignments[i]);
+        if(variable){
+            saved[i] = *variable;
+            saved[i].entry = ArenaStrdup(&lineArena, variable->entry);
+        }
+        else{
+            saved[i].state = VARIABLE_EMPTY;
+        }
+    }
+    return saved;
+}
+
+
+/*
+ * Function: RestoreAssignments
+ * ----------------------------
+ * Puts back the variables saved by SaveAssignments
+ *
+ * Parameters:
+ *   assignments - The NAME=value strings that were applied
+ *   saved       - What SaveAssignments returned for them
+ *
+ * Returns:
+ *   None
+ */
+void RestoreAssignments(char** assignments, Variable* saved){
+    for(size_t i = 0; assignments[i]; i++){
+        size_t nameLength = strchr(assignments[i], '=') - assignments[i];
+        if(saved[i].state != VARIABLE_USED || !saved[i].isSet){
+            UnsetVariable(assignments[i], nameLength);
+        }
+        if(saved[i].state == VARIABLE_USED){
+            SetVariable(saved[i].entry, nameLength, saved[i].isSet ? saved[i].entry + nameLength + 1 : NULL, saved[i].exported);
+        }
+    }
+}
+
+
+/*
+ * Function: IsVariableName
+ * ------------------------
+ * Checks that a string is a valid variable name: a letter or '_'
+ * followed by letters, digits and '_'
+ *
+ * Parameters:
+ *   name   - The candidate
+ *   length - Its length
+ *
+ * Returns:
+ *   1 if it is valid, 0 otherwise
+ */
+int IsVariableName(const char* name, size_t length){
+    if(length == 0 || !(isalpha((unsigned char)name[0]) || name[0] == '_')){
+        return 0;
+    }
+    for(size_t i = 1; i < length; i++){
+        if(!(isalnum((unsigned char)name[i]) || name[i] == '_')){
+            return 0;
+        }
+    }
+    return 1;
+}
+
+
+/*
+ * Function: PrintVariable
+ * -----------------------
+ * Prints a variable as a line the shell can read back, single quoting
+ * the value
+ *
+ * Parameters:
+ *   prefix   - Printed first, such as "export "
+ *   variable - The variable
+ *
+ * Returns:
+ *   None
+ */
+void PrintVariable(const char* prefix, const Variable* variable){
+    printf("%s%.*s", prefix, (int)variable->nameLength, variable->entry);
+    if(!variable->isSet){
+        putchar('\n');
+        return;
+    }
+    fputs("='", stdout);
+    for(const char* c = variable->entry + variable->nameLength + 1; *c; c++){
+        if(*c == '\''){
+            fputs("'\\''", stdout);
+        }
+        else{
+            putchar(*c);
+        }
+    }
+    fputs("'\n", stdout);
+}
+
+
+/*
+ * Function: CompareVariables
+ * --------------------------
+ * qsort comparator ordering variable pointers by name
+ *
+ * Parameters:
+ *   a - Pointer to the first Variable pointer
+ *   b - Pointer to the second Variable pointer
+ *
+ * Returns:
+ *   Negative, zero or positive like strcmp
+ */
+int CompareVariables(const void* a, const void* b){
+    const Variable* left = *(const Variable* const*)a;
+    const Variable* right = *(const Variable* const*)b;
+    size_t length = left->nameLength < right->nameLength ? left->nameLength : right->nameLength;
+    int order = memcmp(left->entry, right->entry, length);
+    return order ? order : (int)left->nameLength - (int)right->nameLength;
+}
+
+
+/*
+ * Function: ExportBuiltin
+ * -----------------------
+ * Implements 'export [-n] [NAME[=value]...]'. With no names it lists the
+ * exported variables, sorted. -n stops exporting the names instead
+ *
+ * Parameters:
+ *   command - The parsed command, args[0] is the builtin's name
+ *
+ * Returns:
+ *   0, or 1 if a name was not valid
+ */
+int ExportBuiltin(ShellCommand* command){
+    char** args = command->args + 1;
+    int exported = 1;
+    if(args[0] && strcmp(args[0], "-n") == 0){
+        exported = 0;
+        args++;
+    }
+    else if(args[0] && strcmp(args[0], "-p") == 0){
+        args++;
+    }
+
+    if(args[0] == NULL){
+        Variable** sorted = (Variable**)ArenaAlloc(&lineArena, (variables.count + 1) * sizeof(Variable*));
+        size_t count = 0;
+        for(size_t i = 0; i < variables.capacity; i++){
+            if(variables.slots[i].state == VARIABLE_USED && variables.slots[i].exported){
+                sorted[count++] = &variables.slots[i];
+            }
+        }
+        qsort(sorted, count, sizeof(Variable*), CompareVariables);
+        for(size_t i = 0; i < count; i++){
+            PrintVariable("export ", sorted[i]);
+        }
+        return 0;
+    }
+
+    int status = 0;
+    for(int i = 0; args[i]; i++){
+        const char* equals = strchr(args[i], '=');
+        size_t nameLength = equals ? (size_t)(equals - args[i]) : strlen(args[i]);
+        if(!IsVariableName(args[i], nameLength)){
+            fprintf(stderr, "export: '%s': not a valid name\n", args[i]);
+            status = 1;
+            continue;
+        }
+        SetVariable(args[i], nameLength, equals ? equals + 1 : NULL, exported);
+    }
+    return status;
+}
+
+
+/*
+ * Function: UnsetBuiltin
+ * ----------------------
+ * Implements 'unset NAME...'
+ *
+ * Parameters:
+ *   command - The parsed command, args[0] is the builtin's name
+ *
+ * Returns:
+ *   0, or 1 if a name was not valid
+ */
+int UnsetBuiltin(ShellCommand* command){
+    int status = 0;
+    for(int i = 1; command->args[i]; i++){
+        if(!IsVariableName(command->args[i], strlen(command->args[i]))){
+            fprintf(stderr, "unset: '%s': not a valid name\n", command->args[i]);
+            status = 1;
+            continue;
+        }
+        UnsetVariable(command->args[i], strlen(command->args[i]));
+    }
+    return status;
+}
+
+
+/*
+ * Function: InitTrace
+ * -------------------
+ * Turns on phase tracing. The ring buffer is allocated once here, so
+ * recording an event never allocates. The trace is written at exit
+ *
+ * Parameters:
+ *   path - File the Chrome trace JSON is written to
+ *
+ * Returns:
+ *   None
+ */
+void InitTrace(const char* path){
+    traceEvents = (TraceEvent*)calloc(TRACE_CAPACITY, sizeof(TraceEvent));
+    tracePath = strdup(path);
+    if(!traceEvents || !tracePath){
+        perror("Memory allocation failed");
+        exit(EXIT_FAILURE);
+    }
+    tracePid = getpid();
+    atexit(WriteTrace);
+}
+
+
+/*
+ * Function: TraceBegin
+ * --------------------
+ * Takes the starting timestamp of a phase
+ *
+ * Parameters:
+ *   None
+ *
+ * Returns:
+ *   CLOCK_MONOTONIC nanoseconds, or 0 when tracing is off
+ */
+uint64_t TraceBegin(){
+    if(traceEvents == NULL){
+        return 0;
+    }
+    struct timespec now;
+    clock_gettime(CLOCK_MONOTONIC, &now);
+    return (uint64_t)now.tv_sec * 1000000000u + now.tv_nsec;
+}
+
+
+/*
+ * Function: TraceEnd
+ * ------------------
+ * Records a finished phase in the ring buffer, overwriting the oldest
+ * event once it is full
+ *
+ * Parameters:
+ *   name   - Phase name, must be a string literal
+ *   start  - Value returned by TraceBegin
+ *   detail - Extra text such as the command name, or NULL
+ *
+ * Returns:
+ *   None
+ */
+void TraceEnd(const char* name, uint64_t start, const char* detail){
+    if(traceEvents == NULL){
+        return;
+    }
+    TraceEvent* event = &traceEvents[traceCount++ % TRACE_CAPACITY];
+    event->name = name;
+    event->start = start;
+    event->duration = TraceBegin() - start;
+    event->detail[0] = '\0';
+    if(detail){
+        strncat(event->detail, detail, TRACE_DETAIL_SIZE - 1);
+    }
+}
+
+
+/*
+ * Function: WriteTrace
+ * --------------------
+ * Writes the recorded events in Chrome trace-event format, loadable in
+ * chrome://tracing or Perfetto. Registered with atexit()
+ *
+ * Parameters:
+ *   None
+ *
+ * Returns:
+ *   None
+ */
+void WriteTrace(){
+    if(traceEvents == NULL || getpid() != tracePid){
+        return;  // Forked children share the buffer but must not write it
+    }
+
+    FILE* file = fopen(tracePath, "w");
+    if(file == NULL){
+        fprintf(stderr, "Error: Cannot write trace '%s': %s\n", tracePath, strerror(errno));
+        return;
+    }
+
+    uint64_t first = traceCount > TRACE_CAPACITY ? traceCount - TRACE_CAPACITY : 0;
+    fprintf(file, "{\"traceEvents\":[\n");
+    for(uint64_t i = first; i < traceCount; i++){
+        TraceEvent* event = &traceEvents[i % TRACE_CAPACITY];
+        fprintf(file, "%s{\"name\":\"%s\",\"cat\":\"repl\",\"ph\":\"X\",\"ts\":%.3f,\"dur\":%.3f,\"pid\":%d,\"tid\":%d",
+                i == first ? "" : ",\n", event->name, event->start / 1000.0, event->duration / 1000.0,
+                (int)tracePid, (int)tracePid);
+        if(event->detail[0]){
+            // Escape what JSON needs escaped, drop other control bytes
+            fprintf(file, ",\"args\":{\"command\":\"");
+            for(const char* c = event->detail; *c; c++){
+                if(*c == '"' || *c == '\\'){
+                    fprintf(file, "\\%c", *c);
+                }
+                else if((unsigned char)*c >= 0x20){
+                    fputc(*c, file);
+                }
+            }
+            fprintf(file, "\"}");
+        }
+        fprintf(file, "}");
+    }
+    fprintf(file, "\n],\"displayTimeUnit\":\"ns\"}\n");
+    fclose(file);
+}